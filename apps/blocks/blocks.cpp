@@ -82,6 +82,14 @@ extern "C" void main(int argc, char** argv) {
   int ball_dir = 0; // degree
   int ball_dx = 0, ball_dy = 0;
 
+  // フレームごとに仕掛け直さず，周期タイマーで一定の間隔を保つ
+  auto [ frame_timer, err_timer ]
+    = SyscallArmTimer(TIMER_ONESHOT_REL, 1, 1000 / kFrameRate, 1000 / kFrameRate);
+  if (err_timer) {
+    SyscallCloseWindow(layer_id);
+    exit(err_timer);
+  }
+
   for (;;) {
     // 画面を一旦クリアし，各種オブジェクトを描画
     SyscallWinFillRectangle(layer_id | LAYER_NO_REDRAW,
@@ -94,15 +102,6 @@ extern "C" void main(int argc, char** argv) {
     }
     SyscallWinRedraw(layer_id);
 
-    static unsigned long prev_timeout = 0;
-    if (prev_timeout == 0) {
-      const auto timeout = SyscallCreateTimer(TIMER_ONESHOT_REL, 1, 1000 / kFrameRate);
-      prev_timeout = timeout.value;
-    } else {
-      prev_timeout += 1000 / kFrameRate;
-      SyscallCreateTimer(TIMER_ONESHOT_ABS, 1, prev_timeout);
-    }
-
     AppEvent events[1];
     for (;;) {
       SyscallReadEvent(events, 1);
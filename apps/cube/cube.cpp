@@ -1,5 +1,6 @@
 #include <array>
 #include <cmath>
+#include <cstdio>
 #include <cstdlib>
 #include "../syscall.h"
 
@@ -17,7 +18,7 @@ struct Vector2D {
 
 void DrawObj(uint64_t layer_id);
 void DrawSurface(uint64_t layer_id, int sur);
-bool Sleep(unsigned long ms);
+bool WaitFrame();
 
 const int kScale = 50, kMargin = 10;
 const int kCanvasSize = 3 * kScale + kMargin;
@@ -36,6 +37,10 @@ array<Vector3D<double>, kCube.size()> vert;
 array<double, kSurface.size()> centerz4;
 array<Vector2D<int>, kCube.size()> scr;
 
+// フレームの時刻が期限からどれだけ遅れたか（ナノ秒）
+const unsigned long kFrameMs = 50;
+uint64_t lat_min = ~0ul, lat_max, lat_sum, num_frames, num_overruns;
+
 extern "C" void main(int argc, char** argv) {
   auto [layer_id, err_openwin]
     = SyscallOpenWindow(kCanvasSize + 8, kCanvasSize + 28, 10, 10, "cube");
@@ -43,6 +48,11 @@ extern "C" void main(int argc, char** argv) {
     exit(err_openwin);
   }
 
+  // 周期タイマーは期限の絶対時刻で発火するので，描画にかかった時間でずれない
+  if (auto [ handle, err ] = SyscallArmTimer(TIMER_ONESHOT_REL, 1, kFrameMs, kFrameMs); err) {
+    exit(err);
+  }
+
   int thx = 0, thy = 0, thz = 0;
   const double to_rad = 3.14159265358979323 / 0x8000;
   for (;;) {
@@ -76,12 +86,18 @@ extern "C" void main(int argc, char** argv) {
                             4, 24, kCanvasSize, kCanvasSize, 0);
     DrawObj(layer_id | LAYER_NO_REDRAW);
     SyscallWinRedraw(layer_id);
-    if (Sleep(50)) {
+    if (WaitFrame()) {
       break;
     }
   }
 
   SyscallCloseWindow(layer_id);
+  if (num_frames > 0) {
+    printf("cube: %lu frames, %lu overruns\n", num_frames, num_overruns);
+    printf("frame latency us: min %lu avg %lu max %lu (jitter %lu)\n",
+           lat_min / 1000, lat_sum / num_frames / 1000, lat_max / 1000,
+           (lat_max - lat_min) / 1000);
+  }
   exit(0);
 }
 
@@ -151,20 +167,19 @@ void DrawSurface(uint64_t layer_id, int sur) {
   }
 }
 
-bool Sleep(unsigned long ms) {
-  static unsigned long prev_timeout = 0;
-  if (prev_timeout == 0) {
-    const auto timeout = SyscallCreateTimer(TIMER_ONESHOT_REL, 1, ms);
-    prev_timeout = timeout.value;
-  } else {
-    prev_timeout += ms;
-    SyscallCreateTimer(TIMER_ONESHOT_ABS, 1, prev_timeout);
-  }
-
+bool WaitFrame() {
   AppEvent events[1];
   for (;;) {
     SyscallReadEvent(events, 1);
     if (events[0].type == AppEvent::kTimerTimeout) {
+      const uint64_t expected = events[0].arg.timer.timeout * 1'000'000;
+      const uint64_t now = TimePageNanos();
+      const uint64_t lat = now > expected ? now - expected : 0;
+      lat_min = lat < lat_min ? lat : lat_min;
+      lat_max = lat > lat_max ? lat : lat_max;
+      lat_sum += lat;
+      ++num_frames;
+      num_overruns += events[0].arg.timer.overrun;
       return false;
     } else if (events[0].type == AppEvent::kQuit) {
       return true;
@@ -0,0 +1,75 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include "../syscall.h"
+
+bool WaitTimeout() {
+  AppEvent events[1];
+  for (;;) {
+    SyscallReadEvent(events, 1);
+    if (events[0].type == AppEvent::kTimerTimeout) {
+      return false;
+    } else if (events[0].type == AppEvent::kQuit) {
+      return true;
+    }
+  }
+}
+
+// usage: jitter <rr|fair|edf> [period_ms] [count]
+//        jitter spin [sec]
+extern "C" void main(int argc, char** argv) {
+  if (argc < 2) {
+    printf("Usage: jitter <rr|fair|edf> [period_ms] [count]\n"
+           "       jitter spin [sec]\n");
+    exit(1);
+  }
+
+  const auto timer_freq = TimePageTimerFreq();
+  if (strcmp(argv[1], "spin") == 0) {
+    const unsigned long sec = argc >= 3 ? atoi(argv[2]) : 10;
+    const auto end = TimePageTick() + sec * timer_freq;
+    while (TimePageTick() < end);
+    exit(0);
+  }
+
+  const unsigned long period_ms = argc >= 3 ? atoi(argv[2]) : 50;
+  const int count = argc >= 4 ? atoi(argv[3]) : 100;
+
+  SyscallResult res{0, 0};
+  if (strcmp(argv[1], "fair") == 0) {
+    res = SyscallSetScheduler(SCHED_CLASS_FAIR, 1024, 0);
+  } else if (strcmp(argv[1], "edf") == 0) {
+    res = SyscallSetScheduler(SCHED_CLASS_DEADLINE, period_ms, period_ms / 4);
+  }
+  if (res.error) {
+    printf("SetScheduler failed: %s\n", strerror(res.error));
+    exit(1);
+  }
+
+  // タイマーの時刻（ミリ秒）と時刻ページの時刻は同じ時点を 0 として数えている
+  uint64_t lat_min = ~0ul, lat_max = 0, lat_sum = 0;
+  int n = 0;
+  const unsigned long start_ms = TimePageNanos() / 1'000'000 + 1;
+  for (n = 0; n < count; ++n) {
+    const unsigned long release_ms = start_ms + (n + 1) * period_ms;
+    SyscallCreateTimer(TIMER_ONESHOT_ABS, 1, release_ms);
+    if (WaitTimeout()) {
+      break;
+    }
+    const uint64_t expected = release_ms * 1'000'000;
+    const uint64_t now = TimePageNanos();
+    const uint64_t lat = now > expected ? now - expected : 0;
+    lat_min = lat < lat_min ? lat : lat_min;
+    lat_max = lat > lat_max ? lat : lat_max;
+    lat_sum += lat;
+  }
+
+  if (n == 0) {
+    exit(0);
+  }
+  printf("%s: %d wakeups, period %lu ms\n", argv[1], n, period_ms);
+  printf("latency us: min %lu avg %lu max %lu (jitter %lu)\n",
+         lat_min / 1000, lat_sum / n / 1000, lat_max / 1000,
+         (lat_max - lat_min) / 1000);
+  exit(0);
+}
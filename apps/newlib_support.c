@@ -1,4 +1,5 @@
 #include <errno.h>
+#include <reent.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <stdint.h>
@@ -7,6 +8,98 @@
 
 #include "syscall.h"
 
+/* システムコールを使わずにスレッドを見分けるため，CreateThread で作った
+ * スレッドのスタックの上端を覚えておく．スタックの大きさはカーネルが確保する大きさ．
+ * 表に空きがなければそのスレッドだけ GetThreadID で見分ける．
+ */
+#define THREAD_STACK_SIZE (16 * 4096)
+#define MAX_THREADS 64
+#define MAIN_STACK_TOP 0xfffffffffffff000ul
+static volatile uintptr_t thread_stack_tops[MAX_THREADS];
+
+/* ThreadStart から呼ばれ，スレッドの本体 func(arg) を実行する */
+int ThreadMain(void* arg, int (*func)(void*), uintptr_t stack_top) {
+  volatile uintptr_t* slot = NULL;
+  for (int i = 0; i < MAX_THREADS && !slot; ++i) {
+    uintptr_t expected = 0;
+    if (__atomic_compare_exchange_n(&thread_stack_tops[i], &expected, stack_top, 0,
+                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+      slot = &thread_stack_tops[i];
+    }
+  }
+  const int ret = func(arg);
+  if (slot) {
+    *slot = 0;
+  }
+  return ret;
+}
+
+/* 呼び出したスレッドの識別子．メインスレッドは 0，ほかはスタックの上端か
+ * （表に載っていなければ）スレッド ID となり，互いに重ならない */
+static uint64_t CurrentThreadKey(void) {
+  const uintptr_t sp = (uintptr_t)__builtin_frame_address(0);
+  if (MAIN_STACK_TOP - THREAD_STACK_SIZE <= sp && sp < MAIN_STACK_TOP) {
+    return 0;
+  }
+  for (int i = 0; i < MAX_THREADS; ++i) {
+    const uintptr_t top = thread_stack_tops[i];
+    if (top - THREAD_STACK_SIZE <= sp && sp < top) {
+      return top;
+    }
+  }
+  return SyscallGetThreadID().value;
+}
+
+/* malloc は複数のスレッドから呼ばれうるので，futex を使ったロックで守る．
+ * newlib の malloc はロックを取ったまま再入するので，持ち主なら深さだけを数える．
+ * ロックの値は 0: 空き，1: 保持，2: 保持かつ待ちあり
+ *
+ * 持ち主と深さは保持していないスレッドも読むので __atomic で読み書きする．
+ * 持ち主は解放前に NO_OWNER へ戻すので，持ち主として自分が見えるのは
+ * 自分が保持している間だけとなる．
+ */
+static volatile uint32_t malloc_lock_word;
+#define NO_OWNER UINT64_MAX  // CurrentThreadKey が返さない値
+static uint64_t malloc_lock_owner = NO_OWNER;
+static int malloc_lock_depth;
+
+void __malloc_lock(struct _reent* r) {
+  // 空いていればそのまま取る．取れなければ自分が持ち主（再入）かを確かめる
+  uint32_t c = 0;
+  const int acquired = __atomic_compare_exchange_n(
+      &malloc_lock_word, &c, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+  const uint64_t self = CurrentThreadKey();
+  if (!acquired) {
+    const int depth = __atomic_load_n(&malloc_lock_depth, __ATOMIC_RELAXED);
+    if (__atomic_load_n(&malloc_lock_owner, __ATOMIC_RELAXED) == self && depth > 0) {
+      __atomic_store_n(&malloc_lock_depth, depth + 1, __ATOMIC_RELAXED);
+      return;
+    }
+    if (c != 2) {
+      c = __atomic_exchange_n(&malloc_lock_word, 2, __ATOMIC_ACQUIRE);
+    }
+    while (c != 0) {
+      SyscallFutexWait(&malloc_lock_word, 2);
+      c = __atomic_exchange_n(&malloc_lock_word, 2, __ATOMIC_ACQUIRE);
+    }
+  }
+  __atomic_store_n(&malloc_lock_depth, 1, __ATOMIC_RELAXED);
+  __atomic_store_n(&malloc_lock_owner, self, __ATOMIC_RELAXED);
+}
+
+void __malloc_unlock(struct _reent* r) {
+  const int depth = __atomic_load_n(&malloc_lock_depth, __ATOMIC_RELAXED) - 1;
+  __atomic_store_n(&malloc_lock_depth, depth, __ATOMIC_RELAXED);
+  if (depth > 0) {
+    return;
+  }
+  // 解放した直後に別のスレッドが取っても，自分が持ち主に見えないよう先に消す
+  __atomic_store_n(&malloc_lock_owner, NO_OWNER, __ATOMIC_RELAXED);
+  if (__atomic_exchange_n(&malloc_lock_word, 0, __ATOMIC_RELEASE) == 2) {
+    SyscallFutexWake(&malloc_lock_word, 1);
+  }
+}
+
 int close(int fd) {
   errno = EBADF;
   return -1;
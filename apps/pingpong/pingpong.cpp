@@ -0,0 +1,106 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include "../syscall.h"
+
+uint64_t ReadTSC() {
+  uint32_t lo, hi;
+  __asm__ volatile("rdtsc" : "=a"(lo), "=d"(hi));
+  return (static_cast<uint64_t>(hi) << 32) | lo;
+}
+
+// TSC の周波数をカーネルの時計と 10ms 比べて求める
+uint64_t TSCPerMicrosecond() {
+  const auto ns_start = TimePageNanos();
+  const auto tsc_start = ReadTSC();
+  uint64_t ns;
+  while ((ns = TimePageNanos()) < ns_start + 10'000'000);
+  return (ReadTSC() - tsc_start) * 1000 / (ns - ns_start);
+}
+
+// futex: 交互に相手を起こして自分は眠る（自発的な切り替え）
+volatile uint32_t turn;
+int num_rounds;
+
+int FutexPlayer(void* arg) {
+  const uint32_t self = reinterpret_cast<uint64_t>(arg);
+  for (int i = 0; i < num_rounds; ++i) {
+    while (turn != self) {
+      SyscallFutexWait(&turn, 1 - self);
+    }
+    turn = 1 - self;
+    SyscallFutexWake(&turn, 1);
+  }
+  return 0;
+}
+
+// preempt: 2 つのスレッドが回り続け，タイマー割り込みで切り替わるまでの空白を測る
+volatile uint64_t last_tsc[2];
+volatile int owner;
+volatile bool stop;
+uint64_t gap_min = ~0ul, gap_sum, gap_count;
+
+int SpinPlayer(void* arg) {
+  const int self = reinterpret_cast<uint64_t>(arg);
+  while (!stop) {
+    const uint64_t now = ReadTSC();
+    if (owner != self) {
+      const uint64_t gap = now - last_tsc[1 - self];
+      gap_min = gap < gap_min ? gap : gap_min;
+      gap_sum += gap;
+      ++gap_count;
+      owner = self;
+    }
+    last_tsc[self] = now;
+  }
+  return 0;
+}
+
+// usage: pingpong futex [rounds]
+//        pingpong preempt [sec]
+extern "C" void main(int argc, char** argv) {
+  if (argc < 2) {
+    printf("Usage: pingpong futex [rounds]\n"
+           "       pingpong preempt [sec]\n");
+    exit(1);
+  }
+
+  const uint64_t tsc_per_us = TSCPerMicrosecond();
+
+  if (strcmp(argv[1], "futex") == 0) {
+    num_rounds = argc >= 3 ? atoi(argv[2]) : 10000;
+    const auto start = ReadTSC();
+    auto t0 = SyscallCreateThread(FutexPlayer, reinterpret_cast<void*>(0));
+    auto t1 = SyscallCreateThread(FutexPlayer, reinterpret_cast<void*>(1));
+    SyscallJoinThread(t0.value);
+    SyscallJoinThread(t1.value);
+    const auto cycles = ReadTSC() - start;
+    printf("%d round trips, %lu ns per switch\n", num_rounds,
+           cycles * 1000 / tsc_per_us / (2 * num_rounds));
+  } else if (strcmp(argv[1], "preempt") == 0) {
+    const unsigned long sec = argc >= 3 ? atoi(argv[2]) : 5;
+    auto t0 = SyscallCreateThread(SpinPlayer, reinterpret_cast<void*>(0));
+    auto t1 = SyscallCreateThread(SpinPlayer, reinterpret_cast<void*>(1));
+    // 計測を乱さないよう，メインスレッドはタイマーで眠って待つ
+    SyscallCreateTimer(TIMER_ONESHOT_REL, 1, sec * 1000);
+    AppEvent events[1];
+    do {
+      SyscallReadEvent(events, 1);
+    } while (events[0].type != AppEvent::kTimerTimeout &&
+             events[0].type != AppEvent::kQuit);
+    stop = true;
+    SyscallJoinThread(t0.value);
+    SyscallJoinThread(t1.value);
+    if (gap_count == 0) {
+      printf("no preemption observed\n");
+      exit(1);
+    }
+    // 最小値は割り込みとタスク切り替えだけの時間に近い
+    printf("%lu switches, min %lu ns, avg %lu ns\n", gap_count,
+           gap_min * 1000 / tsc_per_us, gap_sum / gap_count * 1000 / tsc_per_us);
+  } else {
+    printf("unknown mode: %s\n", argv[1]);
+    exit(1);
+  }
+  exit(0);
+}
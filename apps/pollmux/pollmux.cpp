@@ -0,0 +1,63 @@
+#include <cstdio>
+#include <cstdlib>
+#include <unistd.h>
+#include "../syscall.h"
+
+// 標準入力，ウィンドウイベント，タイムアウトを 1 つの Poll で待ち合わせる．
+// 入力した文字をウィンドウに表示し，^D かウィンドウを閉じると終了する．
+extern "C" void main(int argc, char** argv) {
+  const int timeout_ms = argc >= 2 ? atoi(argv[1]) : 1000;
+
+  auto [layer_id, err_openwin]
+    = SyscallOpenWindow(200, 60, 10, 10, "pollmux");
+  if (err_openwin) {
+    exit(err_openwin);
+  }
+
+  PollFD fds[2] = {
+    {0, kPollIn, 0},
+    {POLL_EVENT_FD, kPollIn, 0},
+  };
+  char line[24] = {};
+  int line_len = 0, num_timeouts = 0;
+  bool quit = false;
+
+  while (!quit) {
+    auto [ n, err ] = SyscallPoll(fds, 2, timeout_ms);
+    if (err) {
+      printf("Poll failed: %d\n", err);
+      break;
+    }
+
+    if (n == 0) {
+      ++num_timeouts;
+    } else if (fds[0].revents & kPollIn) {
+      // キー入力は標準入力とウィンドウイベントの両方で報告されるので，
+      // 読んだら Poll し直す
+      char c;
+      if (read(0, &c, 1) <= 0) {
+        break;
+      }
+      if (line_len == sizeof(line) - 1) {
+        line_len = 0;
+      }
+      line[line_len++] = c;
+      line[line_len] = '\0';
+    } else if (fds[1].revents & kPollIn) {
+      AppEvent event;
+      SyscallReadEvent(&event, 1);
+      quit = event.type == AppEvent::kQuit;
+    } else {
+      break; // kPollHup や kPollNval
+    }
+
+    char s[32];
+    snprintf(s, sizeof(s), "timeouts: %d", num_timeouts);
+    SyscallWinFillRectangle(layer_id | LAYER_NO_REDRAW, 4, 24, 192, 32, 0xffffff);
+    SyscallWinWriteString(layer_id | LAYER_NO_REDRAW, 4, 24, 0x000000, s);
+    SyscallWinWriteString(layer_id, 4, 40, 0x000000, line);
+  }
+
+  SyscallCloseWindow(layer_id);
+  exit(0);
+}
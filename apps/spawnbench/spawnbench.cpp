@@ -0,0 +1,41 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include "../syscall.h"
+
+// 起動から終了までの平均時間（ナノ秒）を返す．失敗したら 0
+uint64_t Measure(const char* const* app_argv, int flags, int count) {
+  uint64_t sum = 0;
+  for (int i = 0; i < count; ++i) {
+    const auto start = TimePageNanos();
+    auto res = SyscallSpawn(app_argv, flags);
+    if (res.error) {
+      printf("Spawn failed: %s\n", strerror(res.error));
+      return 0;
+    }
+    SyscallWaitTask(res.value);
+    sum += TimePageNanos() - start;
+  }
+  return sum / count;
+}
+
+// usage: spawnbench [count] [app [args...]]
+extern "C" void main(int argc, char** argv) {
+  const int count = argc >= 2 ? atoi(argv[1]) : 20;
+  const char* default_argv[] = {"rpn", "1", "2", "+", nullptr};
+  const char* const* app_argv = argc >= 3 ? argv + 2 : default_argv;
+  if (count <= 0) {
+    printf("Usage: spawnbench [count] [app [args...]]\n");
+    exit(1);
+  }
+
+  const auto spawn = Measure(app_argv, 0, count);
+  const auto terminal = Measure(app_argv, SPAWN_VIA_TERMINAL, count);
+  if (spawn == 0 || terminal == 0) {
+    exit(1);
+  }
+  printf("%s x %d\n", app_argv[0], count);
+  printf("spawn    : %lu us\n", spawn / 1000);
+  printf("terminal : %lu us\n", terminal / 1000);
+  exit(0);
+}
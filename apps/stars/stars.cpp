@@ -19,7 +19,8 @@ extern "C" void main(int argc, char** argv) {
     num_stars = atoi(argv[1]);
   }
 
-  auto [tick_start, timer_freq] = SyscallGetCurrentTick();
+  const auto tick_start = TimePageTick();
+  const auto timer_freq = TimePageTimerFreq();
 
   std::default_random_engine rand_engine;
   std::uniform_int_distribution x_dist(0, kWidth - 2), y_dist(0, kHeight - 2);
@@ -31,10 +32,10 @@ extern "C" void main(int argc, char** argv) {
   }
   SyscallWinRedraw(layer_id);
 
-  auto tick_end = SyscallGetCurrentTick();
+  const auto tick_end = TimePageTick();
   printf("%d stars in %lu ms.\n",
          num_stars,
-         (tick_end.value - tick_start) * 1000 / timer_freq);
+         (tick_end - tick_start) * 1000 / timer_freq);
 
   exit(0);
 }
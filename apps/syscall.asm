@@ -26,3 +26,38 @@ define_syscall OpenFile,         0x8000000c
 define_syscall ReadFile,         0x8000000d
 define_syscall DemandPages,      0x8000000e
 define_syscall MapFile,          0x8000000f
+define_syscall SetScheduler,     0x80000010
+define_syscall GetTaskStats,     0x80000011
+define_syscall FutexWait,        0x80000012
+define_syscall FutexWake,        0x80000013
+define_syscall ExitThread,       0x80000015
+define_syscall JoinThread,       0x80000016
+define_syscall GetThreadID,      0x80000017
+define_syscall Spawn,            0x80000018
+define_syscall WaitTask,         0x80000019
+define_syscall Poll,             0x8000001a
+define_syscall GetTimeNanos,     0x8000001b
+define_syscall ArmTimer,         0x8000001c
+define_syscall ModifyTimer,      0x8000001d
+define_syscall CancelTimer,      0x8000001e
+
+global SyscallCreateThread
+SyscallCreateThread:  ; struct SyscallResult SyscallCreateThread(
+                      ;     int (*func)(void*), void* arg);
+    mov rdx, rsi  ; arg
+    mov rsi, rdi  ; func
+    mov rdi, ThreadStart
+    mov rax, 0x80000014
+    mov r10, rcx
+    syscall
+    ret
+
+extern ThreadMain
+ThreadStart:  ; 新しいスレッドはここから始まる．スタックには func, arg が積まれている
+    pop rsi  ; func
+    pop rdi  ; arg
+    mov rdx, rsp  ; スタックの上端
+    call ThreadMain  ; int ThreadMain(void* arg, int (*func)(void*), uintptr_t stack_top)
+    mov edi, eax
+    call SyscallExitThread
+    ; ここには戻らない
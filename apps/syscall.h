@@ -10,6 +10,9 @@ extern "C" {
 
 #include "../kernel/logger.hpp"
 #include "../kernel/app_event.hpp"
+#include "../kernel/task_stat.hpp"
+#include "../kernel/poll.hpp"
+#include "../kernel/time_page.hpp"
 
 struct SyscallResult {
   uint64_t value;
@@ -44,6 +47,50 @@ struct SyscallResult SyscallReadFile(int fd, void* buf, size_t count);
 struct SyscallResult SyscallDemandPages(size_t num_pages, int flags);
 struct SyscallResult SyscallMapFile(int fd, size_t* file_size, int flags);
 
+#define SCHED_CLASS_RR       0
+#define SCHED_CLASS_FAIR     1 // param1: weight (default 1024)
+#define SCHED_CLASS_DEADLINE 2 // param1: period_ms, param2: budget_ms
+struct SyscallResult SyscallSetScheduler(
+    unsigned int sched_class, unsigned long param1, unsigned long param2);
+struct SyscallResult SyscallGetTaskStats(struct TaskStat* stats, size_t len);
+
+// *addr == expected の間だけ眠る．値が異なれば error = EAGAIN
+struct SyscallResult SyscallFutexWait(const volatile uint32_t* addr, uint32_t expected);
+// addr で待っているタスクを最大 num 個起こす．value は起こした数
+struct SyscallResult SyscallFutexWake(const volatile uint32_t* addr, int num);
+
+// 同じアドレス空間で func(arg) を実行するスレッドを作る．value はスレッド ID
+struct SyscallResult SyscallCreateThread(int (*func)(void*), void* arg);
+// 呼び出したスレッドだけを終了する．func から戻るのと同じ
+struct SyscallResult SyscallExitThread(int exit_code);
+// スレッドの終了を待つ．value は func の戻り値
+struct SyscallResult SyscallJoinThread(uint64_t thread_id);
+struct SyscallResult SyscallGetThreadID();
+
+#define SPAWN_VIA_TERMINAL 1 // 比較用：画面を持たないターミナルを介して起動する
+// argv（NULL 終端）のアプリを起動する．標準入出力は引き継ぐ．value はタスク ID
+struct SyscallResult SyscallSpawn(const char* const* argv, int flags);
+// Spawn で起動したタスクの終了を待つ．value は終了コード
+struct SyscallResult SyscallWaitTask(uint64_t task_id);
+
+// fds のいずれかが events の状態になるまで最大 timeout_ms 眠る（負なら無期限）．
+// fd に POLL_EVENT_FD を指定するとウィンドウイベントを待つ．value は revents が 0 でない数
+struct SyscallResult SyscallPoll(struct PollFD* fds, size_t nfds, int timeout_ms);
+// 起動してからの経過時間（ナノ秒）を value に返す．TSC を基にしており 1 マイクロ秒より細かい．
+// 同じ値は時刻ページの TimePageNanos() でもシステムコールなしに得られる
+struct SyscallResult SyscallGetTimeNanos();
+
+// タイマーを作り，value にハンドルを返す．type は CreateTimer と同じ．
+// period_ms が 0 でなければ，timeout_ms + period_ms * n の時刻に発火し続ける．
+// 発火が遅れて飛ばした期限の数は AppEvent の timer.overrun に入る
+struct SyscallResult SyscallArmTimer(
+    unsigned int type, int timer_value, unsigned long timeout_ms, unsigned long period_ms);
+// ArmTimer で作ったタイマーの期限と周期を変える．発火済みの単発タイマーなら ENOENT
+struct SyscallResult SyscallModifyTimer(uint64_t handle,
+    unsigned int type, int timer_value, unsigned long timeout_ms, unsigned long period_ms);
+// タイマーを取り消す．発火済みの単発タイマーや取り消し済みなら ENOENT
+struct SyscallResult SyscallCancelTimer(uint64_t handle);
+
 #ifdef __cplusplus
 } // extern "C"
 #endif
@@ -0,0 +1,45 @@
+#include <cstdio>
+#include <cstdlib>
+#include "../syscall.h"
+
+uint64_t ReadTSC() {
+  uint32_t lo, hi;
+  __asm__ volatile("rdtsc" : "=a"(lo), "=d"(hi));
+  return (static_cast<uint64_t>(hi) << 32) | lo;
+}
+
+template <class F>
+void Measure(const char* name, int count, F f) {
+  uint64_t min_cycles = ~uint64_t{0};
+  const auto start = ReadTSC();
+  for (int i = 0; i < count; ++i) {
+    const auto t0 = ReadTSC();
+    f();
+    const auto t = ReadTSC() - t0;
+    if (t < min_cycles) {
+      min_cycles = t;
+    }
+  }
+  const auto total = ReadTSC() - start;
+
+  printf("%s x %d\n", name, count);
+  printf("avg : %lu cycles\n", total / count);
+  printf("min : %lu cycles\n", min_cycles);
+}
+
+// usage: syscallbench [count]
+// ほぼ何もしないシステムコール（GetThreadID）の往復にかかるサイクル数を測る．
+// 時刻の取得についても，システムコールと時刻ページの読み出しを比べる
+extern "C" void main(int argc, char** argv) {
+  const int count = argc >= 2 ? atoi(argv[1]) : 100000;
+  if (count <= 0) {
+    printf("Usage: syscallbench [count]\n");
+    exit(1);
+  }
+
+  Measure("GetThreadID", count, [] { SyscallGetThreadID(); });
+  Measure("GetTimeNanos", count, [] { SyscallGetTimeNanos(); });
+  volatile uint64_t sink;
+  Measure("TimePageNanos", count, [&sink] { sink = TimePageNanos(); });
+  exit(0);
+}
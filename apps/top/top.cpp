@@ -0,0 +1,89 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include "../syscall.h"
+
+static const int kMaxTasks = 16;
+static const int kColumns = 64, kRows = kMaxTasks + 1;
+static const int kWidth = 8 * kColumns, kHeight = 16 * kRows;
+
+TaskStat prev_stats[kMaxTasks], stats[kMaxTasks];
+int num_prev_stats = 0;
+
+const TaskStat* FindPrev(uint64_t id) {
+  for (int i = 0; i < num_prev_stats; ++i) {
+    if (prev_stats[i].id == id) {
+      return &prev_stats[i];
+    }
+  }
+  return nullptr;
+}
+
+void Draw(uint64_t layer_id) {
+  const int n = SyscallGetTaskStats(stats, kMaxTasks).value;
+
+  uint64_t total_cycles = 0;
+  for (int i = 0; i < n; ++i) {
+    auto prev = FindPrev(stats[i].id);
+    total_cycles += stats[i].cpu_cycles - (prev ? prev->cpu_cycles : 0);
+  }
+  if (total_cycles == 0) {
+    total_cycles = 1;
+  }
+
+  SyscallWinFillRectangle(layer_id | LAYER_NO_REDRAW,
+                          4, 24, kWidth, kHeight, 0x000000);
+  SyscallWinWriteString(layer_id | LAYER_NO_REDRAW, 4, 24, 0xffffff,
+      "  ID  CPU%    VSW    ISW  DEMAND  FILE   COW  SYSCALL  STACK");
+
+  char s[kColumns + 1];
+  for (int i = 0; i < n; ++i) {
+    auto prev = FindPrev(stats[i].id);
+    const auto cycles = stats[i].cpu_cycles - (prev ? prev->cpu_cycles : 0);
+    snprintf(s, sizeof(s), "%4lu %5lu %6lu %6lu %7lu %5lu %5lu %8lu %6lu",
+             stats[i].id, cycles * 100 / total_cycles,
+             stats[i].voluntary_switches, stats[i].involuntary_switches,
+             stats[i].demand_faults, stats[i].file_faults, stats[i].cow_faults,
+             stats[i].syscalls, stats[i].peak_stack_bytes);
+    SyscallWinWriteString(layer_id | LAYER_NO_REDRAW,
+                          4, 24 + 16 * (i + 1), 0xffffff, s);
+  }
+  SyscallWinRedraw(layer_id);
+
+  memcpy(prev_stats, stats, sizeof(stats[0]) * n);
+  num_prev_stats = n;
+}
+
+extern "C" void main(int argc, char** argv) {
+  unsigned long interval_ms = 1000;
+  if (argc >= 2) {
+    interval_ms = atoi(argv[1]);
+  }
+
+  auto [layer_id, err_openwin]
+    = SyscallOpenWindow(kWidth + 8, kHeight + 28, 10, 10, "top");
+  if (err_openwin) {
+    exit(err_openwin);
+  }
+
+  Draw(layer_id);
+  SyscallCreateTimer(TIMER_ONESHOT_REL, 1, interval_ms);
+
+  AppEvent events[1];
+  while (true) {
+    auto [ n, err ] = SyscallReadEvent(events, 1);
+    if (err) {
+      printf("ReadEvent failed: %s\n", strerror(err));
+      break;
+    }
+    if (events[0].type == AppEvent::kQuit) {
+      break;
+    } else if (events[0].type == AppEvent::kTimerTimeout) {
+      Draw(layer_id);
+      SyscallCreateTimer(TIMER_ONESHOT_REL, 1, interval_ms);
+    }
+  }
+
+  SyscallCloseWindow(layer_id);
+  exit(0);
+}
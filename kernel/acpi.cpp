@@ -66,7 +66,16 @@ size_t XSDT::Count() const {
   return (this->header.length - sizeof(DescriptionHeader)) / sizeof(uint64_t);
 }
 
+const MCFGAllocation& MCFG::operator[](size_t i) const {
+  return reinterpret_cast<const MCFGAllocation*>(this + 1)[i];
+}
+
+size_t MCFG::Count() const {
+  return (this->header.length - sizeof(MCFG)) / sizeof(MCFGAllocation);
+}
+
 const FADT* fadt;
+const MCFG* mcfg;
 
 void WaitMilliseconds(unsigned long msec) {
   const bool pm_timer_32 = (fadt->flags >> 8) & 1;
@@ -95,11 +104,14 @@ void Initialize(const RSDP& rsdp) {
   }
 
   fadt = nullptr;
+  mcfg = nullptr;
   for (int i = 0; i < xsdt.Count(); ++i) {
     const auto& entry = xsdt[i];
-    if (entry.IsValid("FACP")) { // FACP is the signature of FADT
+    if (strncmp(entry.signature, "FACP", 4) == 0 && entry.IsValid("FACP")) {
+      // FACP is the signature of FADT
       fadt = reinterpret_cast<const FADT*>(&entry);
-      break;
+    } else if (strncmp(entry.signature, "MCFG", 4) == 0 && entry.IsValid("MCFG")) {
+      mcfg = reinterpret_cast<const MCFG*>(&entry);
     }
   }
 
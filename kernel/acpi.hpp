@@ -56,7 +56,27 @@ struct FADT {
   char reserved3[276 - 116];
 } __attribute__((packed));
 
+/** @brief MCFG の 1 エントリ。PCI セグメントのバス範囲と、その ECAM 領域の物理アドレス */
+struct MCFGAllocation {
+  uint64_t base_address;  // start_bus の ECAM 領域の先頭
+  uint16_t segment;
+  uint8_t start_bus;
+  uint8_t end_bus;
+  uint32_t reserved;
+} __attribute__((packed));
+
+/** @brief PCI Express のメモリマップドコンフィギュレーション空間（ECAM）を示すテーブル */
+struct MCFG {
+  DescriptionHeader header;
+  char reserved[8];
+
+  const MCFGAllocation& operator[](size_t i) const;
+  size_t Count() const;
+} __attribute__((packed));
+
 extern const FADT* fadt;
+/** @brief MCFG。ファームウェアが提供していなければ nullptr */
+extern const MCFG* mcfg;
 const int kPMTimerFreq = 3579545;
 
 void WaitMilliseconds(unsigned long msec);
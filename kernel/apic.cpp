@@ -0,0 +1,64 @@
+#include "apic.hpp"
+
+#include "asmfunc.h"
+#include "logger.hpp"
+#include "msr.hpp"
+
+namespace {
+  const uint64_t kXAPICBase = 0xfee00000;
+  const uint64_t kAPICBaseEnable = 1u << 11; // IA32_APIC_BASE の EN
+  const uint64_t kAPICBaseX2APIC = 1u << 10; // IA32_APIC_BASE の EXTD
+
+  bool x2apic = false;
+
+  volatile uint32_t& MMIORegister(LAPICRegister reg) {
+    return *reinterpret_cast<volatile uint32_t*>(kXAPICBase + static_cast<uint32_t>(reg));
+  }
+
+  /** @brief x2APIC ではオフセットを 16 で割って 0x800 を足した番号の MSR になる */
+  uint32_t MSRNumber(LAPICRegister reg) {
+    return 0x800 + (static_cast<uint32_t>(reg) >> 4);
+  }
+}
+
+void InitializeLAPIC() {
+  // CPUID.01H:ECX[21] が x2APIC の有無
+  uint32_t regs[4];
+  CPUID(1, 0, regs);
+  const bool supported = (regs[2] >> 21) & 1;
+
+  const uint64_t apic_base = ReadMSR(kIA32_APIC_BASE);
+  if (apic_base & kAPICBaseX2APIC) {
+    x2apic = true;
+  } else if (supported) {
+    // xAPIC から x2APIC へは EN を立てたまま EXTD を立てるだけで移れる
+    WriteMSR(kIA32_APIC_BASE, apic_base | kAPICBaseEnable | kAPICBaseX2APIC);
+    x2apic = true;
+  }
+
+  Log(kInfo, "lapic: %s mode, id %u\n", x2apic ? "x2APIC" : "xAPIC", LAPICID());
+}
+
+bool X2APICMode() {
+  return x2apic;
+}
+
+uint32_t ReadLAPIC(LAPICRegister reg) {
+  if (x2apic) {
+    return ReadMSR(MSRNumber(reg));
+  }
+  return MMIORegister(reg);
+}
+
+void WriteLAPIC(LAPICRegister reg, uint32_t value) {
+  if (x2apic) {
+    WriteMSR(MSRNumber(reg), value);
+    return;
+  }
+  MMIORegister(reg) = value;
+}
+
+uint32_t LAPICID() {
+  const uint32_t id = ReadLAPIC(LAPICRegister::kID);
+  return x2apic ? id : id >> 24;
+}
@@ -0,0 +1,37 @@
+/**
+ * @file apic.hpp
+ *
+ * Local APIC のレジスタへのアクセス．x2APIC が使えれば MSR で，使えなければ
+ * 0xfee00000 からの MMIO（xAPIC）でアクセスする．仮想マシンでは MMIO のたびに
+ * ハイパーバイザへトラップするが，x2APIC の MSR アクセスは安く済むことが多い．
+ */
+
+#pragma once
+
+#include <cstdint>
+
+/** @brief Local APIC のレジスタ．値は xAPIC の MMIO でのオフセット */
+enum class LAPICRegister : uint32_t {
+  kID           = 0x020,
+  kTPR          = 0x080,
+  kEOI          = 0x0b0,
+  kSVR          = 0x0f0,
+  kLVTTimer     = 0x320,
+  kInitialCount = 0x380,
+  kCurrentCount = 0x390,
+  kDivideConfig = 0x3e0,
+};
+
+/** @brief x2APIC が使えれば x2APIC モードにする．
+ *
+ * ファームウェアがすでに x2APIC モードにしていればそのまま使う．
+ * Local APIC に触る他の初期化（LAPIC タイマーや MSI の設定）より前に呼ぶ．
+ */
+void InitializeLAPIC();
+/** @brief x2APIC モードで動いていれば true */
+bool X2APICMode();
+
+uint32_t ReadLAPIC(LAPICRegister reg);
+void WriteLAPIC(LAPICRegister reg, uint32_t value);
+/** @brief この CPU の Local APIC ID．xAPIC では 8 ビット，x2APIC では 32 ビット */
+uint32_t LAPICID();
@@ -27,8 +27,10 @@ struct AppEvent {
     } mouse_button;
 
     struct {
-      unsigned long timeout;
+      unsigned long timeout;  // 期限（ミリ秒）
       int value;
+      unsigned long overrun;  // 周期タイマーで，発火できずに飛ばした回数
+      uint64_t handle;        // タイマーのハンドル（ArmTimer の戻り値）
     } timer;
 
     struct {
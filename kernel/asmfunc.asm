@@ -6,6 +6,12 @@
 bits 64
 section .text
 
+; percpu.hpp の PerCPU のメンバのオフセット
+%define PERCPU_CONTEXT    0x08
+%define PERCPU_KERNEL_RSP 0x10
+%define PERCPU_USER_RSP   0x18
+%define PERCPU_SYSCALLS   0x20
+
 global IoOut32  ; void IoOut32(uint16_t addr, uint32_t data);
 IoOut32:
     mov dx, di    ; dx = addr
@@ -160,12 +166,20 @@ RestoreContext:  ; void RestoreContext(void* task_context);
     ; コンテキストの復帰
     fxrstor [rdi + 0xc0]
 
+    ; CR3 とセグメントレジスタは値が変わるときだけ書き込む
+    ; GS はセレクタを書き込むと PerCPU を指す GS ベースが失われるので触らない
     mov rax, [rdi + 0x00]
+    mov rcx, cr3
+    cmp rax, rcx
+    je .cr3_done
     mov cr3, rax
+.cr3_done:
     mov rax, [rdi + 0x30]
+    mov cx, fs
+    cmp ax, cx
+    je .fs_done
     mov fs, ax
-    mov rax, [rdi + 0x38]
-    mov gs, ax
+.fs_done:
 
     mov rax, [rdi + 0x40]
     mov rbx, [rdi + 0x48]
@@ -184,6 +198,11 @@ RestoreContext:  ; void RestoreContext(void* task_context);
 
     mov rdi, [rdi + 0x60]
 
+    ; ユーザモードへ戻るときはアプリの GS ベースに戻す
+    test byte [rsp + 0x08], 3  ; CS の RPL
+    jz .iret
+    swapgs
+.iret:
     o64 iret
 
 global CallApp
@@ -196,80 +215,77 @@ CallApp:  ; int CallApp(int argc, char** argv, uint16_t ss,
     push r14
     push r15
     mov [r9], rsp ; OS 用のスタックポインタを保存
+    mov [gs:PERCPU_KERNEL_RSP], rsp
 
+    ; swapgs から iret までに割り込まれないよう，割り込みの許可は iret に任せる
+    cli
     push rdx  ; SS
     push r8   ; RSP
+    push 0x202  ; RFLAGS (IF = 1)
     add rdx, 8
     push rdx  ; CS
     push rcx  ; RIP
-    o64 retf
+    swapgs
+    o64 iret
     ; アプリケーションが終了してもここには来ない
 
 extern LAPICTimerOnInterrupt
-; void LAPICTimerOnInterrupt(const TaskContext& ctx_stack);
+; TaskContext* LAPICTimerOnInterrupt();
 
 global IntHandlerLAPICTimer
 IntHandlerLAPICTimer:  ; void IntHandlerLAPICTimer();
-    push rbp
-    mov rbp, rsp
-
-    ; スタック上に TaskContext 型の構造を構築する
-    sub rsp, 512
-    fxsave [rsp]
-    push r15
-    push r14
-    push r13
-    push r12
-    push r11
-    push r10
-    push r9
-    push r8
-    push qword [rbp]         ; RBP
-    push qword [rbp + 0x20]  ; RSP
-    push rsi
-    push rdi
-    push rdx
-    push rcx
-    push rbx
+    test byte [rsp + 0x08], 3  ; CS の RPL
+    jz .kernel
+    swapgs
+.kernel:
+    ; 実行中のタスクのコンテキストへ直接保存する
     push rax
+    mov rax, [gs:PERCPU_CONTEXT]
+
+    mov [rax + 0x48], rbx
+    mov [rax + 0x50], rcx
+    mov [rax + 0x58], rdx
+    mov [rax + 0x60], rdi
+    mov [rax + 0x68], rsi
+    mov [rax + 0x78], rbp
+    mov [rax + 0x80], r8
+    mov [rax + 0x88], r9
+    mov [rax + 0x90], r10
+    mov [rax + 0x98], r11
+    mov [rax + 0xa0], r12
+    mov [rax + 0xa8], r13
+    mov [rax + 0xb0], r14
+    mov [rax + 0xb8], r15
+    pop qword [rax + 0x40]  ; RAX
+
+    mov rcx, [rsp + 0x00]
+    mov [rax + 0x08], rcx   ; RIP
+    mov rcx, [rsp + 0x08]
+    mov [rax + 0x20], rcx   ; CS
+    mov rcx, [rsp + 0x10]
+    mov [rax + 0x10], rcx   ; RFLAGS
+    mov rcx, [rsp + 0x18]
+    mov [rax + 0x70], rcx   ; RSP
+    mov rcx, [rsp + 0x20]
+    mov [rax + 0x28], rcx   ; SS
 
-    mov ax, fs
-    mov bx, gs
     mov rcx, cr3
+    mov [rax + 0x00], rcx   ; CR3
+    mov rcx, fs
+    mov [rax + 0x30], rcx   ; FS
+    mov rcx, gs
+    mov [rax + 0x38], rcx   ; GS
 
-    push rbx                 ; GS
-    push rax                 ; FS
-    push qword [rbp + 0x28]  ; SS
-    push qword [rbp + 0x10]  ; CS
-    push rbp                 ; reserved1
-    push qword [rbp + 0x18]  ; RFLAGS
-    push qword [rbp + 0x08]  ; RIP
-    push rcx                 ; CR3
+    fxsave [rax + 0xc0]
 
-    mov rdi, rsp
+    mov rbp, rsp
+    and rsp, 0xfffffffffffffff0
     call LAPICTimerOnInterrupt
-
-    add rsp, 8*8  ; CR3 から GS までを無視
-    pop rax
-    pop rbx
-    pop rcx
-    pop rdx
-    pop rdi
-    pop rsi
-    add rsp, 16   ; RSP, RBP を無視
-    pop r8
-    pop r9
-    pop r10
-    pop r11
-    pop r12
-    pop r13
-    pop r14
-    pop r15
-    fxrstor [rsp]
-
     mov rsp, rbp
-    pop rbp
-    iretq
+
+    ; 切り替えないときは同じコンテキストを復帰する
+    mov rdi, rax
+    jmp RestoreContext
 
 global LoadTR
 LoadTR:  ; void LoadTR(uint16_t sel);
@@ -285,35 +301,27 @@ WriteMSR:  ; void WriteMSR(uint32_t msr, uint64_t value);
     wrmsr
     ret
 
-extern GetCurrentTaskOSStackPointer
 extern syscall_table
+extern SyscallCancelPoint
 global SyscallEntry
 SyscallEntry:  ; void SyscallEntry(void);
-    push rbp
+    ; IA32_FMASK により割り込み禁止の状態で入ってくる
+    swapgs
+    mov [gs:PERCPU_USER_RSP], rsp
+    mov rsp, [gs:PERCPU_KERNEL_RSP]  ; システムコールは OS 用スタックで実行する
+
+    push qword [gs:PERCPU_USER_RSP]  ; original RSP
     push rcx  ; original RIP
     push r11  ; original RFLAGS
-
     push rax  ; システムコール番号を保存
-
-    mov rcx, r10
-    and eax, 0x7fffffff
+    push rbp
     mov rbp, rsp
 
-    ; システムコールを OS 用スタックで実行するための準備
-    and rsp, 0xfffffffffffffff0
-    push rax
-    push rdx
-    cli
-    call GetCurrentTaskOSStackPointer
+    inc qword [gs:PERCPU_SYSCALLS]
     sti
-    mov rdx, [rsp + 0]  ; RDX
-    mov [rax - 16], rdx
-    mov rdx, [rsp + 8]  ; RAX
-    mov [rax - 8], rdx
 
-    lea rsp, [rax - 16]
-    pop rdx
-    pop rax
+    mov rcx, r10
+    and eax, 0x7fffffff
     and rsp, 0xfffffffffffffff0
 
     call [syscall_table + 8 * eax]
@@ -321,14 +329,35 @@ SyscallEntry:  ; void SyscallEntry(void);
     ; rax は戻り値用なので呼び出し側で保存しない
 
     mov rsp, rbp
+    pop rbp
 
     pop rsi  ; システムコール番号を復帰
-    cmp esi, 0x80000002
+    cmp esi, 0x80000002  ; Exit
     je  .exit
+    cmp esi, 0x80000015  ; ExitThread
+    je  .exit
+
+    ; swapgs から sysret までに割り込まれないようにする
+    cli
+
+    ; アプリが終了中なら，アプリへ戻らずにスレッドを終える
+    push rax
+    push rdx
+    push rbp
+    mov rbp, rsp
+    and rsp, 0xfffffffffffffff0
+    call SyscallCancelPoint
+    mov rsp, rbp
+    pop rbp
+    test rax, rax
+    jnz .cancel
+    pop rdx
+    pop rax
 
     pop r11
     pop rcx
-    pop rbp
+    pop rsp
+    swapgs
     o64 sysret
 
 .exit:
@@ -336,6 +365,12 @@ SyscallEntry:  ; void SyscallEntry(void);
     mov esi, edx
     jmp ExitApp
 
+.cancel:
+    sti
+    mov rdi, rax
+    mov esi, 128 + 9  ; SIGKILL
+    jmp ExitApp
+
 global ExitApp  ; void ExitApp(uint64_t rsp, int32_t ret_val);
 ExitApp:
     mov rsp, rdi
@@ -354,3 +389,32 @@ global InvalidateTLB  ; void InvalidateTLB(uint64_t addr);
 InvalidateTLB:
     invlpg [rdi]
     ret
+
+global ReadTSC  ; uint64_t ReadTSC();
+ReadTSC:
+    rdtsc
+    shl rdx, 32
+    or rax, rdx
+    ret
+
+global ReadMSR  ; uint64_t ReadMSR(uint32_t msr);
+ReadMSR:
+    mov ecx, edi
+    rdmsr
+    shl rdx, 32
+    or rax, rdx
+    ret
+
+global CPUID  ; void CPUID(uint32_t leaf, uint32_t subleaf, uint32_t* regs);
+CPUID:
+    push rbx
+    mov r8, rdx
+    mov eax, edi
+    mov ecx, esi
+    cpuid
+    mov [r8 + 0x00], eax
+    mov [r8 + 0x04], ebx
+    mov [r8 + 0x08], ecx
+    mov [r8 + 0x0c], edx
+    pop rbx
+    ret
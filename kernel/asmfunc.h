@@ -24,4 +24,8 @@ extern "C" {
   void SyscallEntry(void);
   void ExitApp(uint64_t rsp, int32_t ret_val);
   void InvalidateTLB(uint64_t addr);
+  uint64_t ReadTSC();
+  uint64_t ReadMSR(uint32_t msr);
+  /** @brief CPUID を実行し，EAX, EBX, ECX, EDX を regs[0..3] に書き込む． */
+  void CPUID(uint32_t leaf, uint32_t subleaf, uint32_t* regs);
 }
@@ -0,0 +1,157 @@
+#include "clock.hpp"
+
+#include <cstring>
+
+#include "acpi.hpp"
+#include "asmfunc.h"
+#include "logger.hpp"
+#include "memory_manager.hpp"
+#include "time_page.hpp"
+#include "timer.hpp"
+
+namespace {
+  const uint64_t kNanosPerSec = 1000000000;
+
+  uint64_t tsc_base;
+  ClockSource clock_source;
+  unsigned long crystal_freq;
+  bool invariant_tsc;
+  TimePage* time_page;
+
+  /** @brief シーケンスロックを取って時刻ページを書き換える．割り込みを禁止して呼ぶこと． */
+  template <class F>
+  void WriteTimePage(F f) {
+    if (time_page == nullptr) {
+      return;
+    }
+    ++time_page->seq;
+    __asm__ volatile("" ::: "memory");
+    f(*time_page);
+    __asm__ volatile("" ::: "memory");
+    ++time_page->seq;
+  }
+
+  void InitializeTimePage() {
+    auto [ frame, err ] = memory_manager->Allocate(1);
+    if (err) {
+      Log(kError, "failed to allocate the time page: %s\n", err.Name());
+      return;
+    }
+    time_page = reinterpret_cast<TimePage*>(frame.Frame());
+    memset(time_page, 0, kBytesPerFrame);
+    WriteTimePage([](TimePage& page) {
+      page.timer_freq = kTimerFreq;
+      page.tsc_base = tsc_base;
+      page.tsc_freq = tsc_freq;
+      page.nanos_per_tick = kNanosPerTick;
+    });
+  }
+
+  uint32_t MaxLeaf(uint32_t base) {
+    uint32_t regs[4];
+    CPUID(base, 0, regs);
+    return regs[0];
+  }
+
+  /** @brief CPUID 0x15, 0x16 から TSC の周波数を求める．分からなければ 0 */
+  unsigned long TSCFreqFromCPUID() {
+    const uint32_t max_leaf = MaxLeaf(0);
+    uint32_t regs[4];
+    if (max_leaf >= 0x15) {
+      CPUID(0x15, 0, regs);
+      const uint32_t denominator = regs[0], numerator = regs[1];
+      crystal_freq = regs[2];
+      if (denominator != 0 && numerator != 0 && crystal_freq != 0) {
+        clock_source = ClockSource::kCPUID15;
+        return static_cast<uint64_t>(crystal_freq) * numerator / denominator;
+      }
+    }
+    if (max_leaf >= 0x16) {
+      CPUID(0x16, 0, regs);
+      const uint32_t base_mhz = regs[0] & 0xffffu;
+      if (base_mhz != 0) {
+        clock_source = ClockSource::kCPUID16;
+        return static_cast<uint64_t>(base_mhz) * 1000000;
+      }
+    }
+    return 0;
+  }
+
+  unsigned long TSCFreqFromPMTimer() {
+    // 10ms でも PM タイマーの 1 カウントは 30ppm 程度の誤差にしかならない
+    const auto start = ReadTSC();
+    acpi::WaitMilliseconds(10);
+    clock_source = ClockSource::kPMTimer;
+    return (ReadTSC() - start) * 100;
+  }
+}
+
+unsigned long tsc_freq;
+
+void InitializeClock() {
+  if (MaxLeaf(0x80000000) >= 0x80000007) {
+    uint32_t regs[4];
+    CPUID(0x80000007, 0, regs);
+    invariant_tsc = (regs[3] >> 8) & 1;
+  }
+
+  tsc_freq = TSCFreqFromCPUID();
+  if (tsc_freq == 0) {
+    tsc_freq = TSCFreqFromPMTimer();
+  }
+
+  tsc_base = ReadTSC();
+  InitializeTimePage();
+
+  Log(kInfo, "clock: TSC %lu Hz from %s%s\n", tsc_freq,
+      ClockSourceName(clock_source), invariant_tsc ? "" : " (not invariant)");
+}
+
+uint64_t NowNanos() {
+  return TSCToNanos(ReadTSC());
+}
+
+/* 秒と 1 秒未満に分けて計算すると，TSC の周波数が 18GHz 未満なら 64 ビットで
+ * 桁あふれせず，掛けてから割るので誤差もたまらない． */
+uint64_t TSCToNanos(uint64_t tsc) {
+  const uint64_t cycles = tsc - tsc_base;
+  const uint64_t sec = cycles / tsc_freq, rem = cycles % tsc_freq;
+  return sec * kNanosPerSec + rem * kNanosPerSec / tsc_freq;
+}
+
+uint64_t NanosToTSC(uint64_t nanos) {
+  const uint64_t sec = nanos / kNanosPerSec, rem = nanos % kNanosPerSec;
+  // 切り上げておくと TSCToNanos(NanosToTSC(n)) >= n となる
+  return tsc_base + sec * tsc_freq + (rem * tsc_freq + kNanosPerSec - 1) / kNanosPerSec;
+}
+
+uint64_t TimePageAddress() {
+  return reinterpret_cast<uint64_t>(time_page);
+}
+
+void PublishTick(unsigned long tick) {
+  WriteTimePage([tick](TimePage& page) {
+    page.tick = tick;
+  });
+}
+
+ClockSource GetClockSource() {
+  return clock_source;
+}
+
+const char* ClockSourceName(ClockSource source) {
+  switch (source) {
+  case ClockSource::kCPUID15: return "cpuid 0x15";
+  case ClockSource::kCPUID16: return "cpuid 0x16";
+  case ClockSource::kPMTimer: return "pm timer";
+  }
+  return "unknown";
+}
+
+unsigned long CrystalFreq() {
+  return crystal_freq;
+}
+
+bool InvariantTSC() {
+  return invariant_tsc;
+}
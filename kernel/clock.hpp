@@ -0,0 +1,49 @@
+/**
+ * @file clock.hpp
+ *
+ * TSC を基にした単調増加する時計．起動時に TSC の周波数を求めておき，
+ * 以後は rdtsc だけでナノ秒単位の時刻を得る．
+ */
+
+#pragma once
+
+#include <cstdint>
+
+/** @brief TSC の周波数をどうやって求めたか */
+enum class ClockSource {
+  kCPUID15,  // CPUID 0x15 の水晶振動子の周波数と比
+  kCPUID16,  // CPUID 0x16 のベース周波数
+  kPMTimer,  // ACPI PM タイマーとの比較
+};
+
+/** @brief TSC の周波数（Hz）．InitializeClock で求める． */
+extern unsigned long tsc_freq;
+
+/** @brief TSC の周波数を求め，この時点を時刻 0 とする．
+ *
+ * CPUID で周波数が分かればそれを使い，分からなければ PM タイマーで短く測る．
+ * PM タイマーを使うことがあるので acpi::Initialize の後に呼ぶ．
+ */
+void InitializeClock();
+
+/** @brief InitializeClock からの経過時間（ナノ秒） */
+uint64_t NowNanos();
+/** @brief TSC の値を InitializeClock からの経過時間（ナノ秒）に変換する． */
+uint64_t TSCToNanos(uint64_t tsc);
+/** @brief InitializeClock からの経過時間（ナノ秒）を TSC の値に変換する．
+ *
+ * 変換した TSC に達した時点では，必ず NowNanos() が nanos 以上になる．
+ */
+uint64_t NanosToTSC(uint64_t nanos);
+
+/** @brief 時刻ページ（time_page.hpp）の物理アドレス．確保できていなければ 0 */
+uint64_t TimePageAddress();
+/** @brief 時刻ページのティックを更新する．割り込みを禁止して呼ぶこと． */
+void PublishTick(unsigned long tick);
+
+ClockSource GetClockSource();
+const char* ClockSourceName(ClockSource source);
+/** @brief 水晶振動子の周波数（Hz）．CPUID 0x15 で分からなければ 0 */
+unsigned long CrystalFreq();
+/** @brief 電力状態によらず一定の速さで進む TSC なら true */
+bool InvariantTSC();
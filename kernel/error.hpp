@@ -35,6 +35,7 @@ class Error {
     kIsDirectory,
     kNoSuchEntry,
     kFreeTypeError,
+    kTryAgain,
     kLastOfCode,  // この列挙子は常に最後に配置する
   };
 
@@ -69,6 +70,7 @@ class Error {
     "kIsDirectory",
     "kNoSuchEntry",
     "kFreeTypeError",
+    "kTryAgain",
   };
   static_assert(Error::Code::kLastOfCode == code_names_.size());
 
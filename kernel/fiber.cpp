@@ -0,0 +1,242 @@
+#include "fiber.hpp"
+
+#include <array>
+
+#include "irqtrace.hpp"
+#include "lock.hpp"
+#include "task.hpp"
+#include "timer.hpp"
+
+/** @brief 実行可能なファイバーをワーカータスクに割り当てる． */
+class FiberScheduler {
+ public:
+  FiberScheduler();
+  /** @brief ワーカータスクを起こす．scheduler を設定してから呼ぶ． */
+  void Start();
+  /** @brief fiber を実行可能にする．lock_ を保持して呼ぶ． */
+  void MakeRunnable(Fiber* fiber);
+  /** @brief fiber を wake_tick_ に起こすよう登録する．lock_ を保持して呼ぶ． */
+  void AddSleeper(Fiber* fiber);
+  void Schedule(Fiber* fiber, size_t frame_bytes);
+  [[noreturn]] void RunWorker(Task& task, int worker_index);
+  FiberStat Stat();
+
+  SpinLock lock_{"fiber"};
+
+ private:
+  Fiber* run_head_{nullptr};
+  Fiber* run_tail_{nullptr};
+  Fiber* sleepers_{nullptr}; // wake_tick_ の昇順
+  unsigned long timer_armed_tick_{0};
+  TimerHandle timer_{0};
+  std::array<Task*, kNumFiberWorkers> workers_{};
+  std::array<bool, kNumFiberWorkers> worker_idle_{};
+  FiberStat stat_{};
+
+  Fiber* PopRunnable();
+  void WakeSleepers(unsigned long tick);
+};
+
+namespace {
+  FiberScheduler* scheduler;
+
+  // ワーカーが眠る前に登録する，次のスリーパーを起こすタイマーの値
+  const int kFiberTimer = 1;
+
+  void TaskFiberWorker(uint64_t task_id, int64_t data) {
+    DisableInterrupts();
+    Task& task = task_manager->CurrentTask();
+    EnableInterrupts();
+    scheduler->RunWorker(task, data);
+  }
+}
+
+void FiberEvent::Signal() {
+  LockGuard guard{scheduler->lock_};
+  if (head_ == nullptr) {
+    ++count_;
+    return;
+  }
+
+  Fiber* fiber = head_;
+  head_ = fiber->next_;
+  if (head_ == nullptr) {
+    tail_ = nullptr;
+  }
+  fiber->next_ = nullptr;
+  scheduler->MakeRunnable(fiber);
+}
+
+bool FiberEvent::TryWait(Fiber* fiber) {
+  LockGuard guard{scheduler->lock_};
+  if (count_ > 0) {
+    --count_;
+    return true;
+  }
+
+  fiber->next_ = nullptr;
+  if (tail_) {
+    tail_->next_ = fiber;
+  } else {
+    head_ = fiber;
+  }
+  tail_ = fiber;
+  return false;
+}
+
+void Fiber::SleepFor(unsigned long ticks) {
+  LockGuard guard{scheduler->lock_};
+  wake_tick_ = timer_manager->CurrentTick() + ticks;
+  scheduler->AddSleeper(this);
+}
+
+void Fiber::Yield() {
+  LockGuard guard{scheduler->lock_};
+  scheduler->MakeRunnable(this);
+}
+
+FiberScheduler::FiberScheduler() {
+  stat_.num_workers = kNumFiberWorkers;
+  for (int i = 0; i < kNumFiberWorkers; ++i) {
+    workers_[i] = &task_manager->NewTask().InitContext(TaskFiberWorker, i);
+  }
+}
+
+void FiberScheduler::Start() {
+  for (auto worker : workers_) {
+    worker->Wakeup();
+  }
+}
+
+void FiberScheduler::MakeRunnable(Fiber* fiber) {
+  switch (fiber->state_) {
+  case Fiber::State::kRunning:
+    // 実行中のワーカーが Resume から戻ってから並べる
+    fiber->state_ = Fiber::State::kRunningWoken;
+    return;
+  case Fiber::State::kWaiting:
+    break;
+  default:
+    return;
+  }
+
+  fiber->state_ = Fiber::State::kRunnable;
+  fiber->next_ = nullptr;
+  if (run_tail_) {
+    run_tail_->next_ = fiber;
+  } else {
+    run_head_ = fiber;
+  }
+  run_tail_ = fiber;
+
+  for (int i = 0; i < kNumFiberWorkers; ++i) {
+    if (worker_idle_[i]) {
+      worker_idle_[i] = false;
+      workers_[i]->Wakeup();
+      break;
+    }
+  }
+}
+
+void FiberScheduler::AddSleeper(Fiber* fiber) {
+  auto p = &sleepers_;
+  while (*p && (*p)->wake_tick_ <= fiber->wake_tick_) {
+    p = &(*p)->next_;
+  }
+  fiber->next_ = *p;
+  *p = fiber;
+}
+
+void FiberScheduler::Schedule(Fiber* fiber, size_t frame_bytes) {
+  LockGuard guard{lock_};
+  fiber->frame_bytes_ = frame_bytes;
+  ++stat_.num_fibers;
+  stat_.frame_bytes += frame_bytes;
+  fiber->state_ = Fiber::State::kWaiting;
+  MakeRunnable(fiber);
+}
+
+Fiber* FiberScheduler::PopRunnable() {
+  Fiber* fiber = run_head_;
+  if (fiber) {
+    run_head_ = fiber->next_;
+    if (run_head_ == nullptr) {
+      run_tail_ = nullptr;
+    }
+    fiber->next_ = nullptr;
+  }
+  return fiber;
+}
+
+void FiberScheduler::WakeSleepers(unsigned long tick) {
+  while (sleepers_ && sleepers_->wake_tick_ <= tick) {
+    Fiber* fiber = sleepers_;
+    sleepers_ = fiber->next_;
+    fiber->next_ = nullptr;
+    MakeRunnable(fiber);
+  }
+}
+
+void FiberScheduler::RunWorker(Task& task, int worker_index) {
+  while (true) {
+    lock_.Lock();
+    // 起こすためのタイマーメッセージは中身を見ずに捨てる
+    while (task.ReceiveMessage()) {
+    }
+    WakeSleepers(timer_manager->CurrentTick());
+
+    Fiber* fiber = PopRunnable();
+    if (fiber == nullptr) {
+      if (sleepers_ && timer_armed_tick_ != sleepers_->wake_tick_) {
+        // 先に仕掛けた遅いタイマーは要らなくなるので取り消す
+        timer_manager->CancelTimer(timer_);
+        timer_armed_tick_ = sleepers_->wake_tick_;
+        timer_ = timer_manager->AddTimer(Timer{timer_armed_tick_, kFiberTimer, task.ID()});
+      }
+      worker_idle_[worker_index] = true;
+      // 起こされるのを取りこぼさないよう，割り込みを禁止したまま眠る
+      const bool irq_enabled = lock_.UnlockKeepIrqOff();
+      task.Sleep();
+      if (irq_enabled) {
+        EnableInterrupts();
+      }
+      continue;
+    }
+
+    fiber->state_ = Fiber::State::kRunning;
+    ++stat_.num_resumes;
+    lock_.Unlock();
+
+    const bool finished = fiber->Resume();
+
+    LockGuard guard{lock_};
+    if (finished) {
+      --stat_.num_fibers;
+      stat_.frame_bytes -= fiber->frame_bytes_;
+      delete fiber;
+    } else if (fiber->state_ == Fiber::State::kRunningWoken) {
+      fiber->state_ = Fiber::State::kWaiting;
+      MakeRunnable(fiber);
+    } else {
+      fiber->state_ = Fiber::State::kWaiting;
+    }
+  }
+}
+
+FiberStat FiberScheduler::Stat() {
+  LockGuard guard{lock_};
+  return stat_;
+}
+
+void InitializeFiber() {
+  scheduler = new FiberScheduler;
+  scheduler->Start();
+}
+
+void ScheduleFiber(Fiber* fiber, size_t frame_bytes) {
+  scheduler->Schedule(fiber, frame_bytes);
+}
+
+FiberStat GetFiberStat() {
+  return scheduler->Stat();
+}
@@ -0,0 +1,138 @@
+/**
+ * @file fiber.hpp
+ *
+ * スタックを持たない軽量な実行単位（ファイバー）．
+ *
+ * 待ち合わせのたびにタスクを 1 つ作る代わりに，待ち合わせ点ごとに Resume から
+ * 戻る状態機械として書き，少数のワーカータスクで多重化する．
+ * 待ち合わせをまたいで使う変数はすべてメンバ変数に置くこと（それがファイバーの
+ * フレームになる）．
+ *
+ * @code
+ * class Blink : public Fiber {
+ *  public:
+ *   bool Resume() override {
+ *     FIBER_BEGIN;
+ *     for (i_ = 0; i_ < 10; ++i_) {
+ *       FIBER_WAIT(event_);
+ *       FIBER_SLEEP(kTimerFreq / 2);
+ *     }
+ *     FIBER_END;
+ *   }
+ *  private:
+ *   int i_;
+ *   FiberEvent& event_;
+ * };
+ * @endcode
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+
+class Fiber;
+
+/** @brief ファイバーが待つ事象．カウント付きのセマフォとして振る舞う．
+ *
+ * Signal は割り込みハンドラからも呼べる．定数初期化できるので大域変数にしてよい．
+ */
+class FiberEvent {
+ public:
+  constexpr explicit FiberEvent(int count = 0) : count_{count} {}
+
+  /** @brief 待っているファイバーを 1 つ起こす．いなければカウントを増やす． */
+  void Signal();
+  /** @brief カウントが正なら減らして true を返す．0 なら fiber を待たせて false を返す． */
+  bool TryWait(Fiber* fiber);
+
+ private:
+  int count_;
+  Fiber* head_{nullptr};
+  Fiber* tail_{nullptr};
+};
+
+class Fiber {
+ public:
+  virtual ~Fiber() = default;
+  /** @brief 次の待ち合わせ点まで実行する．終了したら true を返す． */
+  virtual bool Resume() = 0;
+
+ protected:
+  /** @brief 待ち合わせ点の番号．FIBER_BEGIN などのマクロが使う． */
+  int resume_point_{0};
+
+  /** @brief ticks 後に再開するよう登録する．この後すぐに Resume から戻ること． */
+  void SleepFor(unsigned long ticks);
+  /** @brief すぐに再開するよう登録する．この後すぐに Resume から戻ること． */
+  void Yield();
+
+ private:
+  enum class State {
+    kWaiting,
+    kRunnable,
+    kRunning,
+    kRunningWoken, // 実行中に起こされた．Resume から戻ったらすぐ実行可能にする
+  };
+  State state_{State::kRunnable};
+  Fiber* next_{nullptr};
+  unsigned long wake_tick_{0};
+  size_t frame_bytes_{0};
+
+  friend class FiberEvent;
+  friend class FiberScheduler;
+};
+
+#define FIBER_BEGIN switch (resume_point_) { case 0:
+#define FIBER_END } return true
+
+/** @brief event が Signal されるまで待つ． */
+#define FIBER_WAIT(event) \
+  do { \
+    resume_point_ = __LINE__; \
+    if (!(event).TryWait(this)) { \
+      return false; \
+    } \
+    case __LINE__:; \
+  } while (0)
+
+/** @brief ticks だけ待つ． */
+#define FIBER_SLEEP(ticks) \
+  do { \
+    resume_point_ = __LINE__; \
+    SleepFor(ticks); \
+    return false; \
+    case __LINE__:; \
+  } while (0)
+
+/** @brief ほかのファイバーに実行を譲る． */
+#define FIBER_YIELD() \
+  do { \
+    resume_point_ = __LINE__; \
+    Yield(); \
+    return false; \
+    case __LINE__:; \
+  } while (0)
+
+struct FiberStat {
+  uint64_t num_fibers;  // 終了していないファイバーの数
+  uint64_t frame_bytes; // それらのフレーム（オブジェクト）の合計サイズ
+  uint64_t num_resumes;
+  int num_workers;
+};
+
+const int kNumFiberWorkers = 2;
+
+void InitializeFiber();
+/** @brief ファイバーを実行可能にする．終了したファイバーは delete される． */
+void ScheduleFiber(Fiber* fiber, size_t frame_bytes);
+FiberStat GetFiberStat();
+
+/** @brief F を生成して実行を始める． */
+template <class F, class... Args>
+F* StartFiber(Args&&... args) {
+  auto fiber = new F{std::forward<Args>(args)...};
+  ScheduleFiber(fiber, sizeof(F));
+  return fiber;
+}
@@ -2,6 +2,9 @@
 
 #include <cstddef>
 #include "error.hpp"
+#include "poll.hpp"
+
+class WaitQueue;
 
 class FileDescriptor {
  public:
@@ -13,6 +16,14 @@ class FileDescriptor {
   /** @brief Load reads file content without changing internal offset
    */
   virtual size_t Load(void* buf, size_t len, size_t offset) = 0;
+
+  /** @brief 今ブロックせずに行える操作を PollBits の組み合わせで返す． */
+  virtual int Poll() { return kPollIn | kPollOut; }
+  /** @brief Poll の結果が変わるときに起こされる待ち行列を返す．
+   *
+   * nullptr なら，状態の変化は持ち主のタスクへのメッセージとして届く．
+   */
+  virtual WaitQueue* GetWaitQueue() { return nullptr; }
 };
 
 size_t PrintToFD(FileDescriptor& fd, const char* format, ...);
@@ -0,0 +1,100 @@
+#include "futex.hpp"
+
+#include <array>
+
+#include "irqtrace.hpp"
+#include "paging.hpp"
+#include "task.hpp"
+
+namespace {
+  struct FutexWaiter {
+    uint64_t paddr;
+    Task* task;
+    bool woken;
+    FutexWaiter* next;
+  };
+
+  // 待ち行列の各要素は待っているタスクのスタック上に置かれる
+  std::array<FutexWaiter*, 64> futex_buckets;
+
+  FutexWaiter*& Bucket(uint64_t paddr) {
+    const uint64_t hash = (paddr >> 2) * 0x9e37'79b9'7f4a'7c15;
+    return futex_buckets[hash >> 58];
+  }
+}
+
+Error FutexWait(const volatile uint32_t* addr, uint32_t expected) {
+  // 物理アドレスで待ち合わせるので，コピーオンライトのページは先にコピーしておく．
+  // さもないと FutexWake の前に書き込んだ側だけページが差し替わり，起こし損ねる．
+  // ページフォルトの処理は割り込み禁止区間の外で済ませる
+  if (auto err = PrepareUserWrite(reinterpret_cast<uint64_t>(addr))) {
+    return err;
+  }
+  if (*addr != expected) {
+    return MAKE_ERROR(Error::kTryAgain);
+  }
+
+  DisableInterrupts();
+  auto [ paddr, err ] = TranslateAddress(reinterpret_cast<uint64_t>(addr));
+  if (err) {
+    EnableInterrupts();
+    return err;
+  }
+  if (*addr != expected) {
+    EnableInterrupts();
+    return MAKE_ERROR(Error::kTryAgain);
+  }
+
+  auto& task = task_manager->CurrentTask();
+  FutexWaiter waiter{paddr, &task, false, nullptr};
+  auto p = &Bucket(paddr);
+  while (*p) {
+    p = &(*p)->next;
+  }
+  *p = &waiter;
+
+  // メッセージの到着でも起こされるので，FutexWake されるまで眠り直す
+  while (!waiter.woken && !task.Canceled()) {
+    task.Sleep();
+  }
+  if (!waiter.woken) {
+    // アプリの終了で起こされたので，待ち行列から外す
+    for (p = &Bucket(paddr); *p; p = &(*p)->next) {
+      if (*p == &waiter) {
+        *p = waiter.next;
+        break;
+      }
+    }
+  }
+  EnableInterrupts();
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+WithError<int> FutexWake(const volatile uint32_t* addr, int num) {
+  int num_woken = 0;
+  // FutexWait と同じ物理アドレスを得るため，コピーオンライトのページは先にコピーする
+  if (auto err = PrepareUserWrite(reinterpret_cast<uint64_t>(addr))) {
+    return { 0, err };
+  }
+  DisableInterrupts();
+  auto [ paddr, err ] = TranslateAddress(reinterpret_cast<uint64_t>(addr));
+  if (err) {
+    EnableInterrupts();
+    return { 0, err };
+  }
+
+  auto p = &Bucket(paddr);
+  while (*p && num_woken < num) {
+    auto waiter = *p;
+    if (waiter->paddr != paddr) {
+      p = &waiter->next;
+      continue;
+    }
+    *p = waiter->next;
+    waiter->woken = true;
+    waiter->task->Wakeup();
+    ++num_woken;
+  }
+  EnableInterrupts();
+  return { num_woken, MAKE_ERROR(Error::kSuccess) };
+}
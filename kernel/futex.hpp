@@ -0,0 +1,22 @@
+/**
+ * @file futex.hpp
+ *
+ * アプリ向けの futex（アドレスをキーとする待ち行列）を提供するプログラムを集めたファイル．
+ */
+
+#pragma once
+
+#include <cstdint>
+
+#include "error.hpp"
+
+/** @brief *addr が expected と等しければ，FutexWake で起こされるまで現在のタスクを眠らせる．
+ *
+ * 待ち行列は addr の物理アドレスをキーとするので，同じ物理ページを共有していれば
+ * 異なる仮想アドレスからでも待ち合わせられる．
+ * 値が expected と異なる場合は眠らずに kTryAgain を返す．
+ */
+Error FutexWait(const volatile uint32_t* addr, uint32_t expected);
+
+/** @brief addr で待っているタスクを待ち始めた順に最大 num 個起こし，起こした数を返す． */
+WithError<int> FutexWake(const volatile uint32_t* addr, int num);
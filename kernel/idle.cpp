@@ -0,0 +1,164 @@
+#include "idle.hpp"
+
+#include <algorithm>
+
+#include "asmfunc.h"
+#include "clock.hpp"
+#include "logger.hpp"
+#include "timer.hpp"
+
+namespace {
+  /** @brief アイドル中の CPU の状態．起床フラグは MONITOR で監視するので 1 キャッシュラインに置く．
+   *
+   * いまは BSP しか動かないので 1 つだけ持つ．
+   */
+  struct alignas(64) IdleCPU {
+    volatile uint64_t kick_tsc; // 起床フラグ．起こす側が書いた時点の TSC（0 なら未設定）
+    volatile bool polling;      // 起床フラグを監視して休んでいる間 true
+  };
+  IdleCPU idle_cpu;
+
+  bool use_mwait = false;
+  bool break_on_masked = false;  // 割り込み禁止のまま MWAIT しても割り込みで目覚める
+  // cstate_hints[n] は Cn に入るときの MWAIT ヒント．-1 なら Cn は使えない
+  std::array<int, IdleStat::kMaxCStates> cstate_hints;
+
+  /** @brief Cn に入る価値がある最短の滞在時間（マイクロ秒）．
+   *
+   * CPUID では復帰にかかる時間が分からないので，よくある復帰時間の数倍にしておく．
+   */
+  const uint64_t kTargetResidencyUs[IdleStat::kMaxCStates] = {
+    0, 0, 20, 100, 300, 600, 1000, 2000
+  };
+
+  IdleStat stat;
+
+  int Log2(uint64_t v) {
+    return 63 - __builtin_clzll(v | 1);
+  }
+
+  /** @brief expected サイクルだけ休める見込みのとき，入る C ステートを選ぶ． */
+  int SelectCState(uint64_t expected) {
+    const uint64_t cycles_per_us = std::max(tsc_freq / 1000000, 1ul);
+    for (int n = stat.deepest_cstate; n > 1; --n) {
+      if (cstate_hints[n] >= 0 && kTargetResidencyUs[n] * cycles_per_us <= expected) {
+        return n;
+      }
+    }
+    return 1;
+  }
+
+  void Monitor(const volatile void* addr) {
+    __asm__ volatile("monitor" : : "a"(addr), "c"(0), "d"(0) : "memory");
+  }
+}
+
+void InitializeIdle() {
+  cstate_hints.fill(-1);
+  cstate_hints[1] = 0;
+  stat.deepest_cstate = 1;
+
+  uint32_t regs[4];
+  CPUID(0, 0, regs);
+  const uint32_t max_leaf = regs[0];
+  CPUID(1, 0, regs);
+  // CPUID.01H:ECX[3] が MONITOR/MWAIT の有無
+  if (max_leaf < 5 || ((regs[2] >> 3) & 1) == 0) {
+    Log(kInfo, "idle: hlt\n");
+    return;
+  }
+
+  // CPUID.05H:ECX[0] が拡張の有無，ECX[1] が割り込み禁止中でも割り込みで目覚められるか．
+  // EDX の 4 ビットずつが C0, C1, ... のサブステートの数
+  CPUID(5, 0, regs);
+  use_mwait = true;
+  stat.mwait = true;
+  const bool extensions = regs[2] & 1;
+  break_on_masked = extensions && ((regs[2] >> 1) & 1);
+  const uint32_t substates = regs[3];
+
+  // CPUID.06H:EAX[2] (ARAT) が，C ステートによらず Local APIC タイマーが動き続けるか
+  bool arat = false;
+  if (max_leaf >= 6) {
+    CPUID(6, 0, regs);
+    arat = (regs[0] >> 2) & 1;
+  }
+  if (extensions) {
+    // C2 以降では TSC や Local APIC タイマーが止まることがある．時刻がずれたり
+    // タイマー割り込みで目覚められなくなったりするので，どちらかが止まりうるなら C1 に留める
+    const int max_cstate = InvariantTSC() && arat ? IdleStat::kMaxCStates - 1 : 1;
+    for (int n = 2; n <= max_cstate; ++n) {
+      if ((substates >> (4 * n)) & 0xf) {
+        cstate_hints[n] = (n - 1) << 4;
+        stat.deepest_cstate = n;
+      }
+    }
+  }
+  Log(kInfo, "idle: mwait up to C%d%s\n", stat.deepest_cstate,
+      break_on_masked ? "" : " (no break on masked interrupts)");
+}
+
+void CPUIdle() {
+  // 割り込み禁止区間の計測に載らないよう，cli/sti を直接使う
+  __asm__ volatile("cli" : : : "memory");
+  const uint64_t enter_tsc = ReadTSC();
+  const uint64_t deadline_tsc = ArmedTimerTSC();
+  const uint64_t expected = deadline_tsc > enter_tsc ? deadline_tsc - enter_tsc : 0;
+
+  int cstate = 1;
+  idle_cpu.kick_tsc = 0;
+  idle_cpu.polling = true;
+  if (use_mwait) {
+    cstate = SelectCState(expected);
+    Monitor(&idle_cpu.kick_tsc);
+    // MONITOR より前に書かれた起床フラグは MWAIT を起こさないので確かめる
+    if (idle_cpu.kick_tsc == 0) {
+      if (break_on_masked) {
+        // 割り込みハンドラより先に目覚めた時刻を取れるよう，割り込み禁止のまま待つ
+        __asm__ volatile("mwait" : : "a"(cstate_hints[cstate]), "c"(1) : "memory");
+      } else {
+        // sti の直後の命令までは割り込まれないので，MWAIT に入る前の割り込みを取りこぼさない
+        __asm__ volatile("sti\n\tmwait\n\tcli"
+                         : : "a"(cstate_hints[cstate]), "c"(0) : "memory");
+      }
+    }
+  } else {
+    __asm__ volatile("sti\n\thlt\n\tcli" : : : "memory");
+  }
+  uint64_t wake_tsc = ReadTSC();
+  idle_cpu.polling = false;
+
+  const uint64_t kick_tsc = idle_cpu.kick_tsc;
+  const bool handler_ran = !(use_mwait && break_on_masked);
+  if (handler_ran && kick_tsc != 0) {
+    // 起こした割り込みハンドラが他のタスクへ切り替え，しばらく経ってから戻ってきたかもしれない．
+    // 起床フラグが書かれた時点で目覚めていたとみなす
+    wake_tsc = kick_tsc;
+  }
+
+  const uint64_t residency = wake_tsc - enter_tsc;
+  ++stat.entries[cstate];
+  stat.residency_cycles[cstate] += residency;
+  ++stat.residency_histogram[Log2(residency)];
+
+  if (!handler_ran && kick_tsc != 0) {
+    ++stat.kick_wakeups;
+    ++stat.wakeup_histogram[Log2(wake_tsc - kick_tsc)];
+  } else if (wake_tsc >= deadline_tsc) {
+    ++stat.timer_wakeups;
+    ++stat.wakeup_histogram[Log2(wake_tsc - deadline_tsc)];
+  } else {
+    ++stat.other_wakeups;
+  }
+  __asm__ volatile("sti" : : : "memory");
+}
+
+void KickIdle() {
+  if (idle_cpu.polling && idle_cpu.kick_tsc == 0) {
+    idle_cpu.kick_tsc = ReadTSC();
+  }
+}
+
+IdleStat IdleStatSnapshot() {
+  return stat;
+}
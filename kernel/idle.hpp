@@ -0,0 +1,47 @@
+/**
+ * @file idle.hpp
+ *
+ * 実行するタスクがないときに CPU を休ませるアイドルドライバ．
+ *
+ * MONITOR/MWAIT が使えれば，次のタイマー割り込みまでの時間から C ステートを選んで
+ * MWAIT で休む．MWAIT は割り込みのほか，MONITOR で監視している起床フラグへの
+ * 書き込みでも目覚めるので，IPI を使わずにアイドル中の CPU を起こせる．
+ * 使えなければ従来どおり hlt で休む．
+ */
+
+#pragma once
+
+#include <array>
+#include <cstdint>
+
+/** @brief MONITOR/MWAIT と使える C ステートを調べる．InitializeClock の後に呼ぶ． */
+void InitializeIdle();
+/** @brief CPU を 1 回休ませ，目覚めたら戻る．アイドルタスクが繰り返し呼ぶ． */
+void CPUIdle();
+/** @brief アイドル中の CPU の起床フラグを書き，MWAIT から起こす．
+ *
+ * 実行可能なタスクが増えたときにスケジューラが呼ぶ．割り込みを禁止して呼ぶこと．
+ */
+void KickIdle();
+
+/** @brief アイドルの統計．時間は TSC のサイクル数 */
+struct IdleStat {
+  static const int kMaxCStates = 8;
+  static const int kHistogramBuckets = 64;
+
+  bool mwait;             // MWAIT で休んでいれば true．false なら hlt
+  int deepest_cstate;     // 選ぶことのある最も深い C ステート
+  std::array<uint64_t, kMaxCStates> entries;           // [n] は Cn に入った回数．hlt は C1
+  std::array<uint64_t, kMaxCStates> residency_cycles;  // [n] は Cn にいた時間の合計
+  /** @brief residency_histogram[i] は 2^i 以上 2^(i+1) 未満サイクル休んだ回数 */
+  std::array<uint64_t, kHistogramBuckets> residency_histogram;
+  /** @brief 起こされるべき時刻（タイマーの期限か起床フラグを書いた時刻）から
+   * 実際に目覚めるまでの遅れの分布．形式は residency_histogram と同じ */
+  std::array<uint64_t, kHistogramBuckets> wakeup_histogram;
+  uint64_t timer_wakeups;  // タイマー割り込みで目覚めた回数
+  uint64_t kick_wakeups;   // 起床フラグで目覚めた回数
+  uint64_t other_wakeups;  // その他の割り込みで目覚めた回数
+};
+
+/** @brief 統計をコピーする．割り込み禁止状態で呼ぶこと． */
+IdleStat IdleStatSnapshot();
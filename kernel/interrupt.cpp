@@ -8,12 +8,17 @@
 
 #include <csignal>
 
+#include "apic.hpp"
 #include "asmfunc.h"
 #include "segment.hpp"
 #include "timer.hpp"
 #include "task.hpp"
 #include "graphics.hpp"
 #include "font.hpp"
+#include "kernel_stack.hpp"
+#include "percpu.hpp"
+#include "usb/xhci/xhci.hpp"
+#include "workqueue.hpp"
 
 std::array<InterruptDescriptor, 256> idt;
 
@@ -29,15 +34,18 @@ void SetIDTEntry(InterruptDescriptor& desc,
 }
 
 void NotifyEndOfInterrupt() {
-  volatile auto end_of_interrupt = reinterpret_cast<uint32_t*>(0xfee000b0);
-  *end_of_interrupt = 0;
+  WriteLAPIC(LAPICRegister::kEOI, 0);
 }
 
 namespace {
+  /** @brief xHCI のインタラプタ kInterrupter の割り込み．イベントの処理はワークキューで行う． */
+  template <int kInterrupter>
   __attribute__((interrupt))
   void IntHandlerXHCI(InterruptFrame* frame) {
-    task_manager->SendMessage(1, Message{Message::kInterruptXHCI});
+    const uint64_t entry_tsc = ReadTSC();
+    usb::xhci::OnInterrupt(kInterrupter);
     NotifyEndOfInterrupt();
+    IrqExit(entry_tsc);
   }
 
   void PrintHex(uint64_t value, int width, Vector2D<int> pos) {
@@ -71,6 +79,8 @@ namespace {
     }
 
     auto& task = task_manager->CurrentTask();
+    // アプリからの例外なので GS ベースはアプリのもの．カーネルへ戻る前に入れ替える
+    SwapGS();
     __asm__("sti");
     ExitApp(task.OSStackPointer(), 128 + SIGSEGV);
   }
@@ -88,6 +98,24 @@ namespace {
     while (true) __asm__("hlt");
   }
 
+  /* カーネルスタックがガードページに達すると #PF を積めずに #DF となる．
+   * #DF は専用の IST で受けるので，あふれたスタックの上でも処理できる． */
+  __attribute__((interrupt))
+  void IntHandlerDF(InterruptFrame* frame, uint64_t error_code) {
+    uint64_t cr2 = GetCR2();
+    if (kernel_stack_pool && kernel_stack_pool->IsGuardPage(cr2)) {
+      WriteString(*screen_writer, {500, 16*5}, "STACK OVF TASK", {0, 0, 0});
+      PrintHex(task_manager->CurrentTask().ID(), 8, {500 + 8*15, 16*5});
+      WriteString(*screen_writer, {500, 16*6}, "CR2", {0, 0, 0});
+      PrintHex(cr2, 16, {500 + 8*4, 16*6});
+    }
+    KillApp(frame);
+    PrintFrame(frame, "#DF");
+    WriteString(*screen_writer, {500, 16*4}, "ERR", {0, 0, 0});
+    PrintHex(error_code, 16, {500 + 8*4, 16*4});
+    while (true) __asm__("hlt");
+  }
+
 #define FaultHandlerWithError(fault_name) \
   __attribute__((interrupt)) \
   void IntHandler ## fault_name (InterruptFrame* frame, uint64_t error_code) { \
@@ -113,7 +141,6 @@ namespace {
   FaultHandlerNoError(BR)
   FaultHandlerNoError(UD)
   FaultHandlerNoError(NM)
-  FaultHandlerWithError(DF)
   FaultHandlerWithError(TS)
   FaultHandlerWithError(NP)
   FaultHandlerWithError(SS)
@@ -133,7 +160,11 @@ void InitializeInterrupt() {
                 reinterpret_cast<uint64_t>(handler),
                 kKernelCS);
   };
-  set_idt_entry(InterruptVector::kXHCI, IntHandlerXHCI);
+  static_assert(usb::xhci::kMaxInterrupters == 4);
+  set_idt_entry(InterruptVector::kXHCI + 0, IntHandlerXHCI<0>);
+  set_idt_entry(InterruptVector::kXHCI + 1, IntHandlerXHCI<1>);
+  set_idt_entry(InterruptVector::kXHCI + 2, IntHandlerXHCI<2>);
+  set_idt_entry(InterruptVector::kXHCI + 3, IntHandlerXHCI<3>);
   SetIDTEntry(idt[InterruptVector::kLAPICTimer],
               MakeIDTAttr(DescriptorType::kInterruptGate, 0 /* DPL */,
                           true /* present */, kISTForTimer /* IST */),
@@ -146,7 +177,11 @@ void InitializeInterrupt() {
   set_idt_entry(5,  IntHandlerBR);
   set_idt_entry(6,  IntHandlerUD);
   set_idt_entry(7,  IntHandlerNM);
-  set_idt_entry(8,  IntHandlerDF);
+  SetIDTEntry(idt[8],
+              MakeIDTAttr(DescriptorType::kInterruptGate, 0 /* DPL */,
+                          true /* present */, kISTForDoubleFault /* IST */),
+              reinterpret_cast<uint64_t>(IntHandlerDF),
+              kKernelCS);
   set_idt_entry(10, IntHandlerTS);
   set_idt_entry(11, IntHandlerNP);
   set_idt_entry(12, IntHandlerSS);
@@ -50,6 +50,7 @@ constexpr InterruptDescriptorAttribute MakeIDTAttr(
 }
 
 const int kISTForTimer = 1; // index of the interrupt stack table
+const int kISTForDoubleFault = 2;
 
 void SetIDTEntry(InterruptDescriptor& desc,
                  InterruptDescriptorAttribute attr,
@@ -59,8 +60,8 @@ void SetIDTEntry(InterruptDescriptor& desc,
 class InterruptVector {
  public:
   enum Number {
-    kXHCI = 0x40,
-    kLAPICTimer = 0x41,
+    kXHCI = 0x40, // ここから usb::xhci::kMaxInterrupters 個．kXHCI + i がインタラプタ i
+    kLAPICTimer = 0x48,
   };
 };
 
@@ -0,0 +1,58 @@
+#include "irqtrace.hpp"
+
+#include "asmfunc.h"
+
+namespace {
+  uint64_t off_tsc;
+  const char* off_file;
+  int off_line;
+  IrqOffStat stat;
+
+  int Log2(uint64_t v) {
+    return 63 - __builtin_clzll(v);
+  }
+}
+
+void IrqTraceOff(const char* file, int line) {
+  off_tsc = ReadTSC();
+  off_file = file;
+  off_line = line;
+}
+
+void IrqTraceOn(const char* file, int line) {
+  if (off_tsc == 0) {
+    return;
+  }
+  const uint64_t cycles = ReadTSC() - off_tsc;
+  off_tsc = 0;
+  if (InterruptEnabled() || cycles == 0) {
+    // 禁止区間の途中で割り込みが許可されたタスクに切り替わっていた
+    return;
+  }
+
+  ++stat.num_sections;
+  ++stat.histogram[Log2(cycles)];
+
+  auto& worst = stat.worst;
+  if (cycles <= worst.back().cycles) {
+    return;
+  }
+  int i = worst.size() - 1;
+  for (; i > 0 && worst[i - 1].cycles < cycles; --i) {
+    worst[i] = worst[i - 1];
+  }
+  worst[i] = IrqOffSection{cycles, off_file, off_line, file, line};
+}
+
+void IrqTraceInterrupted() {
+  off_tsc = 0;
+}
+
+IrqOffStat IrqTraceSnapshot() {
+  return stat;
+}
+
+void IrqTraceReset() {
+  stat = IrqOffStat{};
+  off_tsc = 0;
+}
@@ -0,0 +1,69 @@
+/**
+ * @file irqtrace.hpp
+ *
+ * 割り込み禁止区間の長さを TSC で計測するトレーサ．
+ */
+
+#pragma once
+
+#include <array>
+#include <cstdint>
+
+/** @brief 割り込み禁止区間 1 つ分の記録 */
+struct IrqOffSection {
+  uint64_t cycles;
+  const char* off_file; // 割り込みを禁止した場所
+  int off_line;
+  const char* on_file;  // 割り込みを許可した場所
+  int on_line;
+};
+
+/** @brief 割り込み禁止区間の統計 */
+struct IrqOffStat {
+  static const int kWorstCount = 16;
+  static const int kHistogramBuckets = 64;
+
+  /** @brief 長い順に並べた区間．cycles == 0 の要素は未使用 */
+  std::array<IrqOffSection, kWorstCount> worst;
+  /** @brief histogram[i] は 2^i 以上 2^(i+1) 未満サイクルだった区間の数 */
+  std::array<uint64_t, kHistogramBuckets> histogram;
+  uint64_t num_sections;
+};
+
+void IrqTraceOff(const char* file, int line);
+void IrqTraceOn(const char* file, int line);
+/** @brief 割り込みが有効な状態で割り込みハンドラに入ったことを知らせる．
+ *
+ * コンテキストスイッチで割り込みが許可された場合，禁止区間の記録を破棄する．
+ */
+void IrqTraceInterrupted();
+/** @brief 統計をコピーする．割り込み禁止状態で呼ぶこと． */
+IrqOffStat IrqTraceSnapshot();
+void IrqTraceReset();
+
+/** @brief 割り込みが許可されていれば真を返す． */
+inline bool InterruptEnabled() {
+  uint64_t rflags;
+  __asm__ volatile("pushfq\n\tpop %0" : "=r"(rflags));
+  return rflags & 0x200;
+}
+
+/** @brief 割り込みを禁止し，区間の始まりを記録する．
+ *
+ * すでに禁止されていた場合は外側の区間の一部とみなす．
+ */
+inline void DisableInterrupts(const char* file = __builtin_FILE(),
+                              int line = __builtin_LINE()) {
+  uint64_t rflags;
+  __asm__ volatile("pushfq\n\tpop %0\n\tcli" : "=r"(rflags) : : "memory");
+  if (rflags & 0x200) {
+    IrqTraceOff(file, line);
+  }
+}
+
+/** @brief 区間の終わりを記録し，割り込みを許可する． */
+inline void EnableInterrupts(const char* file = __builtin_FILE(),
+                             int line = __builtin_LINE()) {
+  IrqTraceOn(file, line);
+  __asm__ volatile("sti" : : : "memory");
+}
@@ -0,0 +1,89 @@
+#include "kernel_stack.hpp"
+
+#include <cstring>
+
+#include "logger.hpp"
+#include "memory_manager.hpp"
+#include "paging.hpp"
+
+Error KernelStackPool::Initialize(size_t num_initial) {
+  free_stacks_.reserve(num_initial);
+  for (size_t i = 0; i < num_initial; ++i) {
+    if (auto err = AddSlot()) {
+      return err;
+    }
+  }
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+WithError<uint64_t> KernelStackPool::Allocate() {
+  if (free_stacks_.empty()) {
+    if (auto err = AddSlot()) {
+      return { 0, err };
+    }
+  }
+
+  const uint64_t stack_begin = free_stacks_.back();
+  free_stacks_.pop_back();
+
+  // 前の持ち主が使った範囲だけを 0 に戻す
+  const size_t used = UsedBytes(stack_begin);
+  memset(reinterpret_cast<void*>(stack_begin + kStackBytes - used), 0, used);
+  return { stack_begin, MAKE_ERROR(Error::kSuccess) };
+}
+
+void KernelStackPool::Free(uint64_t stack_begin) {
+  // Finish からは解放するスタック自身の上で呼ばれるので，ここでは何も書き換えない
+  free_stacks_.push_back(stack_begin);
+}
+
+bool KernelStackPool::IsGuardPage(uint64_t addr) const {
+  if (addr < kRegionBase || kRegionBase + num_slots_ * kSlotBytes <= addr) {
+    return false;
+  }
+  return (addr - kRegionBase) % kSlotBytes < 4096;
+}
+
+size_t KernelStackPool::UsedBytes(uint64_t stack_begin) {
+  const auto stack = reinterpret_cast<const uint64_t*>(stack_begin);
+  const size_t num_words = kStackBytes / sizeof(uint64_t);
+  size_t unused = 0;
+  while (unused < num_words && stack[unused] == 0) {
+    ++unused;
+  }
+  return (num_words - unused) * sizeof(uint64_t);
+}
+
+Error KernelStackPool::AddSlot() {
+  if (num_slots_ == kMaxStacks) {
+    return MAKE_ERROR(Error::kFull);
+  }
+
+  auto [ frames, err ] = memory_manager->Allocate(kStackPages);
+  if (err) {
+    return err;
+  }
+  memset(frames.Frame(), 0, kStackBytes);
+
+  const uint64_t stack_begin = kRegionBase + num_slots_ * kSlotBytes + 4096;
+  const auto paddr = reinterpret_cast<uint64_t>(frames.Frame());
+  for (size_t i = 0; i < kStackPages; ++i) {
+    if (auto err = MapKernelPage(stack_begin + 4096 * i, paddr + 4096 * i)) {
+      return err;
+    }
+  }
+
+  ++num_slots_;
+  free_stacks_.push_back(stack_begin);
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+KernelStackPool* kernel_stack_pool;
+
+void InitializeKernelStackPool() {
+  kernel_stack_pool = new KernelStackPool;
+  if (auto err = kernel_stack_pool->Initialize(8)) {
+    Log(kError, "failed to initialize kernel stack pool: %s\n", err.Name());
+    exit(1);
+  }
+}
@@ -0,0 +1,54 @@
+/**
+ * @file kernel_stack.hpp
+ *
+ * タスク用カーネルスタックのプール．
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "error.hpp"
+
+/** @brief ガードページで区切られたカーネルスタックを使い回すプール．
+ *
+ * スタックは専用の仮想アドレス領域に並べて配置し，各スタックの直下に
+ * マップしないガードページを置く．スタックがあふれるとガードページに触れて
+ * ページフォルトとなり，ヒープなど他の領域を破壊しない．
+ * 解放されたスタックはマップしたままフリーリストに戻し，次の割り当てで再利用する．
+ * プールから渡すスタックは常に 0 で埋まっている．
+ */
+class KernelStackPool {
+ public:
+  /** @brief スタック領域の仮想アドレスの始点（PML4 の 1 番目のエントリ） */
+  static const uint64_t kRegionBase = 0x0000'0080'0000'0000;
+  static const size_t kStackPages = 8;
+  static const size_t kStackBytes = kStackPages * 4096;
+  /** @brief ガードページを含む 1 スタック分の大きさ */
+  static const size_t kSlotBytes = (kStackPages + 1) * 4096;
+  static const size_t kMaxStacks = 4096;
+
+  /** @brief num_initial 個のスタックをあらかじめ用意する． */
+  Error Initialize(size_t num_initial);
+  /** @brief スタックを 1 つ取り出し，その最下位アドレスを返す． */
+  WithError<uint64_t> Allocate();
+  /** @brief Allocate で得たスタックをプールに戻す．割り込み禁止状態で呼ぶこと． */
+  void Free(uint64_t stack_begin);
+
+  /** @brief addr がいずれかのガードページ内なら真を返す． */
+  bool IsGuardPage(uint64_t addr) const;
+  /** @brief スタックの使用済み領域（底から見て最初の非 0 ワード以降）の大きさ． */
+  static size_t UsedBytes(uint64_t stack_begin);
+
+ private:
+  size_t num_slots_{0};
+  std::vector<uint64_t> free_stacks_{};
+
+  Error AddSlot();
+};
+
+extern KernelStackPool* kernel_stack_pool;
+
+void InitializeKernelStackPool();
@@ -1,7 +1,10 @@
 #include "keyboard.hpp"
 
+#include <algorithm>
 #include <memory>
 #include "usb/classdriver/keyboard.hpp"
+#include "asmfunc.h"
+#include "layer.hpp"
 #include "task.hpp"
 
 namespace {
@@ -48,6 +51,10 @@ const char keycode_map_shifted[256] = {
   0,    '|',  0,    0,    0,    0,    0,    0,   // 136
 };
 
+const uint8_t kF2Keycode = 59;
+
+KeyInputStat key_input_stat{};
+
 } // namespace
 
 void InitializeKeyboard() {
@@ -63,6 +70,27 @@ void InitializeKeyboard() {
       msg.arg.keyboard.keycode = keycode;
       msg.arg.keyboard.ascii = ascii;
       msg.arg.keyboard.press = press;
+      msg.arg.keyboard.tsc = ReadTSC();
+
+      // アクティブなウィンドウのタスクへ直接送り，メインタスクを経由しない
+      const uint64_t task_id = active_layer->FocusedTask();
+      if (task_id != 0 && !(press && keycode == kF2Keycode) &&
+          !task_manager->SendMessage(task_id, msg)) {
+        ++key_input_stat.direct;
+        return;
+      }
+      ++key_input_stat.to_main;
       task_manager->SendMessage(1, msg);
     };
 }
+
+void RecordKeyEcho(uint64_t key_tsc) {
+  const uint64_t cycles = ReadTSC() - key_tsc;
+  ++key_input_stat.echoes;
+  key_input_stat.echo_cycles += cycles;
+  key_input_stat.max_echo_cycles = std::max(key_input_stat.max_echo_cycles, cycles);
+}
+
+KeyInputStat GetKeyInputStat() {
+  return key_input_stat;
+}
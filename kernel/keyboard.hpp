@@ -18,4 +18,21 @@ static const int kRShiftBitMask   = 0b00100000u;
 static const int kRAltBitMask     = 0b01000000u;
 static const int kRGUIBitMask     = 0b10000000u;
 
+/** @brief キー入力の配送と応答時間の統計．時間は TSC のサイクル数 */
+struct KeyInputStat {
+  uint64_t direct;           // 入力先のタスクへ直接送ったキー
+  uint64_t to_main;          // メインタスクへ送ったキー（テキストボックス，F2 など）
+  uint64_t echoes;           // エコーを描画し終えた回数
+  uint64_t echo_cycles;      // キーを受け取ってからエコーを描画し終えるまで
+  uint64_t max_echo_cycles;
+};
+
+/** @brief キーボードドライバの入力を，アクティブなウィンドウのタスクへ直接送るようにする．
+ *
+ * 入力を受け取るタスクのないレイヤー（テキストボックスなど）へのキーと F2 だけが
+ * メインタスクに届く．
+ */
 void InitializeKeyboard();
+/** @brief key_tsc に受け取ったキーのエコーを画面に描き終えたことを記録する． */
+void RecordKeyEcho(uint64_t key_tsc);
+KeyInputStat GetKeyInputStat();
@@ -1,6 +1,7 @@
 #include "layer.hpp"
 
 #include <algorithm>
+#include "asmfunc.h"
 #include "console.hpp"
 #include "logger.hpp"
 #include "task.hpp"
@@ -11,6 +12,36 @@ namespace {
     auto it = std::remove_if(c.begin(), c.end(), pred);
     c.erase(it, c.end());
   }
+
+  bool IsEmpty(const Rectangle<int>& rect) {
+    return rect.size.x <= 0 || rect.size.y <= 0;
+  }
+
+  /** @brief rect から hole と重なる部分を除いた残りを，最大 4 つの矩形にして out に加える。 */
+  void Subtract(const Rectangle<int>& rect, const Rectangle<int>& hole,
+                std::vector<Rectangle<int>>& out) {
+    const auto inter = rect & hole;
+    if (IsEmpty(inter)) {
+      out.push_back(rect);
+      return;
+    }
+
+    const auto rect_end = rect.pos + rect.size;
+    const auto inter_end = inter.pos + inter.size;
+    // 上下は rect の幅いっぱいに，左右は重なった部分の高さだけ切り出す
+    if (rect.pos.y < inter.pos.y) {
+      out.push_back({rect.pos, {rect.size.x, inter.pos.y - rect.pos.y}});
+    }
+    if (inter_end.y < rect_end.y) {
+      out.push_back({{rect.pos.x, inter_end.y}, {rect.size.x, rect_end.y - inter_end.y}});
+    }
+    if (rect.pos.x < inter.pos.x) {
+      out.push_back({{rect.pos.x, inter.pos.y}, {inter.pos.x - rect.pos.x, inter.size.y}});
+    }
+    if (inter_end.x < rect_end.x) {
+      out.push_back({{inter_end.x, inter.pos.y}, {rect_end.x - inter_end.x, inter.size.y}});
+    }
+  }
 } // namespace
 
 Layer::Layer(unsigned int id) : id_{id} {
@@ -58,8 +89,13 @@ void Layer::DrawTo(FrameBuffer& screen, const Rectangle<int>& area) const {
   }
 }
 
+bool Layer::IsOpaque() const {
+  return window_ && window_->IsOpaque();
+}
+
 
 void LayerManager::SetWriter(FrameBuffer* screen) {
+  LockGuard guard{mutex_};
   screen_ = screen;
 
   FrameBufferConfig back_config = screen->Config();
@@ -68,11 +104,13 @@ void LayerManager::SetWriter(FrameBuffer* screen) {
 }
 
 Layer& LayerManager::NewLayer() {
+  LockGuard guard{mutex_};
   ++latest_id_;
   return *layers_.emplace_back(new Layer{latest_id_});
 }
 
 void LayerManager::RemoveLayer(unsigned int id) {
+  LockGuard guard{mutex_};
   Hide(id);
 
   auto pred = [id](const std::unique_ptr<Layer>& elem) {
@@ -82,9 +120,8 @@ void LayerManager::RemoveLayer(unsigned int id) {
 }
 
 void LayerManager::Draw(const Rectangle<int>& area) const {
-  for (auto layer : layer_stack_) {
-    layer->DrawTo(back_buffer_, area);
-  }
+  LockGuard guard{mutex_};
+  Composite(area);
   screen_->Copy(area.pos, back_buffer_, area);
 }
 
@@ -93,26 +130,93 @@ void LayerManager::Draw(unsigned int id) const {
 }
 
 void LayerManager::Draw(unsigned int id, Rectangle<int> area) const {
-  bool draw = false;
+  LockGuard guard{mutex_};
+  auto it = std::find_if(layer_stack_.begin(), layer_stack_.end(),
+                         [id](const Layer* layer) { return layer->ID() == id; });
+  if (it == layer_stack_.end()) {
+    return;
+  }
+
   Rectangle<int> window_area;
-  for (auto layer : layer_stack_) {
-    if (layer->ID() == id) {
-      window_area.size = layer->GetWindow()->Size();
-      window_area.pos = layer->GetPosition();
-      if (area.size.x >= 0 || area.size.y >= 0) {
-        area.pos = area.pos + window_area.pos;
-        window_area = window_area & area;
+  window_area.size = (*it)->GetWindow()->Size();
+  window_area.pos = (*it)->GetPosition();
+  if (area.size.x >= 0 || area.size.y >= 0) {
+    area.pos = area.pos + window_area.pos;
+    window_area = window_area & area;
+  }
+  // 下のレイヤーは指定のレイヤーが透過している部分だけ，上のレイヤーは重なる部分だけが描かれる
+  Composite(window_area);
+  screen_->Copy(window_area.pos, back_buffer_, window_area);
+}
+
+void LayerManager::Composite(Rectangle<int> area) const {
+  const uint64_t start = ReadTSC();
+  const auto& config = back_buffer_.Config();
+  area = area & Rectangle<int>{{0, 0},
+      {static_cast<int>(config.horizontal_resolution),
+       static_cast<int>(config.vertical_resolution)}};
+  if (IsEmpty(area)) {
+    return;
+  }
+
+  if (!occlusion_culling_) {
+    for (auto layer : layer_stack_) {
+      const auto window = layer->GetWindow();
+      if (!window) {
+        continue;
+      }
+      const auto layer_area = Rectangle<int>{layer->GetPosition(), window->Size()} & area;
+      if (!IsEmpty(layer_area)) {
+        layer->DrawTo(back_buffer_, layer_area);
+        stat_.pixels += layer_area.size.x * layer_area.size.y;
+      }
+    }
+  } else {
+    /* 上のレイヤーから順に，まだ何にも覆われていない領域 uncovered のうち
+     * そのレイヤーが見える部分を集め，不透過なレイヤーなら uncovered から除く。
+     * 集めた部分を下から順に描けば，透過レイヤーはその下の内容の上に重なる。
+     */
+    struct VisiblePart {
+      const Layer* layer;
+      Rectangle<int> area;
+    };
+    std::vector<VisiblePart> parts;
+    std::vector<Rectangle<int>> uncovered{area}, rest;
+    for (auto it = layer_stack_.rbegin();
+         it != layer_stack_.rend() && !uncovered.empty(); ++it) {
+      const Layer* layer = *it;
+      const auto window = layer->GetWindow();
+      if (!window) {
+        continue;
       }
-      draw = true;
+      const Rectangle<int> layer_area{layer->GetPosition(), window->Size()};
+      for (const auto& rect : uncovered) {
+        if (const auto part = rect & layer_area; !IsEmpty(part)) {
+          parts.push_back({layer, part});
+        }
+      }
+      if (!layer->IsOpaque()) {
+        continue;
+      }
+      rest.clear();
+      for (const auto& rect : uncovered) {
+        Subtract(rect, layer_area, rest);
+      }
+      uncovered.swap(rest);
     }
-    if (draw) {
-      layer->DrawTo(back_buffer_, window_area);
+
+    for (auto it = parts.rbegin(); it != parts.rend(); ++it) {
+      it->layer->DrawTo(back_buffer_, it->area);
+      stat_.pixels += it->area.size.x * it->area.size.y;
     }
   }
-  screen_->Copy(window_area.pos, back_buffer_, window_area);
+
+  ++stat_.composites;
+  stat_.cycles += ReadTSC() - start;
 }
 
 void LayerManager::Move(unsigned int id, Vector2D<int> new_pos) {
+  LockGuard guard{mutex_};
   auto layer = FindLayer(id);
   const auto window_size = layer->GetWindow()->Size();
   const auto old_pos = layer->GetPosition();
@@ -122,6 +226,7 @@ void LayerManager::Move(unsigned int id, Vector2D<int> new_pos) {
 }
 
 void LayerManager::MoveRelative(unsigned int id, Vector2D<int> pos_diff) {
+  LockGuard guard{mutex_};
   auto layer = FindLayer(id);
   const auto window_size = layer->GetWindow()->Size();
   const auto old_pos = layer->GetPosition();
@@ -131,6 +236,7 @@ void LayerManager::MoveRelative(unsigned int id, Vector2D<int> pos_diff) {
 }
 
 void LayerManager::UpDown(unsigned int id, int new_height) {
+  LockGuard guard{mutex_};
   if (new_height < 0) {
     Hide(id);
     return;
@@ -156,6 +262,7 @@ void LayerManager::UpDown(unsigned int id, int new_height) {
 }
 
 void LayerManager::Hide(unsigned int id) {
+  LockGuard guard{mutex_};
   auto layer = FindLayer(id);
   auto pos = std::find(layer_stack_.begin(), layer_stack_.end(), layer);
   if (pos != layer_stack_.end()) {
@@ -164,6 +271,7 @@ void LayerManager::Hide(unsigned int id) {
 }
 
 Layer* LayerManager::FindLayerByPosition(Vector2D<int> pos, unsigned int exclude_id) const {
+  LockGuard guard{mutex_};
   auto pred = [pos, exclude_id](Layer* layer) {
     if (layer->ID() == exclude_id) {
       return false;
@@ -185,6 +293,7 @@ Layer* LayerManager::FindLayerByPosition(Vector2D<int> pos, unsigned int exclude
 }
 
 Layer* LayerManager::FindLayer(unsigned int id) {
+  LockGuard guard{mutex_};
   auto pred = [id](const std::unique_ptr<Layer>& elem) {
     return elem->ID() == id;
   };
@@ -196,6 +305,7 @@ Layer* LayerManager::FindLayer(unsigned int id) {
 }
 
 int LayerManager::GetHeight(unsigned int id) {
+  LockGuard guard{mutex_};
   for (int h = 0; h < layer_stack_.size(); ++h) {
     if (layer_stack_[h]->ID() == id) {
       return h;
@@ -208,14 +318,18 @@ namespace {
   FrameBuffer* screen;
 
   Error SendWindowActiveMessage(unsigned int layer_id, int activate) {
+    layer_task_map_lock->Lock();
     auto task_it = layer_task_map->find(layer_id);
     if (task_it == layer_task_map->end()) {
+      layer_task_map_lock->Unlock();
       return MAKE_ERROR(Error::kNoSuchTask);
     }
+    const uint64_t task_id = task_it->second;
+    layer_task_map_lock->Unlock();
 
     Message msg{Message::kWindowActive};
     msg.arg.window_active.activate = activate;
-    return task_manager->SendMessage(task_it->second, msg);
+    return task_manager->SendMessage(task_id, msg);
   }
 }
 
@@ -229,6 +343,7 @@ void ActiveLayer::SetMouseLayer(unsigned int mouse_layer) {
 }
 
 void ActiveLayer::Activate(unsigned int layer_id) {
+  LockGuard guard{manager_.GetMutex()};
   if (active_layer_ == layer_id) {
     return;
   }
@@ -241,6 +356,11 @@ void ActiveLayer::Activate(unsigned int layer_id) {
   }
 
   active_layer_ = layer_id;
+  {
+    LockGuard map_guard{*layer_task_map_lock};
+    auto task_it = layer_task_map->find(layer_id);
+    focused_task_ = task_it != layer_task_map->end() ? task_it->second : 0;
+  }
   if (active_layer_ > 0) {
     Layer* layer = manager_.FindLayer(active_layer_);
     layer->GetWindow()->Activate();
@@ -253,6 +373,47 @@ void ActiveLayer::Activate(unsigned int layer_id) {
 
 ActiveLayer* active_layer;
 std::map<unsigned int, uint64_t>* layer_task_map;
+TicketLock* layer_task_map_lock;
+
+namespace {
+  uint64_t GetLayerTaskLocked(unsigned int layer_id) {
+    auto task_it = layer_task_map->find(layer_id);
+    return task_it != layer_task_map->end() ? task_it->second : 0;
+  }
+
+  void SetLayerTaskLocked(unsigned int layer_id, uint64_t task_id) {
+    if (task_id) {
+      (*layer_task_map)[layer_id] = task_id;
+    } else {
+      layer_task_map->erase(layer_id);
+    }
+  }
+}
+
+void SetLayerTask(unsigned int layer_id, uint64_t task_id) {
+  LockGuard guard{*layer_task_map_lock};
+  SetLayerTaskLocked(layer_id, task_id);
+  if (layer_id != 0 && layer_id == active_layer->GetActive()) {
+    active_layer->focused_task_ = task_id;
+  }
+}
+
+uint64_t GetLayerTask(unsigned int layer_id) {
+  LockGuard guard{*layer_task_map_lock};
+  return GetLayerTaskLocked(layer_id);
+}
+
+bool ReplaceLayerTask(unsigned int layer_id, uint64_t expected, uint64_t task_id) {
+  LockGuard guard{*layer_task_map_lock};
+  if (GetLayerTaskLocked(layer_id) != expected) {
+    return false;
+  }
+  SetLayerTaskLocked(layer_id, task_id);
+  if (layer_id != 0 && layer_id == active_layer->GetActive()) {
+    active_layer->focused_task_ = task_id;
+  }
+  return true;
+}
 
 void InitializeLayer() {
   const auto screen_size = ScreenSize();
@@ -290,6 +451,7 @@ void InitializeLayer() {
   active_layer = new ActiveLayer{*layer_manager};
 
   layer_task_map = new std::map<unsigned int, uint64_t>;
+  layer_task_map_lock = new TicketLock{"layer_task_map"};
 }
 
 void ProcessLayerMessage(const Message& msg) {
@@ -311,6 +473,7 @@ void ProcessLayerMessage(const Message& msg) {
 }
 
 Error CloseLayer(unsigned int layer_id) {
+  LockGuard guard{layer_manager->GetMutex()};
   Layer* layer = layer_manager->FindLayer(layer_id);
   if (layer == nullptr) {
     return MAKE_ERROR(Error::kNoSuchEntry);
@@ -319,12 +482,11 @@ Error CloseLayer(unsigned int layer_id) {
   const auto pos = layer->GetPosition();
   const auto size = layer->GetWindow()->Size();
 
-  __asm__("cli");
   active_layer->Activate(0);
   layer_manager->RemoveLayer(layer_id);
   layer_manager->Draw({pos, size});
-  layer_task_map->erase(layer_id);
-  __asm__("sti");
+
+  SetLayerTask(layer_id, 0);
 
   return MAKE_ERROR(Error::kSuccess);
 }
@@ -11,6 +11,7 @@
 #include <vector>
 
 #include "graphics.hpp"
+#include "lock.hpp"
 #include "window.hpp"
 #include "message.hpp"
 
@@ -44,6 +45,11 @@ class Layer {
 
   /** @brief 指定された描画先にウィンドウの内容を描画する。 */
   void DrawTo(FrameBuffer& screen, const Rectangle<int>& area) const;
+  /** @brief ウィンドウが表示領域の全体で下のレイヤーを隠すなら true を返す。
+   *
+   * 透過色を設定したウィンドウ（マウスカーソルなど）のレイヤーは透過で，下のレイヤーの上に重ねて描く。
+   */
+  bool IsOpaque() const;
 
  private:
   unsigned int id_;
@@ -52,6 +58,13 @@ class Layer {
   bool draggable_{false};
 };
 
+/** @brief 重ね合わせの統計 */
+struct CompositeStat {
+  uint64_t composites; // 重ね合わせた回数
+  uint64_t cycles;     // 重ね合わせにかかった TSC サイクル数の合計
+  uint64_t pixels;     // レイヤーからバックバッファへ書いたピクセル数（透過レイヤーは範囲全体で数える）
+};
+
 /** @brief LayerManager は複数のレイヤーを管理する。 */
 class LayerManager {
  public:
@@ -65,13 +78,21 @@ class LayerManager {
   /** @brief 指定されたレイヤーを削除する。 */
   void RemoveLayer(unsigned int id);
 
-  /** @brief 現在表示状態にあるレイヤーを描画する。 */
+  /** @brief 現在表示状態にあるレイヤーを描画する。
+   *
+   * 不透過なレイヤーに隠された部分は描かないので，画面の各ピクセルは
+   * 最も上の不透過なレイヤーから 1 回だけ書かれ，その上に透過レイヤーが重なる。
+   */
   void Draw(const Rectangle<int>& area) const;
   /** @brief 指定したレイヤーに設定されているウィンドウの描画領域内を再描画する。 */
   void Draw(unsigned int id) const;
   /** @brief 指定したレイヤーに設定されているウィンドウ内の指定された範囲を再描画する。 */
   void Draw(unsigned int id, Rectangle<int> area) const;
 
+  /** @brief false にすると，隠れた部分も含めて全レイヤーを下から順に描く（比較用）。 */
+  void SetOcclusionCulling(bool enable) { occlusion_culling_ = enable; }
+  CompositeStat GetCompositeStat() const { return stat_; }
+
   /** @brief レイヤーの位置情報を指定された絶対座標へと更新する。再描画する。 */
   void Move(unsigned int id, Vector2D<int> new_pos);
   /** @brief レイヤーの位置情報を指定された相対座標へと更新する。再描画する。 */
@@ -94,12 +115,24 @@ class LayerManager {
   /** @brief 指定されたレイヤーの現在の高さを返す。 */
   int GetHeight(unsigned int id);
 
+  /** @brief 複数の操作をまとめて排他したいときに使うミューテックスを返す。
+   *
+   * 各メソッドも内部でこのミューテックスを取得する（再帰的に取得できる）。
+   */
+  Mutex& GetMutex() const { return mutex_; }
+
  private:
   FrameBuffer* screen_{nullptr};
   mutable FrameBuffer back_buffer_{};
   std::vector<std::unique_ptr<Layer>> layers_{};
   std::vector<Layer*> layer_stack_{};
   unsigned int latest_id_{0};
+  mutable Mutex mutex_{"layer"};
+  bool occlusion_culling_{true};
+  mutable CompositeStat stat_{};
+
+  /** @brief area の範囲で，表示状態にあるレイヤーをバックバッファに重ね合わせる。 */
+  void Composite(Rectangle<int> area) const;
 };
 
 extern LayerManager* layer_manager;
@@ -110,15 +143,38 @@ class ActiveLayer {
   void SetMouseLayer(unsigned int mouse_layer);
   void Activate(unsigned int layer_id);
   unsigned int GetActive() const { return active_layer_; }
+  /** @brief アクティブなレイヤーの入力を受け取るタスク。いなければ 0。
+   *
+   * 入力ドライバがロックを取らずに参照するためのキャッシュで、
+   * Activate と SetLayerTask, ReplaceLayerTask が layer_task_map_lock を保持して更新する。
+   */
+  uint64_t FocusedTask() const { return focused_task_; }
 
  private:
   LayerManager& manager_;
-  unsigned int active_layer_{0};
+  volatile unsigned int active_layer_{0};
   unsigned int mouse_layer_{0};
+  volatile uint64_t focused_task_{0};
+
+  friend void SetLayerTask(unsigned int layer_id, uint64_t task_id);
+  friend bool ReplaceLayerTask(unsigned int layer_id, uint64_t expected, uint64_t task_id);
 };
 
 extern ActiveLayer* active_layer;
 extern std::map<unsigned int, uint64_t>* layer_task_map;
+/** @brief layer_task_map を保護するロック。保持したままレイヤーやタスクを操作しないこと。 */
+extern TicketLock* layer_task_map_lock;
+
+/** @brief レイヤー layer_id の入力を受け取るタスクを task_id にする。0 なら登録を消す。
+ *
+ * layer_task_map を直接書き換えず、これを使うこと。アクティブなレイヤーなら
+ * 入力の送り先（ActiveLayer::FocusedTask）もすぐに切り替わる。
+ */
+void SetLayerTask(unsigned int layer_id, uint64_t task_id);
+/** @brief レイヤー layer_id の入力を受け取るタスク。いなければ 0。 */
+uint64_t GetLayerTask(unsigned int layer_id);
+/** @brief 入力を受け取るタスクが expected のときだけ task_id に変える。変えたら true を返す。 */
+bool ReplaceLayerTask(unsigned int layer_id, uint64_t expected, uint64_t task_id);
 
 void InitializeLayer();
 void ProcessLayerMessage(const Message& msg);
@@ -133,6 +189,7 @@ constexpr Message MakeLayerMessage(
   msg.arg.layer.y = area.pos.y;
   msg.arg.layer.w = area.size.x;
   msg.arg.layer.h = area.size.y;
+  msg.arg.layer.input_tsc = 0;
   return msg;
 }
 
@@ -0,0 +1,172 @@
+#include "lock.hpp"
+
+#include <algorithm>
+
+#include "asmfunc.h"
+#include "irqtrace.hpp"
+#include "task.hpp"
+
+namespace {
+  LockBase* lock_list;
+}
+
+LockBase::LockBase(const char* name) : stat_{name, 0, 0, 0, 0, 0} {
+  const bool irq_enabled = InterruptEnabled();
+  DisableInterrupts();
+  next_ = lock_list;
+  lock_list = this;
+  if (irq_enabled) {
+    EnableInterrupts();
+  }
+}
+
+LockBase::~LockBase() {
+  const bool irq_enabled = InterruptEnabled();
+  DisableInterrupts();
+  for (auto p = &lock_list; *p; p = &(*p)->next_) {
+    if (*p == this) {
+      *p = next_;
+      break;
+    }
+  }
+  if (irq_enabled) {
+    EnableInterrupts();
+  }
+}
+
+void LockBase::RecordAcquire(uint64_t wait_start, bool contended) {
+  hold_start_ = ReadTSC();
+  ++stat_.acquisitions;
+  if (contended) {
+    ++stat_.contentions;
+    stat_.wait_cycles += hold_start_ - wait_start;
+  }
+}
+
+void LockBase::RecordRelease() {
+  const uint64_t hold = ReadTSC() - hold_start_;
+  stat_.hold_cycles += hold;
+  stat_.max_hold_cycles = std::max(stat_.max_hold_cycles, hold);
+}
+
+void SpinLock::Lock(const char* file, int line) {
+  const uint64_t start = ReadTSC();
+  const bool irq_enabled = InterruptEnabled();
+  DisableInterrupts(file, line);
+
+  bool contended = false;
+  while (__atomic_exchange_n(&locked_, true, __ATOMIC_ACQUIRE)) {
+    contended = true;
+    __asm__ volatile("pause");
+  }
+  irq_enabled_ = irq_enabled;
+  RecordAcquire(start, contended);
+}
+
+void SpinLock::Unlock(const char* file, int line) {
+  RecordRelease();
+  const bool irq_enabled = irq_enabled_;
+  __atomic_store_n(&locked_, false, __ATOMIC_RELEASE);
+  if (irq_enabled) {
+    EnableInterrupts(file, line);
+  }
+}
+
+bool SpinLock::UnlockKeepIrqOff() {
+  RecordRelease();
+  const bool irq_enabled = irq_enabled_;
+  __atomic_store_n(&locked_, false, __ATOMIC_RELEASE);
+  return irq_enabled;
+}
+
+void TicketLock::Lock(const char* file, int line) {
+  const uint64_t start = ReadTSC();
+  const bool irq_enabled = InterruptEnabled();
+  DisableInterrupts(file, line);
+
+  const uint32_t ticket = __atomic_fetch_add(&next_ticket_, 1, __ATOMIC_RELAXED);
+  bool contended = false;
+  while (__atomic_load_n(&now_serving_, __ATOMIC_ACQUIRE) != ticket) {
+    contended = true;
+    __asm__ volatile("pause");
+  }
+  irq_enabled_ = irq_enabled;
+  RecordAcquire(start, contended);
+}
+
+void TicketLock::Unlock(const char* file, int line) {
+  RecordRelease();
+  const bool irq_enabled = irq_enabled_;
+  __atomic_store_n(&now_serving_, now_serving_ + 1, __ATOMIC_RELEASE);
+  if (irq_enabled) {
+    EnableInterrupts(file, line);
+  }
+}
+
+void Mutex::Lock(const char* file, int line) {
+  const uint64_t start = ReadTSC();
+  const bool irq_enabled = InterruptEnabled();
+  DisableInterrupts(file, line);
+
+  Task* self = task_manager ? &task_manager->CurrentTask() : nullptr;
+  if (depth_ > 0 && owner_ == self) {
+    ++depth_;
+  } else {
+    bool contended = false;
+    while (depth_ > 0) {
+      contended = true;
+      // メッセージの到着でも起こされるので，待ち行列に二重に並ばないようにする
+      if (std::find(waiters_.begin(), waiters_.end(), self) == waiters_.end()) {
+        waiters_.push_back(self);
+      }
+      self->Sleep();
+    }
+    // Unlock 以外で起こされて取れた場合は待ち行列に残っている．残したままにすると
+    // 次の Unlock がこのタスクを起こしてしまい，本当に待っているタスクが起きない
+    if (contended) {
+      auto it = std::find(waiters_.begin(), waiters_.end(), self);
+      if (it != waiters_.end()) {
+        waiters_.erase(it);
+      }
+    }
+    owner_ = self;
+    depth_ = 1;
+    RecordAcquire(start, contended);
+  }
+
+  if (irq_enabled) {
+    EnableInterrupts(file, line);
+  }
+}
+
+void Mutex::Unlock(const char* file, int line) {
+  const bool irq_enabled = InterruptEnabled();
+  DisableInterrupts(file, line);
+
+  if (--depth_ == 0) {
+    RecordRelease();
+    owner_ = nullptr;
+    if (!waiters_.empty()) {
+      Task* next = waiters_.front();
+      waiters_.pop_front();
+      next->Wakeup();
+    }
+  }
+
+  if (irq_enabled) {
+    EnableInterrupts(file, line);
+  }
+}
+
+std::vector<LockStat> LockStats() {
+  std::vector<LockStat> stats;
+  const bool irq_enabled = InterruptEnabled();
+  DisableInterrupts();
+  for (auto p = lock_list; p; p = p->next_) {
+    stats.push_back(p->Stat());
+  }
+  if (irq_enabled) {
+    EnableInterrupts();
+  }
+  return stats;
+}
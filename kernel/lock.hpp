@@ -0,0 +1,117 @@
+/**
+ * @file lock.hpp
+ *
+ * カーネル内の排他制御プリミティブ．どれも取得の競合と保持時間を記録する．
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <deque>
+#include <vector>
+
+class Task;
+struct LockStat;
+std::vector<LockStat> LockStats();
+
+/** @brief ロック 1 つ分の統計．時間は TSC のサイクル数 */
+struct LockStat {
+  const char* name;
+  uint64_t acquisitions;
+  uint64_t contentions;  // 取得しようとしたとき他が保持していた回数
+  uint64_t wait_cycles;  // 取得を待った時間の合計
+  uint64_t hold_cycles;  // 保持していた時間の合計
+  uint64_t max_hold_cycles;
+};
+
+/** @brief 統計を持つロックの共通部分．生成するとロックの一覧に登録される． */
+class LockBase {
+ public:
+  LockBase(const char* name);
+  ~LockBase();
+  LockBase(const LockBase&) = delete;
+  LockBase& operator=(const LockBase&) = delete;
+
+  const LockStat& Stat() const { return stat_; }
+
+ protected:
+  /** @brief wait_start に取得を始め，今取得できたことを記録する． */
+  void RecordAcquire(uint64_t wait_start, bool contended);
+  void RecordRelease();
+
+ private:
+  LockStat stat_;
+  uint64_t hold_start_{0};
+  LockBase* next_{nullptr};
+
+  friend std::vector<LockStat> LockStats();
+};
+
+/** @brief 割り込みを禁止して保持するスピンロック．割り込みハンドラとも共有できる．
+ *
+ * Lock 前の割り込み許可状態を Unlock で元に戻す．
+ */
+class SpinLock : public LockBase {
+ public:
+  using LockBase::LockBase;
+  void Lock(const char* file = __builtin_FILE(), int line = __builtin_LINE());
+  void Unlock(const char* file = __builtin_FILE(), int line = __builtin_LINE());
+  /** @brief 割り込みを禁止したままロックを解放する．
+   *
+   * コンテキストスイッチの直前に使う．Lock 前に割り込みが許可されていたかを返す．
+   */
+  bool UnlockKeepIrqOff();
+
+ private:
+  volatile bool locked_{false};
+  bool irq_enabled_{false};
+};
+
+/** @brief 到着順に取得できるスピンロック．SpinLock と同じく割り込みを禁止して保持する． */
+class TicketLock : public LockBase {
+ public:
+  using LockBase::LockBase;
+  void Lock(const char* file = __builtin_FILE(), int line = __builtin_LINE());
+  void Unlock(const char* file = __builtin_FILE(), int line = __builtin_LINE());
+
+ private:
+  volatile uint32_t next_ticket_{0}, now_serving_{0};
+  bool irq_enabled_{false};
+};
+
+/** @brief 取得できるまでタスクを眠らせるミューテックス．
+ *
+ * 保持しているタスクは再帰的に Lock できる．割り込みハンドラからは使えない．
+ */
+class Mutex : public LockBase {
+ public:
+  using LockBase::LockBase;
+  void Lock(const char* file = __builtin_FILE(), int line = __builtin_LINE());
+  void Unlock(const char* file = __builtin_FILE(), int line = __builtin_LINE());
+
+ private:
+  Task* owner_{nullptr};
+  int depth_{0};
+  std::deque<Task*> waiters_{};
+};
+
+/** @brief スコープを抜けるまでロックを保持する． */
+template <class L>
+class LockGuard {
+ public:
+  LockGuard(L& lock, const char* file = __builtin_FILE(), int line = __builtin_LINE())
+      : lock_{lock}, file_{file}, line_{line} {
+    lock_.Lock(file_, line_);
+  }
+  ~LockGuard() { lock_.Unlock(file_, line_); }
+  LockGuard(const LockGuard&) = delete;
+  LockGuard& operator=(const LockGuard&) = delete;
+
+ private:
+  L& lock_;
+  const char* file_;
+  int line_;
+};
+
+/** @brief 登録されているすべてのロックの統計をコピーして返す． */
+std::vector<LockStat> LockStats();
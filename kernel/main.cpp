@@ -23,20 +23,28 @@
 #include "logger.hpp"
 #include "usb/xhci/xhci.hpp"
 #include "interrupt.hpp"
+#include "apic.hpp"
+#include "irqtrace.hpp"
 #include "asmfunc.h"
 #include "segment.hpp"
+#include "percpu.hpp"
 #include "paging.hpp"
 #include "memory_manager.hpp"
 #include "window.hpp"
 #include "layer.hpp"
 #include "message.hpp"
 #include "timer.hpp"
+#include "workqueue.hpp"
+#include "clock.hpp"
+#include "idle.hpp"
 #include "acpi.hpp"
+#include "kernel_stack.hpp"
 #include "keyboard.hpp"
 #include "task.hpp"
 #include "terminal.hpp"
 #include "fat.hpp"
 #include "syscall.hpp"
+#include "fiber.hpp"
 
 int printk(const char* format, ...) {
   va_list ap;
@@ -132,22 +140,25 @@ extern "C" void KernelMainNewStack(
   SetLogLevel(kWarn);
 
   InitializeSegmentation();
+  InitializePerCPU();
   InitializePaging();
   InitializeMemoryManager(memory_map);
   InitializeTSS();
   InitializeInterrupt();
+  InitializeLAPIC();
 
   fat::Initialize(volume_image);
   InitializeFont();
-  InitializePCI();
-
   InitializeLayer();
   InitializeMainWindow();
   InitializeTextWindow();
   layer_manager->Draw({{0, 0}, ScreenSize()});
 
   acpi::Initialize(acpi_table);
+  InitializeClock();
+  InitializePCI();
   InitializeLAPICTimer();
+  InitializeIdle();
 
   const int kTextboxCursorTimer = 1;
   const int kTimer05Sec = static_cast<int>(kTimerFreq * 0.5);
@@ -156,8 +167,11 @@ extern "C" void KernelMainNewStack(
 
   InitializeSyscall();
 
+  InitializeKernelStackPool();
   InitializeTask();
   Task& main_task = task_manager->CurrentTask();
+  InitializeWorkQueue();
+  InitializeFiber();
 
   usb::xhci::Initialize();
   InitializeKeyboard();
@@ -171,35 +185,30 @@ extern "C" void KernelMainNewStack(
   char str[128];
 
   while (true) {
-    __asm__("cli");
+    DisableInterrupts();
     const auto tick = timer_manager->CurrentTick();
-    __asm__("sti");
+    EnableInterrupts();
 
     sprintf(str, "%010lu", tick);
     FillRectangle(*main_window->InnerWriter(), {20, 4}, {8 * 10, 16}, {0xc6, 0xc6, 0xc6});
     WriteString(*main_window->InnerWriter(), {20, 4}, str, {0, 0, 0});
     layer_manager->Draw(main_window_layer_id);
 
-    __asm__("cli");
+    DisableInterrupts();
     auto msg = main_task.ReceiveMessage();
     if (!msg) {
       main_task.Sleep();
-      __asm__("sti");
+      EnableInterrupts();
       continue;
     }
 
-    __asm__("sti");
+    EnableInterrupts();
 
     switch (msg->type) {
-    case Message::kInterruptXHCI:
-      usb::xhci::ProcessEvents();
-      break;
     case Message::kTimerTimeout:
       if (msg->arg.timer.value == kTextboxCursorTimer) {
-        __asm__("cli");
         timer_manager->AddTimer(
             Timer{msg->arg.timer.timeout + kTimer05Sec, kTextboxCursorTimer, 1});
-        __asm__("sti");
         textbox_cursor_visible = !textbox_cursor_visible;
         DrawTextCursor(textbox_cursor_visible);
         layer_manager->Draw(text_window_layer_id);
@@ -209,32 +218,29 @@ extern "C" void KernelMainNewStack(
       if (auto act = active_layer->GetActive(); act == text_window_layer_id) {
         if (msg->arg.keyboard.press) {
           InputTextWindow(msg->arg.keyboard.ascii);
+          RecordKeyEcho(msg->arg.keyboard.tsc);
         }
       } else if (msg->arg.keyboard.press &&
                  msg->arg.keyboard.keycode == 59 /* F2 */) {
         task_manager->NewTask()
           .InitContext(TaskTerminal, 0)
           .Wakeup();
-      } else {
-        __asm__("cli");
-        auto task_it = layer_task_map->find(act);
-        __asm__("sti");
-        if (task_it != layer_task_map->end()) {
-          __asm__("cli");
-          task_manager->SendMessage(task_it->second, *msg);
-          __asm__("sti");
-        } else {
-          printk("key push not handled: keycode %02x, ascii %02x\n",
-              msg->arg.keyboard.keycode,
-              msg->arg.keyboard.ascii);
-        }
+      } else if (msg->arg.keyboard.press) {
+        // ウィンドウのタスクへはキーボードドライバが直接送るので，ここへ来るのは
+        // 入力を受け取るタスクのないレイヤーへのキーだけ
+        printk("key push not handled: keycode %02x, ascii %02x\n",
+            msg->arg.keyboard.keycode,
+            msg->arg.keyboard.ascii);
       }
       break;
     case Message::kLayer:
       ProcessLayerMessage(*msg);
-      __asm__("cli");
+      if (msg->arg.layer.input_tsc) {
+        RecordKeyEcho(msg->arg.layer.input_tsc);
+      }
+      DisableInterrupts();
       task_manager->SendMessage(msg->src_task, Message{Message::kLayerFinish});
-      __asm__("sti");
+      EnableInterrupts();
       break;
     default:
       Log(kError, "Unknown message type: %d\n", msg->type);
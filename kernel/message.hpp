@@ -6,7 +6,6 @@ enum class LayerOperation {
 
 struct Message {
   enum Type {
-    kInterruptXHCI,
     kTimerTimeout,
     kKeyPush,
     kLayer,
@@ -14,7 +13,6 @@ struct Message {
     kMouseMove,
     kMouseButton,
     kWindowActive,
-    kPipe,
     kWindowClose,
   } type;
 
@@ -24,6 +22,9 @@ struct Message {
     struct {
       unsigned long timeout;
       int value;
+      bool app;               // アプリが作ったタイマーなら true
+      unsigned long overrun;  // 周期タイマーで，発火できずに飛ばした回数
+      uint64_t handle;
     } timer;
 
     struct {
@@ -31,6 +32,7 @@ struct Message {
       uint8_t keycode;
       char ascii;
       int press;
+      uint64_t tsc;  // キーボードドライバがキーを受け取った時点の TSC
     } keyboard;
 
     struct {
@@ -38,6 +40,7 @@ struct Message {
       unsigned int layer_id;
       int x, y;
       int w, h;
+      uint64_t input_tsc;  // キー入力のエコーなら，そのキーの keyboard.tsc．それ以外は 0
     } layer;
 
     struct {
@@ -56,11 +59,6 @@ struct Message {
       int activate; // 1: activate, 0: deactivate
     } window_active;
 
-    struct {
-      char data[16];
-      uint8_t len;
-    } pipe;
-
     struct {
       unsigned int layer_id;
     } window_close;
@@ -44,12 +44,7 @@ namespace {
     if (!layer) {
       return { nullptr, 0 };
     }
-
-    const auto task_it = layer_task_map->find(act);
-    if (task_it == layer_task_map->end()) {
-      return { layer, 0 };
-    }
-    return { layer, task_it->second };
+    return { layer, active_layer->FocusedTask() };
   }
 
   void SendMouseMessage(Vector2D<int> newpos, Vector2D<int> posdiff,
@@ -5,6 +5,7 @@
 #include "asmfunc.h"
 #include "memory_manager.hpp"
 #include "task.hpp"
+#include "time_page.hpp"
 
 #include "logger.hpp"
 
@@ -37,7 +38,11 @@ void InitializePaging() {
 }
 
 void ResetCR3() {
-  SetCR3(reinterpret_cast<uint64_t>(&pml4_table[0]));
+  SetCR3(KernelCR3());
+}
+
+uint64_t KernelCR3() {
+  return reinterpret_cast<uint64_t>(&pml4_table[0]);
 }
 
 namespace {
@@ -229,21 +234,114 @@ Error CopyPageMaps(PageMapEntry* dest, PageMapEntry* src, int part, int start) {
   return MAKE_ERROR(Error::kSuccess);
 }
 
+Error MapKernelPage(uint64_t vaddr, uint64_t paddr) {
+  LinearAddress4Level addr{vaddr};
+  auto page_map = reinterpret_cast<PageMapEntry*>(&pml4_table[0]);
+  for (int level = 4; level > 1; --level) {
+    auto& entry = page_map[addr.Part(level)];
+    auto [ child_map, err ] = SetNewPageMapIfNotPresent(entry);
+    if (err) {
+      return err;
+    }
+    entry.bits.writable = 1;
+    page_map = child_map;
+  }
+
+  auto& entry = page_map[addr.Part(1)];
+  entry.data = 0;
+  entry.SetPointer(reinterpret_cast<PageMapEntry*>(paddr));
+  entry.bits.present = 1;
+  entry.bits.writable = 1;
+  InvalidateTLB(vaddr);
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+Error MapUserPage(uint64_t vaddr, uint64_t paddr) {
+  LinearAddress4Level addr{vaddr};
+  auto page_map = reinterpret_cast<PageMapEntry*>(GetCR3());
+  for (int level = 4; level > 1; --level) {
+    auto& entry = page_map[addr.Part(level)];
+    auto [ child_map, err ] = SetNewPageMapIfNotPresent(entry);
+    if (err) {
+      return err;
+    }
+    entry.bits.writable = 1;
+    entry.bits.user = 1;
+    page_map = child_map;
+  }
+
+  // 書き込み不可にしておけば CleanPageMaps はこのフレームを解放しない
+  auto& entry = page_map[addr.Part(1)];
+  entry.data = 0;
+  entry.SetPointer(reinterpret_cast<PageMapEntry*>(paddr));
+  entry.bits.present = 1;
+  entry.bits.user = 1;
+  InvalidateTLB(vaddr);
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+WithError<uint64_t> TranslateAddress(uint64_t vaddr) {
+  LinearAddress4Level addr{vaddr};
+  auto page_map = reinterpret_cast<PageMapEntry*>(GetCR3());
+  for (int level = 4; level > 0; --level) {
+    const auto entry = page_map[addr.Part(level)];
+    if (!entry.bits.present) {
+      return { 0, MAKE_ERROR(Error::kNoSuchEntry) };
+    }
+    if (level == 1 || (level <= 3 && entry.bits.huge_page)) {
+      const uint64_t page_mask = (uint64_t{1} << (12 + 9 * (level - 1))) - 1;
+      const uint64_t page_base = entry.bits.addr << 12 & ~page_mask;
+      return { page_base | (vaddr & page_mask), MAKE_ERROR(Error::kSuccess) };
+    }
+    page_map = entry.Pointer();
+  }
+  return { 0, MAKE_ERROR(Error::kNoSuchEntry) };
+}
+
+Error PrepareUserWrite(uint64_t vaddr) {
+  LinearAddress4Level addr{vaddr};
+  auto page_map = reinterpret_cast<PageMapEntry*>(GetCR3());
+  bool writable = true;
+  for (int level = 4; level > 0; --level) {
+    const auto entry = page_map[addr.Part(level)];
+    if (!entry.bits.present) {
+      // 書き込みのページフォルトと同じようにページを用意する
+      return HandlePageFault(0b110, vaddr);
+    }
+    writable = writable && entry.bits.writable;
+    if (level == 1 || (level <= 3 && entry.bits.huge_page)) {
+      if (writable) {
+        return MAKE_ERROR(Error::kSuccess);
+      }
+      return HandlePageFault(0b111, vaddr);
+    }
+    page_map = entry.Pointer();
+  }
+  return MAKE_ERROR(Error::kNoSuchEntry);
+}
+
 Error HandlePageFault(uint64_t error_code, uint64_t causal_addr) {
   auto& task = task_manager->CurrentTask();
   const bool present = (error_code >> 0) & 1;
   const bool rw      = (error_code >> 1) & 1;
   const bool user    = (error_code >> 2) & 1;
   if (present && rw && user) {
+    if ((causal_addr & 0xffff'ffff'ffff'f000) == TIME_PAGE_ADDR) {
+      // 時刻ページは全アプリで共有するので，書き込もうとしてもコピーしない
+      return MAKE_ERROR(Error::kAlreadyAllocated);
+    }
+    ++task.Stat().cow_faults;
     return CopyOnePage(causal_addr);
   } else if (present) {
     return MAKE_ERROR(Error::kAlreadyAllocated);
   }
 
   if (task.DPagingBegin() <= causal_addr && causal_addr < task.DPagingEnd()) {
+    ++task.Stat().demand_faults;
     return SetupPageMaps(LinearAddress4Level{causal_addr}, 1);
   }
   if (auto m = FindFileMapping(task.FileMaps(), causal_addr)) {
+    ++task.Stat().file_faults;
     return PreparePageCache(*task.Files()[m->fd], *m, causal_addr);
   }
   return MAKE_ERROR(Error::kIndexOutOfRange);
@@ -26,6 +26,8 @@ void SetupIdentityPageTable();
 
 void InitializePaging();
 void ResetCR3();
+/** @brief カーネル用ページテーブル（アプリを含まない）の CR3 の値を返す． */
+uint64_t KernelCR3();
 
 union LinearAddress4Level {
   uint64_t value;
@@ -96,3 +98,29 @@ Error SetupPageMaps(LinearAddress4Level addr, size_t num_4kpages,
 Error CleanPageMaps(LinearAddress4Level addr);
 Error CopyPageMaps(PageMapEntry* dest, PageMapEntry* src, int part, int start);
 Error HandlePageFault(uint64_t error_code, uint64_t causal_addr);
+
+/** @brief カーネルのページテーブルで仮想アドレス vaddr に物理アドレス paddr を対応付ける．
+ *
+ * ページはスーパーバイザ専用かつ書き込み可能となる．
+ * PML4 の下位半分はアプリ用 PML4 にもコピーされるので，全アドレス空間から見える．
+ */
+Error MapKernelPage(uint64_t vaddr, uint64_t paddr);
+
+/** @brief 現在のページテーブルで仮想アドレス vaddr に物理アドレス paddr を対応付ける．
+ *
+ * ページはアプリから読み出し専用となる．paddr のフレームは CleanPageMaps で解放されない．
+ */
+Error MapUserPage(uint64_t vaddr, uint64_t paddr);
+
+/** @brief 現在のページテーブルで仮想アドレス vaddr を物理アドレスに変換する．
+ *
+ * vaddr を含むページがマップされていなければ kNoSuchEntry を返す．
+ */
+WithError<uint64_t> TranslateAddress(uint64_t vaddr);
+
+/** @brief アプリが仮想アドレス vaddr に書き込んだときのページフォルト処理を先に済ませる．
+ *
+ * 未割り当てのページは割り当て，コピーオンライトのページはここでコピーする．
+ * 以後 TranslateAddress が返す物理アドレスは，アプリが書き込んでも変わらない．
+ */
+Error PrepareUserWrite(uint64_t vaddr);
@@ -6,8 +6,13 @@
 
 #include "pci.hpp"
 
+#include <algorithm>
+
+#include "acpi.hpp"
 #include "asmfunc.h"
+#include "clock.hpp"
 #include "logger.hpp"
+#include "paging.hpp"
 
 namespace {
   using namespace pci;
@@ -26,6 +31,88 @@ namespace {
         | (reg_addr & 0xfcu);
   }
 
+  /** @brief セグメント 0 のうち，ECAM でアクセスできるバスの範囲 */
+  struct ECAMRegion {
+    uint64_t base;  // start_bus の領域の先頭
+    uint8_t start_bus, end_bus;
+  };
+  std::array<ECAMRegion, 4> ecam_regions;
+  int num_ecam_regions = 0;
+  ConfigAccess config_access = ConfigAccess::kPortIO;
+  ScanTime scan_time{};
+
+  /** @brief ECAM でのレジスタのアドレス．その範囲の ECAM 領域がなければ nullptr */
+  volatile uint32_t* ECAMAddress(uint8_t bus, uint8_t device,
+                                 uint8_t function, uint16_t reg_addr) {
+    for (int i = 0; i < num_ecam_regions; ++i) {
+      const auto& region = ecam_regions[i];
+      if (region.start_bus <= bus && bus <= region.end_bus) {
+        return reinterpret_cast<volatile uint32_t*>(
+            region.base
+            + (static_cast<uint64_t>(bus - region.start_bus) << 20)
+            + (static_cast<uint64_t>(device) << 15)
+            + (static_cast<uint64_t>(function) << 12)
+            + (reg_addr & 0xffcu));
+      }
+    }
+    return nullptr;
+  }
+
+  /** @brief コンフィグレーション空間の 32 ビットレジスタを読む．ECAM が使えればそちらを使う */
+  uint32_t ReadConfig(uint8_t bus, uint8_t device, uint8_t function, uint16_t reg_addr) {
+    if (config_access == ConfigAccess::kECAM) {
+      if (auto reg = ECAMAddress(bus, device, function, reg_addr)) {
+        return *reg;
+      }
+    }
+    if (reg_addr >= kConfigSpaceSize) {
+      return 0xffffffffu;
+    }
+    WriteAddress(MakeAddress(bus, device, function, reg_addr));
+    return ReadData();
+  }
+
+  void WriteConfig(uint8_t bus, uint8_t device, uint8_t function,
+                   uint16_t reg_addr, uint32_t value) {
+    if (config_access == ConfigAccess::kECAM) {
+      if (auto reg = ECAMAddress(bus, device, function, reg_addr)) {
+        *reg = value;
+        return;
+      }
+    }
+    if (reg_addr >= kConfigSpaceSize) {
+      return;
+    }
+    WriteAddress(MakeAddress(bus, device, function, reg_addr));
+    WriteData(value);
+  }
+
+  /** @brief MCFG からセグメント 0 の ECAM 領域を登録する．1 つでも登録できたら true */
+  bool SetupECAM() {
+    if (acpi::mcfg == nullptr) {
+      return false;
+    }
+    const auto& mcfg = *acpi::mcfg;
+    for (size_t i = 0; i < mcfg.Count() && num_ecam_regions < ecam_regions.size(); ++i) {
+      const auto& alloc = mcfg[i];
+      // Device はセグメント番号を持たないので，セグメント 0 だけを扱う
+      if (alloc.segment != 0 || alloc.start_bus > alloc.end_bus) {
+        continue;
+      }
+      // 恒等マップの範囲になければ触れない
+      const uint64_t end = alloc.base_address
+        + ((static_cast<uint64_t>(alloc.end_bus - alloc.start_bus) + 1) << 20);
+      if (end > kPageDirectoryCount * (1ul << 30)) {
+        Log(kWarn, "ECAM %lx is out of the identity map\n", alloc.base_address);
+        continue;
+      }
+      ecam_regions[num_ecam_regions++] = {alloc.base_address, alloc.start_bus, alloc.end_bus};
+      Log(kInfo, "ECAM: buses %02x-%02x at %lx\n",
+          alloc.start_bus, alloc.end_bus, alloc.base_address);
+    }
+    return num_ecam_regions > 0;
+  }
+
   /** @brief devices[num_device] に情報を書き込み num_device をインクリメントする． */
   Error AddDevice(const Device& device) {
     if (num_device == devices.size()) {
@@ -150,9 +237,9 @@ namespace {
   }
 
   /** @brief 指定された MSI レジスタを設定する */
-  Error ConfigureMSIRegister(const Device& dev, uint8_t cap_addr,
-                            uint32_t msg_addr, uint32_t msg_data,
-                            unsigned int num_vector_exponent) {
+  WithError<int> ConfigureMSIRegister(const Device& dev, uint8_t cap_addr,
+                                      uint32_t msg_addr, uint32_t msg_data,
+                                      unsigned int num_vector_exponent) {
     auto msi_cap = ReadMSICapability(dev, cap_addr);
 
     if (msi_cap.header.bits.multi_msg_capable <= num_vector_exponent) {
@@ -167,14 +254,46 @@ namespace {
     msi_cap.msg_data = msg_data;
 
     WriteMSICapability(dev, cap_addr, msi_cap);
-    return MAKE_ERROR(Error::kSuccess);
+    return { 1 << msi_cap.header.bits.multi_msg_enable, MAKE_ERROR(Error::kSuccess) };
   }
 
-  /** @brief 指定された MSI レジスタを設定する */
-  Error ConfigureMSIXRegister(const Device& dev, uint8_t cap_addr,
-                             uint32_t msg_addr, uint32_t msg_data,
-                             unsigned int num_vector_exponent) {
-    return MAKE_ERROR(Error::kNotImplemented);
+  /** @brief 指定された MSI-X レジスタとテーブルを設定する */
+  WithError<int> ConfigureMSIXRegister(const Device& dev, uint8_t cap_addr,
+                                       uint32_t msg_addr, uint32_t msg_data,
+                                       unsigned int num_vector_exponent) {
+    MSIXCapability msix_cap{};
+    msix_cap.header.data = ReadConfReg(dev, cap_addr);
+    msix_cap.table_offset_bir = ReadConfReg(dev, cap_addr + 4);
+
+    auto [ bar, err ] = ReadBar(dev, msix_cap.table_offset_bir & 0x7u);
+    if (err) {
+      return { 0, err };
+    }
+    auto table = reinterpret_cast<volatile MSIXTableEntry*>(
+        (bar & ~static_cast<uint64_t>(0xf)) + (msix_cap.table_offset_bir & ~0x7u));
+
+    const int table_size = msix_cap.header.bits.table_size + 1;
+    const int num_vectors = std::min(1 << num_vector_exponent, table_size);
+
+    // テーブルを書き換える間は全ベクタをマスクしておく
+    msix_cap.header.bits.function_mask = 1;
+    msix_cap.header.bits.msix_enable = 1;
+    WriteConfReg(dev, cap_addr, msix_cap.header.data);
+
+    for (int i = 0; i < table_size; ++i) {
+      if (i < num_vectors) {
+        table[i].msg_addr = msg_addr;
+        table[i].msg_upper_addr = 0;
+        table[i].msg_data = msg_data + i;
+        table[i].vector_control = 0;
+      } else {
+        table[i].vector_control = 1;
+      }
+    }
+
+    msix_cap.header.bits.function_mask = 0;
+    WriteConfReg(dev, cap_addr, msix_cap.header.data);
+    return { num_vectors, MAKE_ERROR(Error::kSuccess) };
   }
 }
 
@@ -192,23 +311,19 @@ namespace pci {
   }
 
   uint16_t ReadVendorId(uint8_t bus, uint8_t device, uint8_t function) {
-    WriteAddress(MakeAddress(bus, device, function, 0x00));
-    return ReadData() & 0xffffu;
+    return ReadConfig(bus, device, function, 0x00) & 0xffffu;
   }
 
   uint16_t ReadDeviceId(uint8_t bus, uint8_t device, uint8_t function) {
-    WriteAddress(MakeAddress(bus, device, function, 0x00));
-    return ReadData() >> 16;
+    return ReadConfig(bus, device, function, 0x00) >> 16;
   }
 
   uint8_t ReadHeaderType(uint8_t bus, uint8_t device, uint8_t function) {
-    WriteAddress(MakeAddress(bus, device, function, 0x0c));
-    return (ReadData() >> 16) & 0xffu;
+    return (ReadConfig(bus, device, function, 0x0c) >> 16) & 0xffu;
   }
 
   ClassCode ReadClassCode(uint8_t bus, uint8_t device, uint8_t function) {
-    WriteAddress(MakeAddress(bus, device, function, 0x08));
-    auto reg = ReadData();
+    auto reg = ReadConfig(bus, device, function, 0x08);
     ClassCode cc;
     cc.base       = (reg >> 24) & 0xffu;
     cc.sub        = (reg >> 16) & 0xffu;
@@ -217,8 +332,7 @@ namespace pci {
   }
 
   uint32_t ReadBusNumbers(uint8_t bus, uint8_t device, uint8_t function) {
-    WriteAddress(MakeAddress(bus, device, function, 0x18));
-    return ReadData();
+    return ReadConfig(bus, device, function, 0x18);
   }
 
   bool IsSingleFunctionDevice(uint8_t header_type) {
@@ -244,17 +358,23 @@ namespace pci {
     return MAKE_ERROR(Error::kSuccess);
   }
 
-  uint32_t ReadConfReg(const Device& dev, uint8_t reg_addr) {
-    WriteAddress(MakeAddress(dev.bus, dev.device, dev.function, reg_addr));
-    return ReadData();
+  ScanTime GetScanTime() {
+    return scan_time;
   }
 
-  void WriteConfReg(const Device& dev, uint8_t reg_addr, uint32_t value) {
-    WriteAddress(MakeAddress(dev.bus, dev.device, dev.function, reg_addr));
-    WriteData(value);
+  uint32_t ReadConfReg(const Device& dev, uint16_t reg_addr) {
+    return ReadConfig(dev.bus, dev.device, dev.function, reg_addr);
   }
 
-  WithError<uint64_t> ReadBar(Device& device, unsigned int bar_index) {
+  void WriteConfReg(const Device& dev, uint16_t reg_addr, uint32_t value) {
+    WriteConfig(dev.bus, dev.device, dev.function, reg_addr, value);
+  }
+
+  ConfigAccess GetConfigAccess() {
+    return config_access;
+  }
+
+  WithError<uint64_t> ReadBar(const Device& device, unsigned int bar_index) {
     if (bar_index >= 6) {
       return {0, MAKE_ERROR(Error::kIndexOutOfRange)};
     }
@@ -285,8 +405,37 @@ namespace pci {
     return header;
   }
 
-  Error ConfigureMSI(const Device& dev, uint32_t msg_addr, uint32_t msg_data,
-                     unsigned int num_vector_exponent) {
+  ExtendedCapabilityHeader ReadExtendedCapabilityHeader(const Device& dev, uint16_t addr) {
+    ExtendedCapabilityHeader header;
+    header.data = ReadConfReg(dev, addr);
+    return header;
+  }
+
+  uint16_t FindExtendedCapability(const Device& dev, uint16_t cap_id) {
+    if (config_access != ConfigAccess::kECAM) {
+      return 0;
+    }
+    uint16_t addr = kExtendedCapabilityBase;
+    // 壊れたリストで回り続けないよう，たどる数に上限を設ける
+    for (int i = 0; addr != 0 && i < kExtendedConfigSpaceSize / 4; ++i) {
+      auto header = ReadExtendedCapabilityHeader(dev, addr);
+      // 拡張ケーパビリティがなければ 0x100 は 0（PCI デバイスなら 0xffffffff）
+      if (header.data == 0 || header.data == 0xffffffffu) {
+        return 0;
+      }
+      if (header.bits.cap_id == cap_id) {
+        return addr;
+      }
+      addr = header.bits.next_ptr & 0xffcu;
+      if (addr < kExtendedCapabilityBase) {
+        return 0;
+      }
+    }
+    return 0;
+  }
+
+  WithError<int> ConfigureMSI(const Device& dev, uint32_t msg_addr, uint32_t msg_data,
+                              unsigned int num_vector_exponent) {
     uint8_t cap_addr = ReadConfReg(dev, 0x34) & 0xffu;
     uint8_t msi_cap_addr = 0, msix_cap_addr = 0;
     while (cap_addr != 0) {
@@ -299,15 +448,16 @@ namespace pci {
       cap_addr = header.bits.next_ptr;
     }
 
-    if (msi_cap_addr) {
-      return ConfigureMSIRegister(dev, msi_cap_addr, msg_addr, msg_data, num_vector_exponent);
-    } else if (msix_cap_addr) {
+    // MSI-X ならベクタを自由に選べ，連続したベクタの境界合わせもいらない
+    if (msix_cap_addr) {
       return ConfigureMSIXRegister(dev, msix_cap_addr, msg_addr, msg_data, num_vector_exponent);
+    } else if (msi_cap_addr) {
+      return ConfigureMSIRegister(dev, msi_cap_addr, msg_addr, msg_data, num_vector_exponent);
     }
-    return MAKE_ERROR(Error::kNoPCIMSI);
+    return { 0, MAKE_ERROR(Error::kNoPCIMSI) };
   }
 
-  Error ConfigureMSIFixedDestination(
+  WithError<int> ConfigureMSIFixedDestination(
       const Device& dev, uint8_t apic_id,
       MSITriggerMode trigger_mode, MSIDeliveryMode delivery_mode,
       uint8_t vector, unsigned int num_vector_exponent) {
@@ -321,10 +471,28 @@ namespace pci {
 }
 
 void InitializePCI() {
+  // まずポート I/O で探索し，ECAM が使えれば ECAM で探索し直して時間を比べる
+  const uint64_t port_io_start = ReadTSC();
   if (auto err = pci::ScanAllBus()) {
     Log(kError, "ScanAllBus: %s\n", err.Name());
     exit(1);
   }
+  scan_time.port_io_cycles = ReadTSC() - port_io_start;
+
+  if (SetupECAM()) {
+    config_access = pci::ConfigAccess::kECAM;
+    const uint64_t ecam_start = ReadTSC();
+    if (auto err = pci::ScanAllBus()) {
+      Log(kError, "ScanAllBus: %s\n", err.Name());
+      exit(1);
+    }
+    scan_time.ecam_cycles = ReadTSC() - ecam_start;
+  }
+
+  const unsigned long cycles_per_us = std::max(tsc_freq / 1000000, 1ul);
+  Log(kInfo, "PCI: %d devices, scan %lu us with port I/O, %lu us with ECAM\n",
+      pci::num_device, scan_time.port_io_cycles / cycles_per_us,
+      scan_time.ecam_cycles / cycles_per_us);
 
   for (int i = 0; i < pci::num_device; ++i) {
     const auto& dev = pci::devices[i];
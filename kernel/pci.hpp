@@ -17,6 +17,16 @@ namespace pci {
   /** @brief CONFIG_DATA レジスタの IO ポートアドレス */
   const uint16_t kConfigData = 0x0cfc;
 
+  /** @brief コンフィグレーション空間の大きさ．ポート I/O で届くのは先頭 256 バイトだけ */
+  const uint16_t kConfigSpaceSize = 256;
+  const uint16_t kExtendedConfigSpaceSize = 4096;
+
+  /** @brief コンフィグレーション空間へのアクセス方法 */
+  enum class ConfigAccess {
+    kPortIO, // CONFIG_ADDRESS と CONFIG_DATA を使う
+    kECAM,   // MCFG が示すメモリマップドな領域を読み書きする
+  };
+
   /** @brief PCI デバイスのクラスコード */
   struct ClassCode {
     uint8_t base, sub, interface;
@@ -61,10 +71,19 @@ namespace pci {
     return ReadVendorId(dev.bus, dev.device, dev.function);
   }
 
-  /** @brief 指定された PCI デバイスの 32 ビットレジスタを読み取る */
-  uint32_t ReadConfReg(const Device& dev, uint8_t reg_addr);
-  /** @brief 指定された PCI デバイスの 32 ビットレジスタに書き込む */
-  void WriteConfReg(const Device& dev, uint8_t reg_addr, uint32_t value);
+  /** @brief 指定された PCI デバイスの 32 ビットレジスタを読み取る
+   *
+   * reg_addr が 256 以上（拡張コンフィグレーション空間）なら ECAM でしか読めず，
+   * ポート I/O で動いているときは 0xffffffff を返す．
+   */
+  uint32_t ReadConfReg(const Device& dev, uint16_t reg_addr);
+  /** @brief 指定された PCI デバイスの 32 ビットレジスタに書き込む
+   *
+   * ポート I/O で動いているとき，拡張コンフィグレーション空間への書き込みは無視される．
+   */
+  void WriteConfReg(const Device& dev, uint16_t reg_addr, uint32_t value);
+  /** @brief いま使っているコンフィグレーション空間へのアクセス方法 */
+  ConfigAccess GetConfigAccess();
 
   /** @brief バス番号レジスタを読み取る（ヘッダタイプ 1 用）
    *
@@ -89,11 +108,18 @@ namespace pci {
    */
   Error ScanAllBus();
 
+  /** @brief InitializePCI で ScanAllBus にかかった時間（TSC のサイクル数）．0 は未計測 */
+  struct ScanTime {
+    uint64_t port_io_cycles;
+    uint64_t ecam_cycles;
+  };
+  ScanTime GetScanTime();
+
   constexpr uint8_t CalcBarAddress(unsigned int bar_index) {
     return 0x10 + 4 * bar_index;
   }
 
-  WithError<uint64_t> ReadBar(Device& device, unsigned int bar_index);
+  WithError<uint64_t> ReadBar(const Device& device, unsigned int bar_index);
 
   /** @brief PCI ケーパビリティレジスタの共通ヘッダ */
   union CapabilityHeader {
@@ -115,6 +141,23 @@ namespace pci {
    */
   CapabilityHeader ReadCapabilityHeader(const Device& dev, uint8_t addr);
 
+  /** @brief PCI Express 拡張ケーパビリティの共通ヘッダ．拡張コンフィグレーション空間の 0x100 から並ぶ */
+  union ExtendedCapabilityHeader {
+    uint32_t data;
+    struct {
+      uint32_t cap_id : 16;
+      uint32_t version : 4;
+      uint32_t next_ptr : 12;
+    } __attribute__((packed)) bits;
+  } __attribute__((packed));
+
+  /** @brief 最初の拡張ケーパビリティのアドレス */
+  const uint16_t kExtendedCapabilityBase = 0x100;
+
+  ExtendedCapabilityHeader ReadExtendedCapabilityHeader(const Device& dev, uint16_t addr);
+  /** @brief ID が cap_id の拡張ケーパビリティのアドレスを返す．なければ（ECAM が使えない場合も）0 */
+  uint16_t FindExtendedCapability(const Device& dev, uint16_t cap_id);
+
   /** @brief MSI ケーパビリティ構造
    *
    * MSI ケーパビリティ構造は 64 ビットサポートの有無などで亜種が沢山ある．
@@ -142,15 +185,46 @@ namespace pci {
     uint32_t pending_bits;
   } __attribute__((packed));
 
+  /** @brief MSI-X ケーパビリティ構造の先頭 12 バイト */
+  struct MSIXCapability {
+    union {
+      uint32_t data;
+      struct {
+        uint32_t cap_id : 8;
+        uint32_t next_ptr : 8;
+        uint32_t table_size : 11; // エントリ数 - 1
+        uint32_t : 3;
+        uint32_t function_mask : 1;
+        uint32_t msix_enable : 1;
+      } __attribute__((packed)) bits;
+    } __attribute__((packed)) header;
+
+    uint32_t table_offset_bir; // 下位 3 ビットが BAR 番号，残りが BAR からのオフセット
+    uint32_t pba_offset_bir;
+  } __attribute__((packed));
+
+  /** @brief MSI-X テーブルの 1 エントリ．BAR が指すメモリ空間に置かれる． */
+  struct MSIXTableEntry {
+    uint32_t msg_addr;
+    uint32_t msg_upper_addr;
+    uint32_t msg_data;
+    uint32_t vector_control; // ビット 0 がマスク
+  } __attribute__((packed));
+
   /** @brief MSI または MSI-X 割り込みを設定する
+   *
+   * MSI-X に対応していれば MSI-X を使い，テーブルのエントリ i には
+   * msg_data + i のベクタを設定する．MSI の複数メッセージと同じく，ベクタ i は
+   * デバイスの i 番目の割り込み要因（xHCI ならインタラプタ i）に対応する．
    *
    * @param dev  設定対象の PCI デバイス
    * @param msg_addr  割り込み発生時にメッセージを書き込む先のアドレス
    * @param msg_data  割り込み発生時に書き込むメッセージの値
    * @param num_vector_exponent  割り当てるベクタ数（2^n の n を指定）
+   * @return 実際に割り当てたベクタ数
    */
-  Error ConfigureMSI(const Device& dev, uint32_t msg_addr, uint32_t msg_data,
-                     unsigned int num_vector_exponent);
+  WithError<int> ConfigureMSI(const Device& dev, uint32_t msg_addr, uint32_t msg_data,
+                              unsigned int num_vector_exponent);
 
   enum class MSITriggerMode {
     kEdge = 0,
@@ -166,10 +240,15 @@ namespace pci {
     kExtINT         = 0b111,
   };
 
-  Error ConfigureMSIFixedDestination(
+  WithError<int> ConfigureMSIFixedDestination(
       const Device& dev, uint8_t apic_id,
       MSITriggerMode trigger_mode, MSIDeliveryMode delivery_mode,
       uint8_t vector, unsigned int num_vector_exponent);
 }
 
+/** @brief PCI デバイスを探索する．
+ *
+ * MCFG があればコンフィグレーション空間へのアクセスを ECAM に切り替える．
+ * 探索にかかる時間を計るので acpi::Initialize と InitializeClock の後に呼ぶ．
+ */
 void InitializePCI();
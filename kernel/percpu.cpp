@@ -0,0 +1,21 @@
+#include "percpu.hpp"
+
+#include "asmfunc.h"
+#include "msr.hpp"
+#include "task.hpp"
+
+namespace {
+  PerCPU bsp_cpu;
+
+  // TaskManager ができるまでにタイマー割り込みが来たときの保存先
+  alignas(16) TaskContext boot_task_context;
+}
+
+void InitializePerCPU() {
+  bsp_cpu.self = &bsp_cpu;
+  bsp_cpu.context = &boot_task_context;
+
+  WriteMSR(kIA32_GS_BASE, reinterpret_cast<uint64_t>(&bsp_cpu));
+  // アプリの GS ベース．最初にユーザモードへ入るときに swapgs で GS ベースになる
+  WriteMSR(kIA32_KERNEL_GS_BASE, 0);
+}
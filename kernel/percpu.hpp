@@ -0,0 +1,47 @@
+/**
+ * @file percpu.hpp
+ *
+ * CPU ごとのデータ領域．カーネルの実行中は GS ベースがこの領域を指す．
+ *
+ * ユーザモードの間は GS ベースをアプリ用の値にしておき，カーネルへ入るときと
+ * 出るときに swapgs で IA32_KERNEL_GS_BASE と入れ替える．ユーザモードからの
+ * 割り込みを受け，この領域を使う（使う関数を呼ぶ）ハンドラは自分で swapgs すること．
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+class Task;
+struct TaskContext;
+
+struct PerCPU {
+  PerCPU* self;         // gs:0 から自分のアドレスを得るため
+  TaskContext* context; // 実行中のタスクのコンテキスト．タイマー割り込みが直接保存する
+  uint64_t kernel_rsp;  // 実行中のタスクがシステムコールで使う OS 用スタック
+  uint64_t user_rsp;    // システムコールの入口でアプリの RSP を一時的に置く
+  uint64_t syscalls;    // まだタスクの統計に足していないシステムコールの回数
+  Task* task;           // 実行中のタスク
+};
+
+// asmfunc.asm の PERCPU_* と一致させる
+static_assert(offsetof(PerCPU, context) == 0x08);
+static_assert(offsetof(PerCPU, kernel_rsp) == 0x10);
+static_assert(offsetof(PerCPU, user_rsp) == 0x18);
+static_assert(offsetof(PerCPU, syscalls) == 0x20);
+
+/** @brief 実行中の CPU の PerCPU を返す．GS ベースがカーネルのものである状態で呼ぶこと． */
+inline PerCPU* CurrentCPU() {
+  PerCPU* cpu;
+  __asm__ volatile("mov %%gs:0, %0" : "=r"(cpu));
+  return cpu;
+}
+
+/** @brief ユーザモードの GS ベースとカーネルの GS ベースを入れ替える． */
+inline void SwapGS() {
+  __asm__ volatile("swapgs" : : : "memory");
+}
+
+/** @brief BSP の PerCPU を用意し，GS ベースに設定する．SetDSAll の後に呼ぶ． */
+void InitializePerCPU();
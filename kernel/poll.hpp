@@ -0,0 +1,34 @@
+/**
+ * @file poll.hpp
+ *
+ * Poll システムコールで使う構造体．カーネルとアプリの双方から参照する．
+ */
+
+#pragma once
+
+#ifdef __cplusplus
+#include <cstdint>
+extern "C" {
+#else
+#include <stdint.h>
+#endif
+
+enum PollBits {
+  kPollIn   = 0x01, // ブロックせずに読める
+  kPollOut  = 0x04, // ブロックせずに書ける
+  kPollHup  = 0x10, // 書き手がいなくなった
+  kPollNval = 0x20, // fd が開かれていない
+};
+
+/** @brief fd に指定すると，ReadEvent で読めるウィンドウイベントを待つ */
+#define POLL_EVENT_FD (-2)
+
+struct PollFD {
+  int fd;
+  int16_t events;  // 待ちたい状態（PollBits の組み合わせ）
+  int16_t revents; // 満たされた状態．kPollHup と kPollNval は events に関わらず返る
+};
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
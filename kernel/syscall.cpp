@@ -4,6 +4,7 @@
 #include <cstdint>
 #include <cerrno>
 #include <cmath>
+#include <csignal>
 #include <fcntl.h>
 
 #include "asmfunc.h"
@@ -13,8 +14,14 @@
 #include "terminal.hpp"
 #include "font.hpp"
 #include "timer.hpp"
+#include "clock.hpp"
 #include "keyboard.hpp"
 #include "app_event.hpp"
+#include "futex.hpp"
+#include "irqtrace.hpp"
+#include "percpu.hpp"
+#include "poll.hpp"
+#include "wait_queue.hpp"
 
 namespace syscall {
   struct Result {
@@ -48,9 +55,9 @@ SYSCALL(PutString) {
     return { 0, E2BIG };
   }
 
-  __asm__("cli");
+  DisableInterrupts();
   auto& task = task_manager->CurrentTask();
-  __asm__("sti");
+  EnableInterrupts();
 
   if (fd < 0 || task.Files().size() <= fd || !task.Files()[fd]) {
     return { 0, EBADF };
@@ -59,9 +66,9 @@ SYSCALL(PutString) {
 }
 
 SYSCALL(Exit) {
-  __asm__("cli");
+  DisableInterrupts();
   auto& task = task_manager->CurrentTask();
-  __asm__("sti");
+  EnableInterrupts();
   return { task.OSStackPointer(), static_cast<int>(arg1) };
 }
 
@@ -71,7 +78,7 @@ SYSCALL(OpenWindow) {
   const auto win = std::make_shared<ToplevelWindow>(
       w, h, screen_config.pixel_format, title);
 
-  __asm__("cli");
+  LockGuard guard{layer_manager->GetMutex()};
   const auto layer_id = layer_manager->NewLayer()
     .SetWindow(win)
     .SetDraggable(true)
@@ -80,8 +87,7 @@ SYSCALL(OpenWindow) {
   active_layer->Activate(layer_id);
 
   const auto task_id = task_manager->CurrentTask().ID();
-  layer_task_map->insert(std::make_pair(layer_id, task_id));
-  __asm__("sti");
+  SetLayerTask(layer_id, task_id);
 
   return { layer_id, 0 };
 }
@@ -92,9 +98,9 @@ namespace {
     const uint32_t layer_flags = layer_id_flags >> 32;
     const unsigned int layer_id = layer_id_flags & 0xffffffff;
 
-    __asm__("cli");
+    DisableInterrupts();
     auto layer = layer_manager->FindLayer(layer_id);
-    __asm__("sti");
+    EnableInterrupts();
     if (layer == nullptr) {
       return { 0, EBADF };
     }
@@ -105,9 +111,9 @@ namespace {
     }
 
     if ((layer_flags & 1) == 0) {
-      __asm__("cli");
+      DisableInterrupts();
       layer_manager->Draw(layer_id);
-      __asm__("sti");
+      EnableInterrupts();
     }
 
     return res;
@@ -136,6 +142,10 @@ SYSCALL(GetCurrentTick) {
   return { timer_manager->CurrentTick(), kTimerFreq };
 }
 
+SYSCALL(GetTimeNanos) {
+  return { NowNanos(), 0 };
+}
+
 SYSCALL(WinRedraw) {
   return DoWinFunc(
       [](Window&) {
@@ -204,19 +214,19 @@ SYSCALL(ReadEvent) {
   const auto app_events = reinterpret_cast<AppEvent*>(arg1);
   const size_t len = arg2;
 
-  __asm__("cli");
+  DisableInterrupts();
   auto& task = task_manager->CurrentTask();
-  __asm__("sti");
+  EnableInterrupts();
   size_t i = 0;
 
   while (i < len) {
-    __asm__("cli");
+    DisableInterrupts();
     auto msg = task.ReceiveMessage();
-    if (!msg && i == 0) {
+    if (!msg && i == 0 && !task.Canceled()) {
       task.Sleep();
       continue;
     }
-    __asm__("sti");
+    EnableInterrupts();
 
     if (!msg) {
       break;
@@ -255,10 +265,12 @@ SYSCALL(ReadEvent) {
       ++i;
       break;
     case Message::kTimerTimeout:
-      if (msg->arg.timer.value < 0) {
+      if (msg->arg.timer.app) {
         app_events[i].type = AppEvent::kTimerTimeout;
-        app_events[i].arg.timer.timeout = msg->arg.timer.timeout;
-        app_events[i].arg.timer.value = -msg->arg.timer.value;
+        app_events[i].arg.timer.timeout = msg->arg.timer.timeout * 1000 / kTimerFreq;
+        app_events[i].arg.timer.value = msg->arg.timer.value;
+        app_events[i].arg.timer.overrun = msg->arg.timer.overrun;
+        app_events[i].arg.timer.handle = msg->arg.timer.handle;
         ++i;
       }
       break;
@@ -274,26 +286,57 @@ SYSCALL(ReadEvent) {
   return { i, 0 };
 }
 
+namespace {
+  /** @brief アプリが指定したタイマーを作る．timeout_ms と period_ms はミリ秒． */
+  Timer MakeAppTimer(unsigned int mode, int timer_value,
+                     unsigned long timeout_ms, unsigned long period_ms) {
+    unsigned long timeout = timeout_ms * kTimerFreq / 1000;
+    if (mode & 1) { // relative
+      timeout += timer_manager->CurrentTick();
+    }
+    // 周期は切り捨てると速く回りすぎるので切り上げる
+    const unsigned long period = (period_ms * kTimerFreq + 999) / 1000;
+    return Timer{timeout, timer_value, CurrentCPU()->task->ID()}
+      .SetPeriod(period)
+      .SetApp(true);
+  }
+}
+
 SYSCALL(CreateTimer) {
-  const unsigned int mode = arg1;
   const int timer_value = arg2;
   if (timer_value <= 0) {
     return { 0, EINVAL };
   }
+  const auto timer = MakeAppTimer(arg1, timer_value, arg3, 0);
+  timer_manager->AddTimer(timer);
+  return { timer.Timeout() * 1000 / kTimerFreq, 0 };
+}
 
-  __asm__("cli");
-  const uint64_t task_id = task_manager->CurrentTask().ID();
-  __asm__("sti");
+SYSCALL(ArmTimer) {
+  const int timer_value = arg2;
+  if (timer_value <= 0) {
+    return { 0, EINVAL };
+  }
+  return { timer_manager->AddTimer(MakeAppTimer(arg1, timer_value, arg3, arg4)), 0 };
+}
 
-  unsigned long timeout = arg3 * kTimerFreq / 1000;
-  if (mode & 1) { // relative
-    timeout += timer_manager->CurrentTick();
+SYSCALL(ModifyTimer) {
+  const TimerHandle handle = arg1;
+  const int timer_value = arg3;
+  if (timer_value <= 0) {
+    return { 0, EINVAL };
+  }
+  if (!timer_manager->ModifyTimer(handle, MakeAppTimer(arg2, timer_value, arg4, arg5))) {
+    return { 0, ENOENT };
   }
+  return { handle, 0 };
+}
 
-  __asm__("cli");
-  timer_manager->AddTimer(Timer{timeout, -timer_value, task_id});
-  __asm__("sti");
-  return { timeout * 1000 / kTimerFreq, 0 };
+SYSCALL(CancelTimer) {
+  if (!timer_manager->CancelAppTimer(arg1, CurrentCPU()->task->ID())) {
+    return { 0, ENOENT };
+  }
+  return { 0, 0 };
 }
 
 namespace {
@@ -322,9 +365,9 @@ namespace {
 SYSCALL(OpenFile) {
   const char* path = reinterpret_cast<const char*>(arg1);
   const int flags = arg2;
-  __asm__("cli");
+  DisableInterrupts();
   auto& task = task_manager->CurrentTask();
-  __asm__("sti");
+  EnableInterrupts();
 
   if (strcmp(path, "@stdin") == 0) {
     return { 0, 0 };
@@ -353,9 +396,9 @@ SYSCALL(ReadFile) {
   const int fd = arg1;
   void* buf = reinterpret_cast<void*>(arg2);
   size_t count = arg3;
-  __asm__("cli");
+  DisableInterrupts();
   auto& task = task_manager->CurrentTask();
-  __asm__("sti");
+  EnableInterrupts();
 
   if (fd < 0 || task.Files().size() <= fd || !task.Files()[fd]) {
     return { 0, EBADF };
@@ -366,9 +409,9 @@ SYSCALL(ReadFile) {
 SYSCALL(DemandPages) {
   const size_t num_pages = arg1;
   // const int flags = arg2;
-  __asm__("cli");
+  DisableInterrupts();
   auto& task = task_manager->CurrentTask();
-  __asm__("sti");
+  EnableInterrupts();
 
   const uint64_t dp_end = task.DPagingEnd();
   task.SetDPagingEnd(dp_end + 4096 * num_pages);
@@ -379,9 +422,9 @@ SYSCALL(MapFile) {
   const int fd = arg1;
   size_t* file_size = reinterpret_cast<size_t*>(arg2);
   // const int flags = arg3;
-  __asm__("cli");
+  DisableInterrupts();
   auto& task = task_manager->CurrentTask();
-  __asm__("sti");
+  EnableInterrupts();
 
   if (fd < 0 || task.Files().size() <= fd || !task.Files()[fd]) {
     return { 0, EBADF };
@@ -395,13 +438,408 @@ SYSCALL(MapFile) {
   return { vaddr_begin, 0 };
 }
 
+SYSCALL(SetScheduler) {
+  const unsigned int sched_class = arg1;
+  unsigned long param1 = 0, param2 = 0;
+  auto ms_to_ticks = [](uint64_t ms) {
+    return (ms * kTimerFreq + 999) / 1000;
+  };
+
+  switch (sched_class) {
+  case static_cast<unsigned int>(SchedClass::kRoundRobin):
+    break;
+  case static_cast<unsigned int>(SchedClass::kFair):
+    param1 = arg2; // weight
+    if (param1 == 0 || param1 > 64 * Task::kDefaultWeight) {
+      return { 0, EINVAL };
+    }
+    break;
+  case static_cast<unsigned int>(SchedClass::kDeadline):
+    param1 = ms_to_ticks(arg2); // period
+    param2 = ms_to_ticks(arg3); // budget
+    if (param1 == 0 || param2 == 0 || param2 > param1) {
+      return { 0, EINVAL };
+    }
+    break;
+  default:
+    return { 0, EINVAL };
+  }
+
+  DisableInterrupts();
+  auto& task = task_manager->CurrentTask();
+  const auto err = task_manager->SetSchedClass(
+      &task, static_cast<SchedClass>(sched_class), param1, param2);
+  EnableInterrupts();
+
+  if (err.Cause() == Error::kFull) {
+    return { 0, EBUSY };
+  }
+  return { 0, 0 };
+}
+
+SYSCALL(GetTaskStats) {
+  if (arg1 < 0x8000'0000'0000'0000) {
+    return { 0, EFAULT };
+  }
+  const auto stats = reinterpret_cast<TaskStat*>(arg1);
+  const size_t len = arg2;
+
+  size_t i = 0;
+  DisableInterrupts();
+  for (const auto& task : task_manager->Tasks()) {
+    if (i >= len) {
+      break;
+    }
+    stats[i] = task->Stat();
+    stats[i].peak_stack_bytes = task->PeakStackBytes();
+    if (task.get() == CurrentCPU()->task) {
+      // まだタスクへ足されていない分
+      stats[i].syscalls += CurrentCPU()->syscalls;
+    }
+    ++i;
+  }
+  EnableInterrupts();
+  return { i, 0 };
+}
+
+namespace {
+  Result CheckFutexAddress(uint64_t addr) {
+    if (addr < 0x8000'0000'0000'0000) {
+      return { 0, EFAULT };
+    }
+    if (addr % sizeof(uint32_t) != 0) {
+      return { 0, EINVAL };
+    }
+    return { 0, 0 };
+  }
+} // namespace
+
+SYSCALL(FutexWait) {
+  if (auto res = CheckFutexAddress(arg1); res.error) {
+    return res;
+  }
+  const auto addr = reinterpret_cast<const volatile uint32_t*>(arg1);
+  const uint32_t expected = arg2;
+
+  const auto err = ::FutexWait(addr, expected);
+  if (err.Cause() == Error::kTryAgain) {
+    return { 0, EAGAIN };
+  } else if (err) {
+    return { 0, EFAULT };
+  }
+  return { 0, 0 };
+}
+
+SYSCALL(FutexWake) {
+  if (auto res = CheckFutexAddress(arg1); res.error) {
+    return res;
+  }
+  const auto addr = reinterpret_cast<const volatile uint32_t*>(arg1);
+  const int num = arg2;
+  if (num <= 0) {
+    return { 0, EINVAL };
+  }
+
+  auto [ num_woken, err ] = ::FutexWake(addr, num);
+  if (err) {
+    return { 0, EFAULT };
+  }
+  return { static_cast<uint64_t>(num_woken), 0 };
+}
+
+namespace {
+  struct ThreadStart {
+    uint64_t rip, rsp;
+  };
+
+  void TaskThread(uint64_t task_id, int64_t data) {
+    const auto start = reinterpret_cast<ThreadStart*>(data);
+    const uint64_t rip = start->rip, rsp = start->rsp;
+    delete start;
+
+    DisableInterrupts();
+    auto& task = task_manager->CurrentTask();
+    EnableInterrupts();
+
+    int ret = 128 + SIGKILL;
+    // 動き出す前にアプリが終了していれば，アプリのコードは実行しない
+    if (!task.Canceled()) {
+      ret = CallApp(0, nullptr, 3 << 3 | 3, rip, rsp, &task.OSStackPointer());
+    }
+    timer_manager->CancelAppTimers(task.ID());
+
+    DisableInterrupts();
+    task_manager->Finish(ret);
+  }
+} // namespace
+
+SYSCALL(CreateThread) {
+  const uint64_t entry = arg1;
+  const uint64_t func = arg2;
+  const uint64_t thread_arg = arg3;
+  if (entry < 0x8000'0000'0000'0000 || func < 0x8000'0000'0000'0000) {
+    return { 0, EFAULT };
+  }
+  const size_t stack_size = 16 * 4096;
+
+  DisableInterrupts();
+  auto& task = task_manager->CurrentTask();
+  auto process = task.Process();
+  // スタックはファイルマップ領域の下に確保し，1 ページ空けてガードとする
+  const uint64_t stack_end = process->FileMapEnd() - 4096;
+  const uint64_t stack_begin = stack_end - stack_size;
+  process->SetFileMapEnd(stack_begin);
+  const auto err = SetupPageMaps(LinearAddress4Level{stack_begin},
+                                 stack_size / 4096);
+  EnableInterrupts();
+  if (err) {
+    return { 0, ENOMEM };
+  }
+
+  // エントリ（アプリ側の ThreadStart）がスタックから取り出す関数と引数
+  const auto stack = reinterpret_cast<uint64_t*>(stack_end) - 2;
+  stack[0] = func;
+  stack[1] = thread_arg;
+  const auto start = new ThreadStart{entry, reinterpret_cast<uint64_t>(stack)};
+
+  DisableInterrupts();
+  auto& thread = task_manager->NewTask()
+    .SetProcess(process)
+    .InitContext(TaskThread, reinterpret_cast<int64_t>(start));
+  const uint64_t thread_id = thread.ID();
+  process->Threads().push_back(thread_id);
+  thread.Wakeup();
+  EnableInterrupts();
+  return { thread_id, 0 };
+}
+
+SYSCALL(ExitThread) {
+  DisableInterrupts();
+  auto& task = task_manager->CurrentTask();
+  EnableInterrupts();
+  return { task.OSStackPointer(), static_cast<int>(arg1) };
+}
+
+SYSCALL(JoinThread) {
+  const uint64_t thread_id = arg1;
+
+  DisableInterrupts();
+  auto& task = task_manager->CurrentTask();
+  if (thread_id == task.ID()) {
+    EnableInterrupts();
+    return { 0, EDEADLK };
+  }
+  auto& threads = task.Process()->Threads();
+  auto it = std::find(threads.begin(), threads.end(), thread_id);
+  if (it == threads.end()) {
+    EnableInterrupts();
+    return { 0, ESRCH };
+  }
+  threads.erase(it);
+  auto [ exit_code, err ] = task_manager->WaitFinish(thread_id);
+  EnableInterrupts();
+  return { static_cast<uint64_t>(exit_code), 0 };
+}
+
+SYSCALL(GetThreadID) {
+  // タスクの切り替えで PerCPU::task も入れ替わるので割り込み禁止は要らない
+  return { CurrentCPU()->task->ID(), 0 };
+}
+
+namespace {
+  const int kMaxSpawnArgs = 32;
+  const size_t kMaxSpawnArgLength = 256;
+
+  /** @brief [addr, addr + len) がすべてアプリのアドレス空間（上位半分）にあれば真 */
+  bool IsUserRange(uint64_t addr, uint64_t len) {
+    return addr >= 0x8000'0000'0000'0000 && addr + len >= addr;
+  }
+}
+
+SYSCALL(Spawn) {
+  const bool via_terminal = arg2 & 1;
+
+  // argv の配列も各文字列もアプリが渡したポインタなので，読む前に範囲を確かめる
+  std::vector<std::string> args;
+  for (int i = 0; ; ++i) {
+    const uint64_t entry = arg1 + i * sizeof(const char*);
+    if (!IsUserRange(arg1, (i + 1) * sizeof(const char*))) {
+      return { 0, EFAULT };
+    }
+    const uint64_t arg = *reinterpret_cast<const uint64_t*>(entry);
+    if (arg == 0) {
+      break;
+    }
+    if (i >= kMaxSpawnArgs) {
+      return { 0, E2BIG };
+    }
+    if (!IsUserRange(arg, kMaxSpawnArgLength)) {
+      return { 0, EFAULT };
+    }
+    const char* s = reinterpret_cast<const char*>(arg);
+    const size_t len = strnlen(s, kMaxSpawnArgLength);
+    if (len == kMaxSpawnArgLength) {
+      return { 0, E2BIG };
+    }
+    args.emplace_back(s, len);
+  }
+
+  DisableInterrupts();
+  auto& task = task_manager->CurrentTask();
+  std::array<std::shared_ptr<FileDescriptor>, 3> files;
+  for (int i = 0; i < files.size() && i < task.Files().size(); ++i) {
+    files[i] = task.Files()[i];
+  }
+  EnableInterrupts();
+  if (!files[0] || !files[1] || !files[2]) {
+    return { 0, EBADF };
+  }
+
+  auto [ child_id, err ] = SpawnApp(std::move(args), files, via_terminal);
+  if (err.Cause() == Error::kNoSuchEntry) {
+    return { 0, ENOENT };
+  } else if (err) {
+    return { 0, EINVAL };
+  }
+
+  DisableInterrupts();
+  task.Process()->Children().push_back(child_id);
+  EnableInterrupts();
+  return { child_id, 0 };
+}
+
+SYSCALL(WaitTask) {
+  const uint64_t child_id = arg1;
+
+  DisableInterrupts();
+  auto& children = task_manager->CurrentTask().Process()->Children();
+  auto it = std::find(children.begin(), children.end(), child_id);
+  if (it == children.end()) {
+    EnableInterrupts();
+    return { 0, ECHILD };
+  }
+  children.erase(it);
+  auto [ exit_code, err ] = task_manager->WaitFinish(child_id);
+  EnableInterrupts();
+  return { static_cast<uint64_t>(exit_code), 0 };
+}
+
+namespace {
+  // Poll のタイムアウト用タイマーの値．カーネルのタイマーなので arg.timer.app は false となり，
+  // ReadEvent には渡らない．アプリのタイマーは値が同じでも app が true なので区別できる
+  const int kPollTimer = 2;
+
+  bool IsPollTimer(const Message& msg) {
+    return msg.type == Message::kTimerTimeout && !msg.arg.timer.app &&
+      msg.arg.timer.value == kPollTimer;
+  }
+
+  /** @brief ReadEvent がアプリに渡すメッセージなら真 */
+  bool IsAppEvent(const Message& msg) {
+    switch (msg.type) {
+    case Message::kKeyPush:
+    case Message::kMouseMove:
+    case Message::kMouseButton:
+    case Message::kWindowClose:
+      return true;
+    case Message::kTimerTimeout:
+      return msg.arg.timer.app;
+    default:
+      return false;
+    }
+  }
+
+  int PollOne(Task& task, const PollFD& pfd) {
+    if (pfd.fd == POLL_EVENT_FD) {
+      return task.HasMessage(IsAppEvent) ? kPollIn : 0;
+    }
+    if (pfd.fd < 0 || task.Files().size() <= pfd.fd || !task.Files()[pfd.fd]) {
+      return kPollNval;
+    }
+    return task.Files()[pfd.fd]->Poll() & (pfd.events | kPollHup);
+  }
+}
+
+SYSCALL(Poll) {
+  if (arg1 < 0x8000'0000'0000'0000) {
+    return { 0, EFAULT };
+  }
+  const auto fds = reinterpret_cast<PollFD*>(arg1);
+  const size_t nfds = arg2;
+  const int timeout_ms = arg3;
+  if (nfds > 64) {
+    return { 0, EINVAL };
+  }
+
+  DisableInterrupts();
+  auto& task = task_manager->CurrentTask();
+  EnableInterrupts();
+
+  unsigned long deadline = std::numeric_limits<unsigned long>::max();
+  TimerHandle timer = 0;
+  if (timeout_ms >= 0) {
+    // 切り捨てると指定より早く戻るので切り上げる
+    const unsigned long ticks =
+      (static_cast<unsigned long>(timeout_ms) * kTimerFreq + 999) / 1000;
+    deadline = timer_manager->CurrentTick() + ticks;
+    if (ticks > 0) {
+      timer = timer_manager->AddTimer(Timer{deadline, kPollTimer, task.ID()});
+    }
+  }
+
+  while (true) {
+    DisableInterrupts();
+    while (task.ReceiveMessage(IsPollTimer)) {
+    }
+
+    size_t num_ready = 0;
+    for (size_t i = 0; i < nfds; ++i) {
+      fds[i].revents = PollOne(task, fds[i]);
+      num_ready += fds[i].revents != 0;
+    }
+    if (num_ready > 0 || timer_manager->CurrentTick() >= deadline ||
+        task.Canceled()) {
+      EnableInterrupts();
+      // 発火前に戻るときは，後から古いタイムアウトが届かないよう取り消す
+      timer_manager->CancelTimer(timer);
+      return { num_ready, 0 };
+    }
+
+    // メッセージで状態が変わるものはタスクへのメッセージで起こされる
+    std::vector<WaitQueue*> queues;
+    for (size_t i = 0; i < nfds; ++i) {
+      if (fds[i].fd >= 0) {
+        if (auto q = task.Files()[fds[i].fd]->GetWaitQueue()) {
+          q->Add(&task);
+          queues.push_back(q);
+        }
+      }
+    }
+    task.Sleep();
+    for (auto q : queues) {
+      q->Remove(&task);
+    }
+    EnableInterrupts();
+  }
+}
+
 #undef SYSCALL
 
 } // namespace syscall
 
+/** @brief アプリへ戻る直前に SyscallEntry から割り込み禁止で呼ばれる．
+ *
+ * 実行中のスレッドのアプリが終了中なら，アプリへ戻らずに ExitApp で終えるための
+ * OS 用スタックポインタを返す．そうでなければ 0 を返す．
+ */
+extern "C" uint64_t SyscallCancelPoint() {
+  Task* task = CurrentCPU()->task;
+  return task->Canceled() ? task->OSStackPointer() : 0;
+}
+
 using SyscallFuncType = syscall::Result (uint64_t, uint64_t, uint64_t,
                                          uint64_t, uint64_t, uint64_t);
-extern "C" std::array<SyscallFuncType*, 0x10> syscall_table{
+extern "C" std::array<SyscallFuncType*, 0x1f> syscall_table{
   /* 0x00 */ syscall::LogString,
   /* 0x01 */ syscall::PutString,
   /* 0x02 */ syscall::Exit,
@@ -418,6 +856,21 @@ extern "C" std::array<SyscallFuncType*, 0x10> syscall_table{
   /* 0x0d */ syscall::ReadFile,
   /* 0x0e */ syscall::DemandPages,
   /* 0x0f */ syscall::MapFile,
+  /* 0x10 */ syscall::SetScheduler,
+  /* 0x11 */ syscall::GetTaskStats,
+  /* 0x12 */ syscall::FutexWait,
+  /* 0x13 */ syscall::FutexWake,
+  /* 0x14 */ syscall::CreateThread,
+  /* 0x15 */ syscall::ExitThread,
+  /* 0x16 */ syscall::JoinThread,
+  /* 0x17 */ syscall::GetThreadID,
+  /* 0x18 */ syscall::Spawn,
+  /* 0x19 */ syscall::WaitTask,
+  /* 0x1a */ syscall::Poll,
+  /* 0x1b */ syscall::GetTimeNanos,
+  /* 0x1c */ syscall::ArmTimer,
+  /* 0x1d */ syscall::ModifyTimer,
+  /* 0x1e */ syscall::CancelTimer,
 };
 
 void InitializeSyscall() {
@@ -425,5 +878,6 @@ void InitializeSyscall() {
   WriteMSR(kIA32_LSTAR, reinterpret_cast<uint64_t>(SyscallEntry));
   WriteMSR(kIA32_STAR, static_cast<uint64_t>(8) << 32 |
                        static_cast<uint64_t>(16 | 3) << 48);
-  WriteMSR(kIA32_FMASK, 0);
+  // 入口で swapgs を済ませるまで割り込まれないよう IF をクリアする
+  WriteMSR(kIA32_FMASK, 0x200u);
 }
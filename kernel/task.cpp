@@ -1,6 +1,12 @@
 #include "task.hpp"
 
+#include <csignal>
+
 #include "asmfunc.h"
+#include "idle.hpp"
+#include "irqtrace.hpp"
+#include "logger.hpp"
+#include "percpu.hpp"
 #include "segment.hpp"
 #include "timer.hpp"
 
@@ -12,17 +18,32 @@ namespace {
   }
 
   void TaskIdle(uint64_t task_id, int64_t data) {
-    while (true) __asm__("hlt");
+    while (true) {
+      CPUIdle();
+    }
   }
 } // namespace
 
-Task::Task(uint64_t id) : id_{id}, msgs_{} {
+Task::Task(uint64_t id)
+    : id_{id}, msgs_{}, process_{std::make_shared<::Process>()} {
+}
+
+Task::~Task() {
+  if (stack_begin_ != 0) {
+    kernel_stack_pool->Free(stack_begin_);
+  }
 }
 
 Task& Task::InitContext(TaskFunc* f, int64_t data) {
-  const size_t stack_size = kDefaultStackBytes / sizeof(stack_[0]);
-  stack_.resize(stack_size);
-  uint64_t stack_end = reinterpret_cast<uint64_t>(&stack_[stack_size]);
+  if (stack_begin_ == 0) {
+    auto [ stack_begin, err ] = kernel_stack_pool->Allocate();
+    if (err) {
+      Log(kError, "failed to allocate kernel stack: %s\n", err.Name());
+      exit(1);
+    }
+    stack_begin_ = stack_begin;
+  }
+  uint64_t stack_end = stack_begin_ + kDefaultStackBytes;
 
   memset(&context_, 0, sizeof(context_));
   context_.cr3 = GetCR3();
@@ -64,8 +85,7 @@ Task& Task::Wakeup() {
 }
 
 void Task::SendMessage(const Message& msg) {
-  msgs_.push_back(msg);
-  Wakeup();
+  task_manager->SendMessage(this, msg);
 }
 
 std::optional<Message> Task::ReceiveMessage() {
@@ -78,43 +98,78 @@ std::optional<Message> Task::ReceiveMessage() {
   return m;
 }
 
+std::optional<Message> Task::ReceiveMessage(bool (*pred)(const Message&)) {
+  auto it = std::find_if(msgs_.begin(), msgs_.end(), pred);
+  if (it == msgs_.end()) {
+    return std::nullopt;
+  }
+
+  auto m = *it;
+  msgs_.erase(it);
+  return m;
+}
+
+bool Task::HasMessage(bool (*pred)(const Message&)) const {
+  return std::any_of(msgs_.begin(), msgs_.end(), pred);
+}
+
 std::vector<std::shared_ptr<::FileDescriptor>>& Task::Files() {
-  return files_;
+  return process_->Files();
 }
 
 uint64_t Task::DPagingBegin() const {
-  return dpaging_begin_;
+  return process_->DPagingBegin();
 }
 
 void Task::SetDPagingBegin(uint64_t v) {
-  dpaging_begin_ = v;
+  process_->SetDPagingBegin(v);
 }
 
 uint64_t Task::DPagingEnd() const {
-  return dpaging_end_;
+  return process_->DPagingEnd();
 }
 
 void Task::SetDPagingEnd(uint64_t v) {
-  dpaging_end_ = v;
+  process_->SetDPagingEnd(v);
 }
 
 uint64_t Task::FileMapEnd() const {
-  return file_map_end_;
+  return process_->FileMapEnd();
 }
 
 void Task::SetFileMapEnd(uint64_t v) {
-  file_map_end_ = v;
+  process_->SetFileMapEnd(v);
 }
 
 std::vector<FileMapping>& Task::FileMaps() {
-  return file_maps_;
+  return process_->FileMaps();
+}
+
+Task& Task::SetProcess(std::shared_ptr<::Process> p) {
+  process_ = std::move(p);
+  return *this;
+}
+
+size_t Task::PeakStackBytes() const {
+  if (stack_begin_ == 0) {
+    return 0;
+  }
+  // スタックは 0 で埋めて渡されるので，底から 0 が続く範囲は未使用とみなせる
+  return KernelStackPool::UsedBytes(stack_begin_);
 }
 
 TaskManager::TaskManager() {
+  quantum_[static_cast<int>(SchedClass::kRoundRobin)] = kTaskTimerPeriod;
+  quantum_[static_cast<int>(SchedClass::kFair)] = kTaskTimerPeriod;
+  quantum_[static_cast<int>(SchedClass::kDeadline)] = 1;
+  quantum_left_ = kTaskTimerPeriod;
+  dispatch_tsc_ = ReadTSC();
+
   Task& task = NewTask()
     .SetLevel(current_level_)
     .SetRunning(true);
   running_[current_level_].push_back(&task);
+  SetCurrentCPUTask();
 
   Task& idle = NewTask()
     .InitContext(TaskIdle, 0)
@@ -124,49 +179,72 @@ TaskManager::TaskManager() {
 }
 
 Task& TaskManager::NewTask() {
+  LockGuard guard{lock_};
   ++latest_id_;
-  return *tasks_.emplace_back(new Task{latest_id_});
+  Task& task = *tasks_.emplace_back(new Task{latest_id_});
+  task.stat_.id = latest_id_;
+  return task;
 }
 
-void TaskManager::SwitchTask(const TaskContext& current_ctx) {
-  TaskContext& task_ctx = task_manager->CurrentTask().Context();
-  memcpy(&task_ctx, &current_ctx, sizeof(TaskContext));
+TaskContext* TaskManager::SwitchTask() {
+  LockGuard guard{lock_};
   Task* current_task = RotateCurrentRunQueue(false);
   if (&CurrentTask() != current_task) {
-    RestoreContext(&CurrentTask().Context());
+    ++current_task->stat_.involuntary_switches;
   }
+  return &CurrentTask().Context();
 }
 
 void TaskManager::Sleep(Task* task) {
+  lock_.Lock();
   if (!task->Running()) {
+    lock_.Unlock();
     return;
   }
 
   task->SetRunning(false);
 
   if (task == running_[current_level_].front()) {
+    ++task->stat_.voluntary_switches;
     Task* current_task = RotateCurrentRunQueue(true);
+    // 切り替え途中でタイマー割り込みが来ないよう，割り込みは禁止したままにする
+    const bool irq_enabled = lock_.UnlockKeepIrqOff();
     SwitchContext(&CurrentTask().Context(), &current_task->Context());
+    if (irq_enabled) {
+      EnableInterrupts();
+    }
     return;
   }
 
   Erase(running_[task->Level()], task);
+  lock_.Unlock();
 }
 
 Error TaskManager::Sleep(uint64_t id) {
-  auto it = std::find_if(tasks_.begin(), tasks_.end(),
-                         [id](const auto& t){ return t->ID() == id; });
-  if (it == tasks_.end()) {
+  lock_.Lock();
+  Task* task = FindTask(id);
+  lock_.Unlock();
+  if (task == nullptr) {
     return MAKE_ERROR(Error::kNoSuchTask);
   }
 
-  Sleep(it->get());
+  Sleep(task);
   return MAKE_ERROR(Error::kSuccess);
 }
 
 void TaskManager::Wakeup(Task* task, int level) {
+  LockGuard guard{lock_};
+  WakeupLocked(task, level);
+}
+
+void TaskManager::WakeupLocked(Task* task, int level) {
+  if (task->sched_class_ == SchedClass::kDeadline && level >= 0) {
+    level = kDeadlineLevel;
+  }
+
   if (task->Running()) {
     ChangeLevelRunning(task, level);
+    ArmSchedulerTick();
     return;
   }
 
@@ -177,43 +255,63 @@ void TaskManager::Wakeup(Task* task, int level) {
   task->SetLevel(level);
   task->SetRunning(true);
 
+  if (task->sched_class_ == SchedClass::kFair) {
+    // 長く眠っていたタスクが CPU を独占しないようにする
+    task->vruntime_ = std::max(task->vruntime_, fair_min_vruntime_);
+  } else if (task->sched_class_ == SchedClass::kDeadline) {
+    ReplenishDeadline(task, timer_manager->CurrentTick());
+    if (task->throttled_) {
+      return;
+    }
+  }
+
   running_[level].push_back(task);
   if (level > current_level_) {
     level_changed_ = true;
   }
-  return;
+  KickIdle();
+  ArmSchedulerTick();
 }
 
 Error TaskManager::Wakeup(uint64_t id, int level) {
-  auto it = std::find_if(tasks_.begin(), tasks_.end(),
-                         [id](const auto& t){ return t->ID() == id; });
-  if (it == tasks_.end()) {
+  LockGuard guard{lock_};
+  Task* task = FindTask(id);
+  if (task == nullptr) {
     return MAKE_ERROR(Error::kNoSuchTask);
   }
 
-  Wakeup(it->get(), level);
+  WakeupLocked(task, level);
   return MAKE_ERROR(Error::kSuccess);
 }
 
 Error TaskManager::SendMessage(uint64_t id, const Message& msg) {
-  auto it = std::find_if(tasks_.begin(), tasks_.end(),
-                         [id](const auto& t){ return t->ID() == id; });
-  if (it == tasks_.end()) {
+  LockGuard guard{lock_};
+  Task* task = FindTask(id);
+  if (task == nullptr) {
     return MAKE_ERROR(Error::kNoSuchTask);
   }
 
-  (*it)->SendMessage(msg);
+  task->msgs_.push_back(msg);
+  WakeupLocked(task, -1);
   return MAKE_ERROR(Error::kSuccess);
 }
 
+void TaskManager::SendMessage(Task* task, const Message& msg) {
+  LockGuard guard{lock_};
+  task->msgs_.push_back(msg);
+  WakeupLocked(task, -1);
+}
+
 Task& TaskManager::CurrentTask() {
   return *running_[current_level_].front();
 }
 
 void TaskManager::Finish(int exit_code) {
+  lock_.Lock();
   Task* current_task = RotateCurrentRunQueue(true);
 
   const auto task_id = current_task->ID();
+  Erase(deadline_tasks_, current_task);
   auto it = std::find_if(
       tasks_.begin(), tasks_.end(),
       [current_task](const auto& t){ return t.get() == current_task; });
@@ -223,9 +321,11 @@ void TaskManager::Finish(int exit_code) {
   if (auto it = finish_waiter_.find(task_id); it != finish_waiter_.end()) {
     auto waiter = it->second;
     finish_waiter_.erase(it);
-    Wakeup(waiter);
+    WakeupLocked(waiter, -1);
   }
 
+  // 戻ってこないので，割り込みの許可は切り替え先のコンテキストに任せる
+  lock_.UnlockKeepIrqOff();
   RestoreContext(&CurrentTask().Context());
 }
 
@@ -233,17 +333,26 @@ WithError<int> TaskManager::WaitFinish(uint64_t task_id) {
   int exit_code;
   Task* current_task = &CurrentTask();
   while (true) {
+    lock_.Lock();
     if (auto it = finish_tasks_.find(task_id); it != finish_tasks_.end()) {
       exit_code = it->second;
       finish_tasks_.erase(it);
+      lock_.Unlock();
       break;
     }
     finish_waiter_[task_id] = current_task;
+    lock_.Unlock();
     Sleep(current_task);
   }
   return { exit_code, MAKE_ERROR(Error::kSuccess) };
 }
 
+Task* TaskManager::FindTask(uint64_t id) {
+  auto it = std::find_if(tasks_.begin(), tasks_.end(),
+                         [id](const auto& t){ return t->ID() == id; });
+  return it == tasks_.end() ? nullptr : it->get();
+}
+
 void TaskManager::ChangeLevelRunning(Task* task, int level) {
   if (level < 0 || level == task->Level()) {
     return;
@@ -273,10 +382,12 @@ void TaskManager::ChangeLevelRunning(Task* task, int level) {
 }
 
 Task* TaskManager::RotateCurrentRunQueue(bool current_sleep) {
+  ChargeCurrentTask();
+
   auto& level_queue = running_[current_level_];
   Task* current_task = level_queue.front();
   level_queue.pop_front();
-  if (!current_sleep) {
+  if (!current_sleep && !current_task->throttled_) {
     level_queue.push_back(current_task);
   }
   if (level_queue.empty()) {
@@ -285,7 +396,7 @@ Task* TaskManager::RotateCurrentRunQueue(bool current_sleep) {
 
   if (level_changed_) {
     level_changed_ = false;
-    for (int lv = kMaxLevel; lv >= 0; --lv) {
+    for (int lv = kDeadlineLevel; lv >= 0; --lv) {
       if (!running_[lv].empty()) {
         current_level_ = lv;
         break;
@@ -293,21 +404,234 @@ Task* TaskManager::RotateCurrentRunQueue(bool current_sleep) {
     }
   }
 
+  PickNext(running_[current_level_]);
+  quantum_left_ = Quantum(CurrentTask().Class());
+  SetCurrentCPUTask();
   return current_task;
 }
 
-TaskManager* task_manager;
+void TaskManager::SetCurrentCPUTask() {
+  Task* task = &CurrentTask();
+  if (task->Canceled() && (task->context_.cs & 3) == 3) {
+    // アプリの実行中に中断したスレッドは再開させず，CallApp から戻らせる
+    auto& ctx = task->context_;
+    ctx.rip = reinterpret_cast<uint64_t>(ExitApp);
+    ctx.cs = kKernelCS;
+    ctx.ss = kKernelSS;
+    ctx.rsp = task->os_stack_ptr_;
+    ctx.rflags = 0x202;
+    ctx.rdi = task->os_stack_ptr_;
+    ctx.rsi = 128 + SIGKILL;
+  }
 
-void InitializeTask() {
-  task_manager = new TaskManager;
+  PerCPU* cpu = CurrentCPU();
+  cpu->task = task;
+  cpu->context = &cpu->task->Context();
+  cpu->kernel_rsp = cpu->task->OSStackPointer();
+}
+
+void TaskManager::ChargeCurrentTask() {
+  const uint64_t now = ReadTSC();
+  Task* task = running_[current_level_].front();
+  task->stat_.cpu_cycles += now - dispatch_tsc_;
+  // SyscallEntry は PerCPU のカウンタだけを増やす
+  PerCPU* cpu = CurrentCPU();
+  task->stat_.syscalls += cpu->syscalls;
+  cpu->syscalls = 0;
+  if (task->sched_class_ == SchedClass::kFair) {
+    task->vruntime_ += (now - dispatch_tsc_) * Task::kDefaultWeight / task->weight_;
+  }
+  dispatch_tsc_ = now;
+}
+
+void TaskManager::PickNext(std::deque<Task*>& queue) {
+  const SchedClass sched_class = queue.front()->sched_class_;
+  if (sched_class == SchedClass::kRoundRobin) {
+    return;
+  }
 
-  __asm__("cli");
-  timer_manager->AddTimer(
-      Timer{timer_manager->CurrentTick() + kTaskTimerPeriod, kTaskTimerValue, 1});
-  __asm__("sti");
+  // 先頭と同じクラスのタスクのうち，最も優先すべきものを先頭に持ってくる
+  auto before = [sched_class](const Task* a, const Task* b) {
+    if (sched_class == SchedClass::kFair) {
+      return a->vruntime_ < b->vruntime_;
+    }
+    return a->deadline_ < b->deadline_;
+  };
+  auto next = queue.begin();
+  for (auto it = queue.begin(); it != queue.end(); ++it) {
+    if ((*it)->sched_class_ == sched_class && before(*it, *next)) {
+      next = it;
+    }
+  }
+  if (next != queue.begin()) {
+    Task* task = *next;
+    queue.erase(next);
+    queue.push_front(task);
+  }
+
+  if (sched_class == SchedClass::kFair) {
+    fair_min_vruntime_ = std::max(fair_min_vruntime_, queue.front()->vruntime_);
+  }
 }
 
-__attribute__((no_caller_saved_registers))
-extern "C" uint64_t GetCurrentTaskOSStackPointer() {
-  return task_manager->CurrentTask().OSStackPointer();
+void TaskManager::ReplenishDeadline(Task* task, unsigned long tick) {
+  if (task->deadline_ > tick) {
+    return;
+  }
+  const auto missed_periods = (tick - task->deadline_) / task->period_ + 1;
+  task->deadline_ += missed_periods * task->period_;
+  task->remaining_budget_ = task->budget_;
+  task->throttled_ = false;
+}
+
+Error TaskManager::SetSchedClass(Task* task, SchedClass sched_class,
+                                 unsigned long param1, unsigned long param2) {
+  LockGuard guard{lock_};
+  if (sched_class == SchedClass::kDeadline) {
+    // 予算/周期の総和が上限を超えるなら受け付けない（permille 単位）
+    const unsigned long kMaxUtilization = 900;
+    unsigned long utilization = param2 * 1000 / param1;
+    for (Task* t : deadline_tasks_) {
+      if (t != task) {
+        utilization += t->budget_ * 1000 / t->period_;
+      }
+    }
+    if (utilization > kMaxUtilization) {
+      return MAKE_ERROR(Error::kFull);
+    }
+  }
+
+  if (task->sched_class_ == SchedClass::kDeadline) {
+    Erase(deadline_tasks_, task);
+    if (task->throttled_) {
+      task->throttled_ = false;
+      if (task->Running()) {
+        running_[kDeadlineLevel].push_back(task);
+      }
+    }
+  }
+
+  task->sched_class_ = sched_class;
+  int level = Task::kDefaultLevel;
+  switch (sched_class) {
+  case SchedClass::kRoundRobin:
+    break;
+  case SchedClass::kFair:
+    task->weight_ = param1;
+    task->vruntime_ = fair_min_vruntime_;
+    break;
+  case SchedClass::kDeadline:
+    task->period_ = param1;
+    task->budget_ = param2;
+    task->deadline_ = timer_manager->CurrentTick() + param1;
+    task->remaining_budget_ = param2;
+    deadline_tasks_.push_back(task);
+    level = kDeadlineLevel;
+    break;
+  }
+
+  if (task->Running()) {
+    ChangeLevelRunning(task, level);
+  } else {
+    task->SetLevel(level);
+  }
+  ArmSchedulerTick();
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+void TaskManager::SetQuantum(SchedClass sched_class, int ticks) {
+  LockGuard guard{lock_};
+  quantum_[static_cast<int>(sched_class)] = std::max(ticks, 1);
+}
+
+int TaskManager::Quantum(SchedClass sched_class) const {
+  return quantum_[static_cast<int>(sched_class)];
+}
+
+bool TaskManager::OnTick(unsigned long tick) {
+  LockGuard guard{lock_};
+  Task* current_task = running_[current_level_].front();
+  bool switch_task = false;
+  // ティックレスの間は割り込みが間引かれるので，進んだティック数でまとめて減らす
+  const unsigned long elapsed = tick - last_tick_;
+  last_tick_ = tick;
+
+  if (current_task->sched_class_ == SchedClass::kDeadline &&
+      current_task->remaining_budget_ > 0 && elapsed > 0) {
+    current_task->remaining_budget_ -=
+      std::min(current_task->remaining_budget_, elapsed);
+    if (current_task->remaining_budget_ == 0) {
+      current_task->throttled_ = true;
+      switch_task = true;
+    }
+  }
+
+  for (Task* task : deadline_tasks_) {
+    if (task->deadline_ > tick) {
+      continue;
+    }
+    const bool was_throttled = task->throttled_;
+    ReplenishDeadline(task, tick);
+    if (was_throttled && task->Running() && task != current_task) {
+      running_[kDeadlineLevel].push_back(task);
+      level_changed_ = true;
+    }
+  }
+
+  if (current_level_ == kDeadlineLevel) {
+    for (Task* task : running_[kDeadlineLevel]) {
+      if (task->deadline_ < current_task->deadline_) {
+        switch_task = true;
+      }
+    }
+  }
+
+  if (elapsed >= static_cast<unsigned long>(std::max(quantum_left_, 0))) {
+    quantum_left_ = 0;
+  } else {
+    quantum_left_ -= elapsed;
+  }
+  if (quantum_left_ <= 0 || level_changed_) {
+    switch_task = true;
+  }
+  return switch_task;
+}
+
+bool TaskManager::NeedsSchedulerTick() const {
+  if (!deadline_tasks_.empty()) {
+    return true;
+  }
+  // アイドルタスクのほかに 2 つ以上実行可能なら，タイムスライスで切り替える
+  size_t num_runnable = 0;
+  for (const auto& queue : running_) {
+    num_runnable += queue.size();
+  }
+  return num_runnable > 2;
+}
+
+unsigned long TaskManager::NextSchedulerTick() {
+  LockGuard guard{lock_};
+  if (level_changed_ || !deadline_tasks_.empty()) {
+    // 予算と周期はティックごとに数える
+    return last_tick_ + 1;
+  }
+  if (NeedsSchedulerTick()) {
+    return last_tick_ + std::max(quantum_left_, 1);
+  }
+  return std::numeric_limits<unsigned long>::max();
+}
+
+void TaskManager::ArmSchedulerTick() {
+  if (level_changed_) {
+    // 優先度の高いタスクが起きたら，次のティックを待たずに切り替える
+    ArmTimerInterrupt(timer_manager->CurrentTick());
+  } else if (NeedsSchedulerTick()) {
+    ArmTimerInterrupt(timer_manager->CurrentTick() + 1);
+  }
+}
+
+TaskManager* task_manager;
+
+void InitializeTask() {
+  task_manager = new TaskManager;
 }
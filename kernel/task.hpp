@@ -11,13 +11,17 @@
 #include <cstdint>
 #include <deque>
 #include <map>
+#include <memory>
 #include <optional>
 #include <vector>
 
 #include "error.hpp"
+#include "lock.hpp"
 #include "message.hpp"
 #include "paging.hpp"
 #include "fat.hpp"
+#include "kernel_stack.hpp"
+#include "task_stat.hpp"
 
 struct TaskContext {
   uint64_t cr3, rip, rflags, reserved1; // offset 0x00
@@ -31,17 +35,56 @@ using TaskFunc = void (uint64_t, int64_t);
 
 class TaskManager;
 
+/** @brief タスクのスケジューリングクラス */
+enum class SchedClass {
+  kRoundRobin, // レベル内で順番に実行する（従来の動作）
+  kFair,       // 重みに応じて仮想実行時間を公平に配分する
+  kDeadline,   // 周期と予算を宣言し，締め切りが早い順に実行する（EDF）
+};
+const int kNumSchedClasses = 3;
+
 struct FileMapping {
   int fd;
   uint64_t vaddr_begin, vaddr_end;
 };
 
+/** @brief アプリ 1 つ分の状態．同じアドレス空間で動くスレッド（Task）で共有する． */
+class Process {
+ public:
+  std::vector<std::shared_ptr<::FileDescriptor>>& Files() { return files_; }
+  uint64_t DPagingBegin() const { return dpaging_begin_; }
+  void SetDPagingBegin(uint64_t v) { dpaging_begin_ = v; }
+  uint64_t DPagingEnd() const { return dpaging_end_; }
+  void SetDPagingEnd(uint64_t v) { dpaging_end_ = v; }
+  uint64_t FileMapEnd() const { return file_map_end_; }
+  void SetFileMapEnd(uint64_t v) { file_map_end_ = v; }
+  std::vector<FileMapping>& FileMaps() { return file_maps_; }
+  /** @brief CreateThread で作られ，まだ join されていないスレッドの ID */
+  std::vector<uint64_t>& Threads() { return threads_; }
+  /** @brief Spawn で起動し，まだ WaitTask で待っていない子タスクの ID */
+  std::vector<uint64_t>& Children() { return children_; }
+  /** @brief メインスレッドが終わり，アプリを片付けている途中なら true */
+  bool Exiting() const { return exiting_; }
+  void SetExiting(bool exiting) { exiting_ = exiting; }
+
+ private:
+  std::vector<std::shared_ptr<::FileDescriptor>> files_{};
+  uint64_t dpaging_begin_{0}, dpaging_end_{0};
+  uint64_t file_map_end_{0};
+  std::vector<FileMapping> file_maps_{};
+  std::vector<uint64_t> threads_{};
+  std::vector<uint64_t> children_{};
+  bool exiting_{false};
+};
+
 class Task {
  public:
   static const int kDefaultLevel = 1;
-  static const size_t kDefaultStackBytes = 8 * 4096;
+  static const size_t kDefaultStackBytes = KernelStackPool::kStackBytes;
+  static const unsigned int kDefaultWeight = 1024;
 
   Task(uint64_t id);
+  ~Task();
   Task& InitContext(TaskFunc* f, int64_t data);
   TaskContext& Context();
   uint64_t& OSStackPointer();
@@ -50,6 +93,9 @@ class Task {
   Task& Wakeup();
   void SendMessage(const Message& msg);
   std::optional<Message> ReceiveMessage();
+  /** @brief pred を満たす最初のメッセージを取り出す．ほかのメッセージはキューに残す． */
+  std::optional<Message> ReceiveMessage(bool (*pred)(const Message&));
+  bool HasMessage(bool (*pred)(const Message&)) const;
   std::vector<std::shared_ptr<::FileDescriptor>>& Files();
   uint64_t DPagingBegin() const;
   void SetDPagingBegin(uint64_t v);
@@ -58,22 +104,39 @@ class Task {
   uint64_t FileMapEnd() const;
   void SetFileMapEnd(uint64_t v);
   std::vector<FileMapping>& FileMaps();
+  std::shared_ptr<::Process> Process() const { return process_; }
+  /** @brief p を共有し，p を持つタスクと同じアプリのスレッドとなる． */
+  Task& SetProcess(std::shared_ptr<::Process> p);
+  /** @brief 属するアプリが終了中なら true．眠って待つ処理は待つのをやめて戻る． */
+  bool Canceled() const { return process_ && process_->Exiting(); }
+  TaskStat& Stat() { return stat_; }
+  /** @brief カーネルスタックの未使用領域を調べ，最大使用量を返す． */
+  size_t PeakStackBytes() const;
 
   int Level() const { return level_; }
   bool Running() const { return running_; }
+  SchedClass Class() const { return sched_class_; }
+  unsigned int Weight() const { return weight_; }
+  uint64_t VRuntime() const { return vruntime_; }
+  unsigned long Deadline() const { return deadline_; }
 
  private:
   uint64_t id_;
-  std::vector<uint64_t> stack_;
+  uint64_t stack_begin_{0}; // カーネルスタックプールから得たスタックの最下位アドレス
   alignas(16) TaskContext context_;
   uint64_t os_stack_ptr_;
   std::deque<Message> msgs_;
   unsigned int level_{kDefaultLevel};
   bool running_{false};
-  std::vector<std::shared_ptr<::FileDescriptor>> files_{};
-  uint64_t dpaging_begin_{0}, dpaging_end_{0};
-  uint64_t file_map_end_{0};
-  std::vector<FileMapping> file_maps_{};
+  std::shared_ptr<::Process> process_;
+  TaskStat stat_{};
+
+  SchedClass sched_class_{SchedClass::kRoundRobin};
+  unsigned int weight_{kDefaultWeight};
+  uint64_t vruntime_{0}; // kFair: 重みで補正した実行時間（TSC サイクル）
+  unsigned long period_{0}, budget_{0}; // kDeadline: 周期と予算（ティック）
+  unsigned long deadline_{0}, remaining_budget_{0}; // kDeadline: 現周期の状態
+  bool throttled_{false}; // kDeadline: 予算を使い切って次の周期を待っている
 
   Task& SetLevel(int level) { level_ = level; return *this; }
   Task& SetRunning(bool running) { running_ = running; return *this; }
@@ -85,31 +148,78 @@ class TaskManager {
  public:
   // level: 0 = lowest, kMaxLevel = highest
   static const int kMaxLevel = 3;
+  // kDeadline クラスのタスク専用のレベル．通常のレベルよりも優先される．
+  static const int kDeadlineLevel = kMaxLevel + 1;
 
   TaskManager();
   Task& NewTask();
-  void SwitchTask(const TaskContext& current_ctx);
+  /** @brief 次に実行するタスクを選び，そのコンテキストを返す．
+   *
+   * タイマー割り込みから呼ばれる．現在のタスクのコンテキストは割り込みハンドラが
+   * PerCPU::context へ直接保存している．
+   */
+  TaskContext* SwitchTask();
 
   void Sleep(Task* task);
   Error Sleep(uint64_t id);
   void Wakeup(Task* task, int level = -1);
   Error Wakeup(uint64_t id, int level = -1);
   Error SendMessage(uint64_t id, const Message& msg);
+  void SendMessage(Task* task, const Message& msg);
   Task& CurrentTask();
   void Finish(int exit_code);
+  /** @brief タスクの終了を待つ．終了の通知を取りこぼさないよう割り込み禁止状態で呼ぶこと． */
   WithError<int> WaitFinish(uint64_t task_id);
 
+  /** @brief タスクのスケジューリングクラスを変更する．
+   *
+   * kFair では param1 が重み，kDeadline では param1 が周期，param2 が予算
+   * （いずれもティック単位）となる．
+   */
+  Error SetSchedClass(Task* task, SchedClass sched_class,
+                      unsigned long param1, unsigned long param2);
+  /** @brief クラスごとのタイムスライス（ティック単位）を設定する． */
+  void SetQuantum(SchedClass sched_class, int ticks);
+  int Quantum(SchedClass sched_class) const;
+  /** @brief タイマー割り込みごとに呼び出し，タスク切り替えが必要なら true を返す．
+   *
+   * ティックレスの間は割り込みが毎ティック来るとは限らない．前回から進んだ分を
+   * まとめて数える．
+   */
+  bool OnTick(unsigned long tick);
+  /** @brief スケジューラが次にタイマー割り込みを必要とするティック．不要なら最大値． */
+  unsigned long NextSchedulerTick();
+  const std::vector<std::unique_ptr<Task>>& Tasks() const { return tasks_; }
+
  private:
   std::vector<std::unique_ptr<Task>> tasks_{};
   uint64_t latest_id_{0};
-  std::array<std::deque<Task*>, kMaxLevel + 1> running_{};
+  std::array<std::deque<Task*>, kDeadlineLevel + 1> running_{};
   int current_level_{kMaxLevel};
   bool level_changed_{false};
   std::map<uint64_t, int> finish_tasks_{}; // key: ID of a finished task
   std::map<uint64_t, Task*> finish_waiter_{}; // key: ID of a finished task
 
+  std::array<int, kNumSchedClasses> quantum_{};
+  int quantum_left_{0};
+  unsigned long last_tick_{0}; // 最後に OnTick で数えたティック
+  uint64_t dispatch_tsc_{0};
+  uint64_t fair_min_vruntime_{0};
+  std::vector<Task*> deadline_tasks_{};
+  SpinLock lock_{"task"};
+
+  Task* FindTask(uint64_t id);
+  void WakeupLocked(Task* task, int level);
   void ChangeLevelRunning(Task* task, int level);
   Task* RotateCurrentRunQueue(bool current_sleep);
+  void ChargeCurrentTask();
+  /** @brief PerCPU の実行中タスクの情報を CurrentTask() に合わせる． */
+  void SetCurrentCPUTask();
+  void PickNext(std::deque<Task*>& queue);
+  void ReplenishDeadline(Task* task, unsigned long tick);
+  /** @brief 実行可能なタスクが増えて切り替えが要るなら，タイマー割り込みを早める． */
+  void ArmSchedulerTick();
+  bool NeedsSchedulerTick() const;
 };
 
 extern TaskManager* task_manager;
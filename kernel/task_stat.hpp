@@ -0,0 +1,27 @@
+/**
+ * @file task_stat.hpp
+ *
+ * タスクごとの実行統計．カーネルとアプリの双方から参照する．
+ */
+
+#pragma once
+
+#ifdef __cplusplus
+#include <cstdint>
+extern "C" {
+#else
+#include <stdint.h>
+#endif
+
+struct TaskStat {
+  uint64_t id;
+  uint64_t cpu_cycles; // 消費した TSC サイクル数
+  uint64_t voluntary_switches, involuntary_switches;
+  uint64_t demand_faults, file_faults, cow_faults;
+  uint64_t syscalls;
+  uint64_t peak_stack_bytes; // カーネルスタックの最大使用量
+};
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
@@ -1,16 +1,26 @@
 #include "terminal.hpp"
 
+#include <algorithm>
 #include <cstring>
 #include <limits>
 
 #include "font.hpp"
 #include "layer.hpp"
 #include "pci.hpp"
+#include "apic.hpp"
 #include "asmfunc.h"
+#include "clock.hpp"
 #include "elf.hpp"
+#include "fiber.hpp"
+#include "idle.hpp"
+#include "irqtrace.hpp"
+#include "lock.hpp"
 #include "memory_manager.hpp"
 #include "paging.hpp"
+#include "time_page.hpp"
 #include "timer.hpp"
+#include "usb/xhci/xhci.hpp"
+#include "workqueue.hpp"
 #include "keyboard.hpp"
 #include "logger.hpp"
 
@@ -233,6 +243,131 @@ fat::DirectoryEntry* FindCommand(const char* command,
   return FindCommand(command, apps_entry.first->FirstCluster());
 }
 
+/** @brief file_entry のアプリを task 上で実行し，終了するまで待つ．
+ *
+ * make_argv(argv, argv_len, argbuf, argbuf_len) はアプリに渡す引数を書き込み，argc を返す．
+ */
+template <class MakeArgv>
+WithError<int> ExecuteApp(fat::DirectoryEntry& file_entry, Task& task,
+    const std::array<std::shared_ptr<FileDescriptor>, 3>& files,
+    MakeArgv make_argv) {
+  auto [ app_load, err ] = LoadApp(file_entry, task);
+  if (err) {
+    return { 0, err };
+  }
+
+  LinearAddress4Level args_frame_addr{0xffff'ffff'ffff'f000};
+  if (auto err = SetupPageMaps(args_frame_addr, 1)) {
+    return { 0, err };
+  }
+  auto argv = reinterpret_cast<char**>(args_frame_addr.value);
+  int argv_len = 32; // argv = 8x32 = 256 bytes
+  auto argbuf = reinterpret_cast<char*>(args_frame_addr.value + sizeof(char**) * argv_len);
+  int argbuf_len = 4096 - sizeof(char**) * argv_len;
+  auto argc = make_argv(argv, argv_len, argbuf, argbuf_len);
+  if (argc.error) {
+    return { 0, argc.error };
+  }
+
+  // #@@range_begin(increase_appstack)
+  const int stack_size = 16 * 4096;
+  LinearAddress4Level stack_frame_addr{0xffff'ffff'ffff'f000 - stack_size};
+  // #@@range_end(increase_appstack)
+  if (auto err = SetupPageMaps(stack_frame_addr, stack_size / 4096)) {
+    return { 0, err };
+  }
+
+  // スレッドは同じページテーブルを使うので，ここで写しておけば全スレッドから読める
+  if (const auto time_page = TimePageAddress()) {
+    if (auto err = MapUserPage(TIME_PAGE_ADDR, time_page)) {
+      return { 0, err };
+    }
+  }
+
+  for (int i = 0; i < files.size(); ++i) {
+    task.Files().push_back(files[i]);
+  }
+
+  const uint64_t elf_next_page =
+    (app_load.vaddr_end + 4095) & 0xffff'ffff'ffff'f000;
+  task.SetDPagingBegin(elf_next_page);
+  task.SetDPagingEnd(elf_next_page);
+
+  task.SetFileMapEnd(stack_frame_addr.value);
+
+  int ret = CallApp(argc.value, argv, 3 << 3 | 3, app_load.entry,
+                    stack_frame_addr.value + stack_size - 8,
+                    &task.OSStackPointer());
+  // 周期タイマーは取り消さないと終了後もメッセージを送り続ける
+  timer_manager->CancelAppTimers(task.ID());
+
+  // 残っているスレッドは終了させる．アプリへ戻らずに終わるよう印を付けて起こし，
+  // 全スレッドが終わってからアドレス空間（スレッドのスタックも含む）を片付ける
+  DisableInterrupts();
+  const auto process = task.Process();
+  process->SetExiting(true);
+  // JoinThread で待たれているスレッドは Threads に残っていないので，全タスクから探す
+  for (const auto& t : task_manager->Tasks()) {
+    if (t.get() != &task && t->Process() == process) {
+      task_manager->Wakeup(t.get());
+    }
+  }
+  auto& threads = process->Threads();
+  while (!threads.empty()) {
+    const uint64_t thread_id = threads.back();
+    threads.pop_back();
+    task_manager->WaitFinish(thread_id);
+  }
+  // このタスクは端末として動き続けることがある
+  process->SetExiting(false);
+  EnableInterrupts();
+
+  task.Files().clear();
+  task.FileMaps().clear();
+
+  if (auto err = CleanPageMaps(LinearAddress4Level{0xffff'8000'0000'0000})) {
+    return { ret, err };
+  }
+  return { ret, FreePML4(task) };
+}
+
+WithError<int> CopyArgVector(const std::vector<std::string>& args,
+    char** argv, int argv_len, char* argbuf, int argbuf_len) {
+  int argc = 0;
+  int argbuf_index = 0;
+  for (const auto& arg : args) {
+    if (argc >= argv_len || argbuf_index + arg.length() + 1 > argbuf_len) {
+      return { argc, MAKE_ERROR(Error::kFull) };
+    }
+    argv[argc] = &argbuf[argbuf_index];
+    ++argc;
+    strcpy(&argbuf[argbuf_index], arg.c_str());
+    argbuf_index += arg.length() + 1;
+  }
+  return { argc, MAKE_ERROR(Error::kSuccess) };
+}
+
+/** @brief histogram[i] が 2^i 以上 2^(i+1) 未満サイクルの数である分布を棒グラフで表示する． */
+template <size_t N>
+void PrintCycleHistogram(FileDescriptor& fd, const std::array<uint64_t, N>& histogram) {
+  const unsigned long cycles_per_us = std::max(tsc_freq / 1000000, 1ul);
+  uint64_t max_count = 1;
+  for (auto count : histogram) {
+    max_count = std::max(max_count, count);
+  }
+  for (int i = 0; i < N; ++i) {
+    if (histogram[i] == 0) {
+      continue;
+    }
+    char bar[32];
+    const int bar_len = histogram[i] * 30 / max_count;
+    memset(bar, '#', bar_len);
+    bar[bar_len] = '\0';
+    PrintToFD(fd, ">=%8lu ns %7lu %s\n",
+        (1ul << i) * 1000 / cycles_per_us, histogram[i], bar);
+  }
+}
+
 } // namespace
 
 std::map<fat::DirectoryEntry*, AppLoadInfo>* app_loads;
@@ -404,7 +539,7 @@ void Terminal::ExecuteLine() {
     }
 
     auto& subtask = task_manager->NewTask();
-    pipe_fd = std::make_shared<PipeDescriptor>(subtask);
+    pipe_fd = std::make_shared<PipeDescriptor>();
     auto term_desc = new TerminalDescriptor{
       subcommand, true, false,
       { pipe_fd, files_[1], files_[2] }
@@ -415,7 +550,7 @@ void Terminal::ExecuteLine() {
       .InitContext(TaskTerminal, reinterpret_cast<int64_t>(term_desc))
       .Wakeup()
       .ID();
-    (*layer_task_map)[layer_id_] = subtask_id;
+    SetLayerTask(layer_id_, subtask_id);
   }
 
   if (strcmp(command, "echo") == 0) {
@@ -434,13 +569,30 @@ void Terminal::ExecuteLine() {
     }
     cursor_.y = 0;
   } else if (strcmp(command, "lspci") == 0) {
+    const bool ecam = pci::GetConfigAccess() == pci::ConfigAccess::kECAM;
+    const auto scan_time = pci::GetScanTime();
+    const unsigned long cycles_per_us = std::max(tsc_freq / 1000000, 1ul);
+    PrintToFD(*files_[1], "config access: %s (scan: port I/O %lu us, ECAM %lu us)\n",
+        ecam ? "ECAM" : "port I/O", scan_time.port_io_cycles / cycles_per_us,
+        scan_time.ecam_cycles / cycles_per_us);
     for (int i = 0; i < pci::num_device; ++i) {
       const auto& dev = pci::devices[i];
       auto vendor_id = pci::ReadVendorId(dev.bus, dev.device, dev.function);
       PrintToFD(*files_[1],
-          "%02x:%02x.%d vend=%04x head=%02x class=%02x.%02x.%02x\n",
+          "%02x:%02x.%d vend=%04x head=%02x class=%02x.%02x.%02x",
           dev.bus, dev.device, dev.function, vendor_id, dev.header_type,
           dev.class_code.base, dev.class_code.sub, dev.class_code.interface);
+      // 拡張ケーパビリティの ID を並べる
+      uint16_t addr = ecam ? pci::kExtendedCapabilityBase : 0;
+      for (int n = 0; addr >= pci::kExtendedCapabilityBase && n < 16; ++n) {
+        const auto header = pci::ReadExtendedCapabilityHeader(dev, addr);
+        if (header.data == 0 || header.data == 0xffffffffu) {
+          break;
+        }
+        PrintToFD(*files_[1], " ext=%04x", header.bits.cap_id);
+        addr = header.bits.next_ptr & 0xffcu;
+      }
+      PrintToFD(*files_[1], "\n");
     }
   } else if (strcmp(command, "ls") == 0) {
     if (!first_arg || first_arg[0] == '\0') {
@@ -507,6 +659,294 @@ void Terminal::ExecuteLine() {
     PrintToFD(*files_[1], "Phys total: %lu frames (%llu MiB)\n",
         p_stat.total_frames,
         p_stat.total_frames * kBytesPerFrame / 1024 / 1024);
+  } else if (strcmp(command, "sched") == 0) {
+    const char* class_names[kNumSchedClasses] = { "rr", "fair", "edf" };
+    if (first_arg && first_arg[0] != '\0') {
+      char* ticks = strchr(first_arg, ' ');
+      int sched_class = 0;
+      while (sched_class < kNumSchedClasses &&
+             strncmp(first_arg, class_names[sched_class],
+                     ticks ? ticks - first_arg : strlen(first_arg)) != 0) {
+        ++sched_class;
+      }
+      if (sched_class == kNumSchedClasses || !ticks) {
+        PrintToFD(*files_[2], "usage: sched [rr|fair|edf <quantum ticks>]\n");
+        exit_code = 1;
+      } else {
+        DisableInterrupts();
+        task_manager->SetQuantum(static_cast<SchedClass>(sched_class),
+                                 atoi(ticks + 1));
+        EnableInterrupts();
+      }
+    }
+    PrintToFD(*files_[1], "quantum: rr %d, fair %d, edf %d ticks\n",
+        task_manager->Quantum(SchedClass::kRoundRobin),
+        task_manager->Quantum(SchedClass::kFair),
+        task_manager->Quantum(SchedClass::kDeadline));
+    struct SchedInfo {
+      uint64_t id;
+      int level, sched_class;
+      bool running;
+      unsigned int weight;
+      uint64_t vruntime;
+      unsigned long deadline;
+    };
+    std::vector<SchedInfo> infos;
+    DisableInterrupts();
+    for (const auto& t : task_manager->Tasks()) {
+      infos.push_back({t->ID(), t->Level(), static_cast<int>(t->Class()),
+                       t->Running(), t->Weight(), t->VRuntime(), t->Deadline()});
+    }
+    EnableInterrupts();
+    for (const auto& info : infos) {
+      PrintToFD(*files_[1], "%3lu lv%d %-4s %c w=%-5u vrt=%lu dl=%lu\n",
+          info.id, info.level, class_names[info.sched_class],
+          info.running ? 'R' : 'S', info.weight, info.vruntime, info.deadline);
+    }
+  } else if (strcmp(command, "irqoff") == 0) {
+    if (first_arg && strcmp(first_arg, "reset") == 0) {
+      DisableInterrupts();
+      IrqTraceReset();
+      EnableInterrupts();
+    } else {
+      DisableInterrupts();
+      const auto stat = IrqTraceSnapshot();
+      EnableInterrupts();
+
+      const unsigned long cycles_per_us = std::max(tsc_freq / 1000000, 1ul);
+      PrintToFD(*files_[1], "%lu sections\n", stat.num_sections);
+      PrintCycleHistogram(*files_[1], stat.histogram);
+      for (const auto& s : stat.worst) {
+        if (s.cycles == 0) {
+          break;
+        }
+        PrintToFD(*files_[1], "%6lu us %s:%d -> %s:%d\n", s.cycles / cycles_per_us,
+            s.off_file, s.off_line, s.on_file, s.on_line);
+      }
+    }
+  } else if (strcmp(command, "idle") == 0) {
+    DisableInterrupts();
+    const auto stat = IdleStatSnapshot();
+    EnableInterrupts();
+
+    const unsigned long cycles_per_us = std::max(tsc_freq / 1000000, 1ul);
+    PrintToFD(*files_[1], "%s, up to C%d\n",
+        stat.mwait ? "mwait" : "hlt", stat.deepest_cstate);
+    for (int n = 1; n < IdleStat::kMaxCStates; ++n) {
+      if (stat.entries[n] == 0) {
+        continue;
+      }
+      PrintToFD(*files_[1], "C%d: %lu entries, %lu us resident\n",
+          n, stat.entries[n], stat.residency_cycles[n] / cycles_per_us);
+    }
+    PrintToFD(*files_[1], "residency\n");
+    PrintCycleHistogram(*files_[1], stat.residency_histogram);
+    PrintToFD(*files_[1], "wakeup latency (%lu timer, %lu kick, %lu other)\n",
+        stat.timer_wakeups, stat.kick_wakeups, stat.other_wakeups);
+    PrintCycleHistogram(*files_[1], stat.wakeup_histogram);
+  } else if (strcmp(command, "compbench") == 0) {
+    // ウィンドウを 20 枚重ね，画面全体の重ね合わせを隠面除去なしとありで比べる
+    const int kNumWindows = 20, kFrames = 10;
+    const Vector2D<int> kWindowSize{400, 300};
+    const auto screen_size = ScreenSize();
+    CompositeStat results[2];
+    {
+      LockGuard guard{layer_manager->GetMutex()};
+      std::vector<unsigned int> ids;
+      for (int i = 0; i < kNumWindows; ++i) {
+        auto win = std::make_shared<ToplevelWindow>(
+            kWindowSize.x, kWindowSize.y, screen_config.pixel_format, "compbench");
+        const Vector2D<int> pos{
+          i * 37 % std::max(screen_size.x - kWindowSize.x, 1),
+          i * 23 % std::max(screen_size.y - kWindowSize.y, 1)};
+        const auto id = layer_manager->NewLayer().SetWindow(win).Move(pos).ID();
+        layer_manager->UpDown(id, 1);
+        ids.push_back(id);
+      }
+
+      for (int culling = 0; culling < 2; ++culling) {
+        layer_manager->SetOcclusionCulling(culling);
+        const auto before = layer_manager->GetCompositeStat();
+        for (int frame = 0; frame < kFrames; ++frame) {
+          layer_manager->Draw({{0, 0}, screen_size});
+        }
+        const auto after = layer_manager->GetCompositeStat();
+        results[culling] = {after.composites - before.composites,
+                            after.cycles - before.cycles, after.pixels - before.pixels};
+      }
+
+      for (auto id : ids) {
+        layer_manager->RemoveLayer(id);
+      }
+      layer_manager->Draw({{0, 0}, screen_size});
+    }
+
+    const unsigned long cycles_per_us = std::max(tsc_freq / 1000000, 1ul);
+    PrintToFD(*files_[1], "%d windows, %dx%d screen, %lu px\n", kNumWindows,
+        screen_size.x, screen_size.y, static_cast<uint64_t>(screen_size.x) * screen_size.y);
+    for (int culling = 0; culling < 2; ++culling) {
+      const auto& r = results[culling];
+      PrintToFD(*files_[1], "%-9s %7lu us/frame %9lu px/frame\n",
+          culling ? "culling" : "painter", r.cycles / kFrames / cycles_per_us,
+          r.pixels / kFrames);
+    }
+  } else if (strcmp(command, "locks") == 0) {
+    auto stats = LockStats();
+    std::sort(stats.begin(), stats.end(), [](const auto& a, const auto& b){
+      return a.contentions > b.contentions;
+    });
+
+    const unsigned long cycles_per_us = std::max(tsc_freq / 1000000, 1ul);
+    PrintToFD(*files_[1], "%-16s %9s %7s %8s %8s %8s\n",
+        "name", "acquire", "contend", "wait us", "avg ns", "max us");
+    for (const auto& s : stats) {
+      const uint64_t avg_hold = s.acquisitions ? s.hold_cycles / s.acquisitions : 0;
+      PrintToFD(*files_[1], "%-16s %9lu %7lu %8lu %8lu %8lu\n",
+          s.name, s.acquisitions, s.contentions, s.wait_cycles / cycles_per_us,
+          avg_hold * 1000 / cycles_per_us, s.max_hold_cycles / cycles_per_us);
+    }
+  } else if (strcmp(command, "workstat") == 0) {
+    // ハード割り込み，ソフト割り込み，ワークキューの各段で費やした時間と，実行までの遅れ
+    const unsigned long cycles_per_us = std::max(tsc_freq / 1000000, 1ul);
+    PrintToFD(*files_[1], "%-14s %9s %8s %8s %8s %8s\n",
+        "stage", "count", "avg ns", "max us", "lat ns", "maxl us");
+    for (const auto& s : DeferredStats()) {
+      const uint64_t avg = s.count ? s.cycles / s.count : 0;
+      const uint64_t avg_latency = s.count ? s.latency_cycles / s.count : 0;
+      PrintToFD(*files_[1], "%-14s %9lu %8lu %8lu %8lu %8lu\n",
+          s.name, s.count, avg * 1000 / cycles_per_us, s.max_cycles / cycles_per_us,
+          avg_latency * 1000 / cycles_per_us, s.max_latency_cycles / cycles_per_us);
+    }
+  } else if (strcmp(command, "keystat") == 0) {
+    const auto stat = GetKeyInputStat();
+    const unsigned long cycles_per_us = std::max(tsc_freq / 1000000, 1ul);
+    const uint64_t avg = stat.echoes ? stat.echo_cycles / stat.echoes : 0;
+    PrintToFD(*files_[1], "keys: %lu direct, %lu via main task\n",
+        stat.direct, stat.to_main);
+    PrintToFD(*files_[1], "key to echo: %lu samples, avg %lu us, max %lu us\n",
+        stat.echoes, avg / cycles_per_us, stat.max_echo_cycles / cycles_per_us);
+  } else if (strcmp(command, "fibers") == 0) {
+    const auto stat = GetFiberStat();
+    PrintToFD(*files_[1], "%lu fibers (%lu bytes), %d workers, %lu resumes\n",
+        stat.num_fibers, stat.frame_bytes, stat.num_workers, stat.num_resumes);
+    PrintToFD(*files_[1], "task stack: %lu bytes each\n", Task::kDefaultStackBytes);
+
+    const unsigned long cycles_per_us = std::max(tsc_freq / 1000000, 1ul);
+    for (int port_id = 1; port_id < 256; ++port_id) {
+      if (auto cycles = usb::xhci::PortConfigCycles(port_id)) {
+        PrintToFD(*files_[1], "usb port %d: configured in %lu us\n",
+            port_id, cycles / cycles_per_us);
+      }
+    }
+  } else if (strcmp(command, "usbstat") == 0) {
+    /* インタラプタごとに，1 秒間の割り込みとイベントの数，割り込みからイベント処理を
+     * 始めるまでの遅れ（インタラプタ 1 なら HID 入力の遅れ），ポーリングの回数を表示する． */
+    const int num_interrupters = usb::xhci::controller->NumInterrupters();
+    std::array<usb::xhci::InterrupterStat, usb::xhci::kMaxInterrupters> before;
+    for (int i = 0; i < num_interrupters; ++i) {
+      before[i] = usb::xhci::GetInterrupterStat(i);
+    }
+    SleepFor(kTimerFreq);
+
+    const unsigned long cycles_per_us = std::max(tsc_freq / 1000000, 1ul);
+    PrintToFD(*files_[1], "%-4s %7s %7s %8s %8s %7s %7s\n",
+        "intr", "irq/s", "ev/s", "avg us", "max us", "polls", "imod us");
+    for (int i = 0; i < num_interrupters; ++i) {
+      const auto stat = usb::xhci::GetInterrupterStat(i);
+      const uint64_t avg = stat.interrupts ? stat.latency_cycles / stat.interrupts : 0;
+      PrintToFD(*files_[1], "%-4d %7lu %7lu %8lu %8lu %7lu %7u\n",
+          i, stat.interrupts - before[i].interrupts, stat.events - before[i].events,
+          avg / cycles_per_us, stat.max_latency_cycles / cycles_per_us,
+          stat.polls, stat.imod_interval_ns / 1000);
+    }
+  } else if (strcmp(command, "sleep") == 0) {
+    const int ms = first_arg ? atoi(first_arg) : 0;
+    if (ms < 0) {
+      PrintToFD(*files_[2], "usage: sleep <ms>\n");
+      exit_code = 1;
+    } else {
+      SleepFor((static_cast<unsigned long>(ms) * kTimerFreq + 999) / 1000);
+    }
+  } else if (strcmp(command, "timerbench") == 0) {
+    const int n = first_arg && first_arg[0] != '\0' ? atoi(first_arg) : 20000;
+    if (n <= 0) {
+      PrintToFD(*files_[2], "usage: timerbench [num timers]\n");
+      exit_code = 1;
+    } else {
+      // 全段のホイールに散らばるよう，数ティックから数時間先までに仕掛ける
+      std::vector<TimerHandle> handles(n);
+      const unsigned long now = timer_manager->CurrentTick();
+      const size_t armed_before = timer_manager->NumTimers();
+      const auto add_start = ReadTSC();
+      for (int i = 0; i < n; ++i) {
+        const unsigned long delay = 1000 + (i * 7919ul) % (1ul << 20);
+        handles[i] = timer_manager->AddTimer(Timer{now + delay, 0, 0});
+      }
+      const auto add_cycles = ReadTSC() - add_start;
+      const size_t armed = timer_manager->NumTimers() - armed_before;
+
+      int cancelled = 0;
+      const auto cancel_start = ReadTSC();
+      for (int i = 0; i < n; ++i) {
+        cancelled += timer_manager->CancelTimer(handles[i]);
+      }
+      const auto cancel_cycles = ReadTSC() - cancel_start;
+
+      PrintToFD(*files_[1], "%lu timers armed, %d cancelled\n", armed, cancelled);
+      PrintToFD(*files_[1], "add   : %lu cycles/timer\n", add_cycles / n);
+      PrintToFD(*files_[1], "cancel: %lu cycles/timer\n", cancel_cycles / n);
+    }
+  } else if (strcmp(command, "clock") == 0) {
+    const uint64_t ns = NowNanos();
+    PrintToFD(*files_[1], "TSC %lu Hz from %s, %s\n", tsc_freq,
+        ClockSourceName(GetClockSource()),
+        InvariantTSC() ? "invariant" : "not invariant");
+    PrintToFD(*files_[1], "uptime %lu.%09lu s\n", ns / 1000000000, ns % 1000000000);
+  } else if (strcmp(command, "tickless") == 0) {
+    if (first_arg && strcmp(first_arg, "on") == 0) {
+      timer_manager->SetTickless(true);
+    } else if (first_arg && strcmp(first_arg, "off") == 0) {
+      timer_manager->SetTickless(false);
+    } else if (first_arg && first_arg[0] != '\0') {
+      PrintToFD(*files_[2], "usage: tickless [on|off]\n");
+      exit_code = 1;
+    }
+    PrintToFD(*files_[1], "tickless %s, %s timer, %d Hz tick\n",
+        timer_manager->Tickless() ? "on" : "off",
+        TSCDeadlineTimer() ? "tsc-deadline" : "one-shot", kTimerFreq);
+  } else if (strcmp(command, "apic") == 0) {
+    /* EOI と同じく副作用のないレジスタ（TPR に 0）への書き込みと ID の読み出しを
+     * 繰り返し，1 回あたりのサイクル数を測る．仮想マシンでは xAPIC の MMIO が
+     * トラップするので x2APIC との差が大きい． */
+    const int count = first_arg && first_arg[0] ? atoi(first_arg) : 10000;
+    if (count <= 0) {
+      PrintToFD(*files_[2], "usage: apic [count]\n");
+      exit_code = 1;
+    } else {
+      DisableInterrupts();
+      auto start = ReadTSC();
+      for (int i = 0; i < count; ++i) {
+        WriteLAPIC(LAPICRegister::kTPR, 0);
+      }
+      const auto write_cycles = (ReadTSC() - start) / count;
+      start = ReadTSC();
+      for (int i = 0; i < count; ++i) {
+        ReadLAPIC(LAPICRegister::kID);
+      }
+      const auto read_cycles = (ReadTSC() - start) / count;
+      EnableInterrupts();
+      PrintToFD(*files_[1], "%s mode, id %u\n",
+          X2APICMode() ? "x2APIC" : "xAPIC", LAPICID());
+      PrintToFD(*files_[1], "write %lu cycles, read %lu cycles\n",
+          write_cycles, read_cycles);
+    }
+  } else if (strcmp(command, "idlestat") == 0) {
+    // 自分も眠った状態で 1 秒間のタイマー割り込みを数える
+    const auto start = timer_manager->NumInterrupts();
+    SleepFor(kTimerFreq);
+    PrintToFD(*files_[1], "%lu timer interrupts/s (tickless %s)\n",
+        timer_manager->NumInterrupts() - start,
+        timer_manager->Tickless() ? "on" : "off");
   } else if (command[0] != 0) {
     auto file_entry = FindCommand(command);
     if (!file_entry) {
@@ -525,10 +965,10 @@ void Terminal::ExecuteLine() {
 
   if (pipe_fd) {
     pipe_fd->FinishWrite();
-    __asm__("cli");
+    DisableInterrupts();
     auto [ ec, err ] = task_manager->WaitFinish(subtask_id);
-    (*layer_task_map)[layer_id_] = task_.ID();
-    __asm__("sti");
+    EnableInterrupts();
+    SetLayerTask(layer_id_, task_.ID());
     if (err) {
       Log(kWarn, "failed to wait finish: %s\n", err.Name());
     }
@@ -541,58 +981,14 @@ void Terminal::ExecuteLine() {
 
 WithError<int> Terminal::ExecuteFile(fat::DirectoryEntry& file_entry,
                                      char* command, char* first_arg) {
-  __asm__("cli");
+  DisableInterrupts();
   auto& task = task_manager->CurrentTask();
-  __asm__("sti");
-
-  auto [ app_load, err ] = LoadApp(file_entry, task);
-  if (err) {
-    return { 0, err };
-  }
-
-  LinearAddress4Level args_frame_addr{0xffff'ffff'ffff'f000};
-  if (auto err = SetupPageMaps(args_frame_addr, 1)) {
-    return { 0, err };
-  }
-  auto argv = reinterpret_cast<char**>(args_frame_addr.value);
-  int argv_len = 32; // argv = 8x32 = 256 bytes
-  auto argbuf = reinterpret_cast<char*>(args_frame_addr.value + sizeof(char**) * argv_len);
-  int argbuf_len = 4096 - sizeof(char**) * argv_len;
-  auto argc = MakeArgVector(command, first_arg, argv, argv_len, argbuf, argbuf_len);
-  if (argc.error) {
-    return { 0, argc.error };
-  }
+  EnableInterrupts();
 
-  // #@@range_begin(increase_appstack)
-  const int stack_size = 16 * 4096;
-  LinearAddress4Level stack_frame_addr{0xffff'ffff'ffff'f000 - stack_size};
-  // #@@range_end(increase_appstack)
-  if (auto err = SetupPageMaps(stack_frame_addr, stack_size / 4096)) {
-    return { 0, err };
-  }
-
-  for (int i = 0; i < files_.size(); ++i) {
-    task.Files().push_back(files_[i]);
-  }
-
-  const uint64_t elf_next_page =
-    (app_load.vaddr_end + 4095) & 0xffff'ffff'ffff'f000;
-  task.SetDPagingBegin(elf_next_page);
-  task.SetDPagingEnd(elf_next_page);
-
-  task.SetFileMapEnd(stack_frame_addr.value);
-
-  int ret = CallApp(argc.value, argv, 3 << 3 | 3, app_load.entry,
-                    stack_frame_addr.value + stack_size - 8,
-                    &task.OSStackPointer());
-
-  task.Files().clear();
-  task.FileMaps().clear();
-
-  if (auto err = CleanPageMaps(LinearAddress4Level{0xffff'8000'0000'0000})) {
-    return { ret, err };
-  }
-  return { ret, FreePML4(task) };
+  return ExecuteApp(file_entry, task, files_,
+      [command, first_arg](char** argv, int argv_len, char* argbuf, int argbuf_len) {
+        return MakeArgVector(command, first_arg, argv, argv_len, argbuf, argbuf_len);
+      });
 }
 
 void Terminal::Print(char32_t c) {
@@ -650,9 +1046,9 @@ void Terminal::Print(const char* s, std::optional<size_t> len) {
 
   Message msg = MakeLayerMessage(
       task_.ID(), LayerID(), LayerOperation::DrawArea, draw_area);
-  __asm__("cli");
+  DisableInterrupts();
   task_manager->SendMessage(1, msg);
-  __asm__("sti");
+  EnableInterrupts();
 }
 
 void Terminal::Redraw() {
@@ -661,9 +1057,9 @@ void Terminal::Redraw() {
 
   Message msg = MakeLayerMessage(
       task_.ID(), LayerID(), LayerOperation::DrawArea, draw_area);
-  __asm__("cli");
+  DisableInterrupts();
   task_manager->SendMessage(1, msg);
-  __asm__("sti");
+  EnableInterrupts();
 }
 
 Rectangle<int> Terminal::HistoryUpDown(int direction) {
@@ -699,15 +1095,16 @@ void TaskTerminal(uint64_t task_id, int64_t data) {
     show_window = term_desc->show_window;
   }
 
-  __asm__("cli");
+  DisableInterrupts();
   Task& task = task_manager->CurrentTask();
+  EnableInterrupts();
   Terminal* terminal = new Terminal{task, term_desc};
   if (show_window) {
+    LockGuard guard{layer_manager->GetMutex()};
     layer_manager->Move(terminal->LayerID(), {100, 200});
-    layer_task_map->insert(std::make_pair(terminal->LayerID(), task_id));
+    SetLayerTask(terminal->LayerID(), task_id);
     active_layer->Activate(terminal->LayerID());
   }
-  __asm__("sti");
 
   if (term_desc && !term_desc->command_line.empty()) {
     for (int i = 0; i < term_desc->command_line.length(); ++i) {
@@ -718,38 +1115,46 @@ void TaskTerminal(uint64_t task_id, int64_t data) {
 
   if (term_desc && term_desc->exit_after_command) {
     delete term_desc;
-    __asm__("cli");
+    DisableInterrupts();
     task_manager->Finish(terminal->LastExitCode());
   }
 
-  auto add_blink_timer = [task_id](unsigned long t){
-    timer_manager->AddTimer(Timer{t + static_cast<int>(kTimerFreq * 0.5),
-                                  1, task_id});
+  // カーソルはウィンドウがアクティブな間だけ点滅させる
+  const int kBlinkTimer = 1;
+  TimerHandle blink_timer = 0;
+  auto add_blink_timer = [task_id, &blink_timer](unsigned long t){
+    blink_timer = timer_manager->AddTimer(
+        Timer{t + static_cast<int>(kTimerFreq * 0.5), kBlinkTimer, task_id});
   };
-  add_blink_timer(timer_manager->CurrentTick());
 
   bool window_isactive = false;
 
   while (true) {
-    __asm__("cli");
+    DisableInterrupts();
     auto msg = task.ReceiveMessage();
     if (!msg) {
       task.Sleep();
-      __asm__("sti");
+      EnableInterrupts();
       continue;
     }
-    __asm__("sti");
+    EnableInterrupts();
 
     switch (msg->type) {
     case Message::kTimerTimeout:
+      // アプリが残していったタイマー（Poll のタイムアウトなど）は無視する．
+      // 取り消す前に届いていた古い点滅タイマーも無視しないと，点滅の連鎖が二重になる
+      if (msg->arg.timer.app || msg->arg.timer.value != kBlinkTimer ||
+          msg->arg.timer.handle != blink_timer || !window_isactive) {
+        break;
+      }
       add_blink_timer(msg->arg.timer.timeout);
-      if (show_window && window_isactive) {
+      if (show_window) {
         const auto area = terminal->BlinkCursor();
         Message msg = MakeLayerMessage(
             task_id, terminal->LayerID(), LayerOperation::DrawArea, area);
-        __asm__("cli");
+        DisableInterrupts();
         task_manager->SendMessage(1, msg);
-        __asm__("sti");
+        EnableInterrupts();
       }
       break;
     case Message::kKeyPush:
@@ -758,20 +1163,31 @@ void TaskTerminal(uint64_t task_id, int64_t data) {
                                              msg->arg.keyboard.keycode,
                                              msg->arg.keyboard.ascii);
         if (show_window) {
+          const uint64_t key_tsc = msg->arg.keyboard.tsc;
           Message msg = MakeLayerMessage(
               task_id, terminal->LayerID(), LayerOperation::DrawArea, area);
-          __asm__("cli");
+          msg.arg.layer.input_tsc = key_tsc;
+          DisableInterrupts();
           task_manager->SendMessage(1, msg);
-          __asm__("sti");
+          EnableInterrupts();
         }
       }
       break;
     case Message::kWindowActive:
+      if (window_isactive == msg->arg.window_active.activate) {
+        break;
+      }
       window_isactive = msg->arg.window_active.activate;
+      if (window_isactive) {
+        add_blink_timer(timer_manager->CurrentTick());
+      } else {
+        timer_manager->CancelTimer(blink_timer);
+      }
       break;
     case Message::kWindowClose:
+      timer_manager->CancelTimer(blink_timer);
       CloseLayer(msg->arg.window_close.layer_id);
-      __asm__("cli");
+      DisableInterrupts();
       task_manager->Finish(terminal->LastExitCode());
       break;
     default:
@@ -784,19 +1200,75 @@ TerminalFileDescriptor::TerminalFileDescriptor(Terminal& term)
     : term_{term} {
 }
 
+namespace {
+  bool IsKeyPush(const Message& msg) {
+    return msg.type == Message::kKeyPush;
+  }
+
+  bool IsKeyPress(const Message& msg) {
+    return msg.type == Message::kKeyPush && msg.arg.keyboard.press;
+  }
+
+  /** @brief 端末のタスク以外（Spawn した子やスレッド）が標準入力を読む間，
+   * 端末のウィンドウへのキー入力をそのタスクへ送らせる．
+   */
+  class KeyInputRedirect {
+   public:
+    KeyInputRedirect(Terminal& term, Task& reader)
+        : layer_id_{term.LayerID()}, reader_id_{reader.ID()} {
+      if (layer_id_ == 0 || &reader == &term.UnderlyingTask()) {
+        layer_id_ = 0;
+        return;
+      }
+      do {
+        prev_task_id_ = GetLayerTask(layer_id_);
+      } while (prev_task_id_ != reader_id_ &&
+               !ReplaceLayerTask(layer_id_, prev_task_id_, reader_id_));
+    }
+
+    ~KeyInputRedirect() {
+      // 読んでいる間に別のタスクへ切り替わっていたら，そちらを優先する
+      if (layer_id_ != 0 && prev_task_id_ != reader_id_) {
+        ReplaceLayerTask(layer_id_, reader_id_, prev_task_id_);
+      }
+    }
+
+   private:
+    unsigned int layer_id_;
+    uint64_t reader_id_;
+    uint64_t prev_task_id_{0};
+  };
+}
+
 size_t TerminalFileDescriptor::Read(void* buf, size_t len) {
   char* bufc = reinterpret_cast<char*>(buf);
 
+  DisableInterrupts();
+  Task& reader = task_manager->CurrentTask();
+  EnableInterrupts();
+  Task& term_task = term_.UnderlyingTask();
+  KeyInputRedirect redirect{term_, reader};
+
   while (true) {
-    __asm__("cli");
-    auto msg = term_.UnderlyingTask().ReceiveMessage();
+    // キー入力以外のメッセージはアプリの ReadEvent などのために残しておく．
+    // 切り替える前に端末のタスクへ届いていたキー入力も読む
+    DisableInterrupts();
+    auto msg = reader.ReceiveMessage(IsKeyPush);
+    if (!msg && &reader != &term_task) {
+      msg = term_task.ReceiveMessage(IsKeyPush);
+    }
+    if (!msg && reader.Canceled()) {
+      EnableInterrupts();
+      return 0;
+    }
     if (!msg) {
-      term_.UnderlyingTask().Sleep();
+      // 眠るのは読んでいるタスク自身．他のタスクを Sleep しても待てない
+      reader.Sleep();
       continue;
     }
-    __asm__("sti");
+    EnableInterrupts();
 
-    if (msg->type != Message::kKeyPush || !msg->arg.keyboard.press) {
+    if (!msg->arg.keyboard.press) {
       continue;
     }
     if (msg->arg.keyboard.modifier & (kLControlBitMask | kRControlBitMask)) {
@@ -826,67 +1298,110 @@ size_t TerminalFileDescriptor::Load(void* buf, size_t len, size_t offset) {
   return 0;
 }
 
-PipeDescriptor::PipeDescriptor(Task& task) : task_{task} {
+int TerminalFileDescriptor::Poll() {
+  DisableInterrupts();
+  const bool readable = term_.UnderlyingTask().HasMessage(IsKeyPress);
+  EnableInterrupts();
+  return (readable ? kPollIn : 0) | kPollOut;
 }
 
 size_t PipeDescriptor::Read(void* buf, size_t len) {
-  if (len_ > 0) {
-    const size_t copy_bytes = std::min(len_, len);
-    memcpy(buf, data_, copy_bytes);
-    len_ -= copy_bytes;
-    memmove(data_, &data_[copy_bytes], len_);
-    return copy_bytes;
+  DisableInterrupts();
+  const Task& reader = task_manager->CurrentTask();
+  while (data_.empty() && !closed_ && !reader.Canceled()) {
+    wait_queue_.Sleep();
   }
 
-  if (closed_) {
-    return 0;
+  const size_t copy_bytes = std::min(data_.size(), len);
+  std::copy_n(data_.begin(), copy_bytes, reinterpret_cast<char*>(buf));
+  data_.erase(data_.begin(), data_.begin() + copy_bytes);
+  EnableInterrupts();
+  return copy_bytes;
+}
+
+size_t PipeDescriptor::Write(const void* buf, size_t len) {
+  auto bufc = reinterpret_cast<const char*>(buf);
+  DisableInterrupts();
+  data_.insert(data_.end(), bufc, bufc + len);
+  wait_queue_.WakeupAll();
+  EnableInterrupts();
+  return len;
+}
+
+int PipeDescriptor::Poll() {
+  DisableInterrupts();
+  int bits = kPollOut;
+  if (!data_.empty()) {
+    bits |= kPollIn;
+  } else if (closed_) {
+    bits |= kPollIn | kPollHup;
   }
+  EnableInterrupts();
+  return bits;
+}
 
-  while (true) {
-    __asm__("cli");
-    auto msg = task_.ReceiveMessage();
-    if (!msg) {
-      task_.Sleep();
-      continue;
-    }
-    __asm__("sti");
+void PipeDescriptor::FinishWrite() {
+  DisableInterrupts();
+  closed_ = true;
+  wait_queue_.WakeupAll();
+  EnableInterrupts();
+}
 
-    if (msg->type != Message::kPipe) {
-      continue;
-    }
+WithError<uint64_t> SpawnApp(std::vector<std::string> args,
+    const std::array<std::shared_ptr<FileDescriptor>, 3>& files,
+    bool via_terminal) {
+  if (args.empty()) {
+    return { 0, MAKE_ERROR(Error::kInvalidFormat) };
+  }
+  auto file_entry = FindCommand(args[0].c_str());
+  if (!file_entry) {
+    return { 0, MAKE_ERROR(Error::kNoSuchEntry) };
+  }
 
-    if (msg->arg.pipe.len == 0) {
-      closed_ = true;
-      return 0;
+  TaskFunc* func;
+  int64_t data;
+  if (via_terminal) {
+    std::string command_line;
+    for (const auto& arg : args) {
+      command_line += command_line.empty() ? "" : " ";
+      command_line += arg;
     }
-
-    const size_t copy_bytes = std::min<size_t>(msg->arg.pipe.len, len);
-    memcpy(buf, msg->arg.pipe.data, copy_bytes);
-    len_ = msg->arg.pipe.len - copy_bytes;
-    memcpy(data_, &msg->arg.pipe.data[copy_bytes], len_);
-    return copy_bytes;
+    func = TaskTerminal;
+    data = reinterpret_cast<int64_t>(
+        new TerminalDescriptor{command_line, true, false, files});
+  } else {
+    func = TaskApp;
+    data = reinterpret_cast<int64_t>(
+        new AppDescriptor{file_entry, std::move(args), files});
   }
+
+  DisableInterrupts();
+  auto& task = task_manager->NewTask().InitContext(func, data);
+  // 呼び出し元のアプリが先に終了してもよいよう，カーネルのページテーブルで始める
+  task.Context().cr3 = KernelCR3();
+  const uint64_t task_id = task.ID();
+  task.Wakeup();
+  EnableInterrupts();
+  return { task_id, MAKE_ERROR(Error::kSuccess) };
 }
 
-size_t PipeDescriptor::Write(const void* buf, size_t len) {
-  auto bufc = reinterpret_cast<const char*>(buf);
-  Message msg{Message::kPipe};
-  size_t sent_bytes = 0;
-  while (sent_bytes < len) {
-    msg.arg.pipe.len = std::min(len - sent_bytes, sizeof(msg.arg.pipe.data));
-    memcpy(msg.arg.pipe.data, &bufc[sent_bytes], msg.arg.pipe.len);
-    sent_bytes += msg.arg.pipe.len;
-    __asm__("cli");
-    task_.SendMessage(msg);
-    __asm__("sti");
+void TaskApp(uint64_t task_id, int64_t data) {
+  const auto app_desc = reinterpret_cast<AppDescriptor*>(data);
+
+  DisableInterrupts();
+  Task& task = task_manager->CurrentTask();
+  EnableInterrupts();
+
+  auto [ ret, err ] = ExecuteApp(*app_desc->file_entry, task, app_desc->files,
+      [app_desc](char** argv, int argv_len, char* argbuf, int argbuf_len) {
+        return CopyArgVector(app_desc->args, argv, argv_len, argbuf, argbuf_len);
+      });
+  if (err) {
+    Log(kWarn, "failed to exec %s: %s\n", app_desc->args[0].c_str(), err.Name());
+    ret = -1;
   }
-  return len;
-}
+  delete app_desc;
 
-void PipeDescriptor::FinishWrite() {
-  Message msg{Message::kPipe};
-  msg.arg.pipe.len = 0;
-  __asm__("cli");
-  task_.SendMessage(msg);
-  __asm__("sti");
+  DisableInterrupts();
+  task_manager->Finish(ret);
 }
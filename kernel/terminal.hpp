@@ -11,10 +11,13 @@
 #include <map>
 #include <memory>
 #include <optional>
+#include <string>
+#include <vector>
 #include "window.hpp"
 #include "task.hpp"
 #include "layer.hpp"
 #include "fat.hpp"
+#include "wait_queue.hpp"
 
 struct AppLoadInfo {
   uint64_t vaddr_end, entry;
@@ -30,6 +33,13 @@ struct TerminalDescriptor {
   std::array<std::shared_ptr<FileDescriptor>, 3> files;
 };
 
+/** @brief SpawnApp で起動するアプリの情報 */
+struct AppDescriptor {
+  fat::DirectoryEntry* file_entry;
+  std::vector<std::string> args;
+  std::array<std::shared_ptr<FileDescriptor>, 3> files;
+};
+
 class Terminal {
  public:
   static const int kRows = 15, kColumns = 60;
@@ -76,6 +86,16 @@ class Terminal {
 
 void TaskTerminal(uint64_t task_id, int64_t data);
 
+/** @brief args[0] のアプリを新しいタスクで起動し，そのタスク ID を返す．
+ *
+ * タスク ID は TaskManager::WaitFinish で待つことができ，アプリの終了コードが得られる．
+ * via_terminal が真なら，比較のため従来どおり画面を持たないターミナル経由で起動する．
+ */
+WithError<uint64_t> SpawnApp(std::vector<std::string> args,
+    const std::array<std::shared_ptr<FileDescriptor>, 3>& files,
+    bool via_terminal);
+void TaskApp(uint64_t task_id, int64_t data);
+
 class TerminalFileDescriptor : public FileDescriptor {
  public:
   explicit TerminalFileDescriptor(Terminal& term);
@@ -83,24 +103,26 @@ class TerminalFileDescriptor : public FileDescriptor {
   size_t Write(const void* buf, size_t len) override;
   size_t Size() const override { return 0; }
   size_t Load(void* buf, size_t len, size_t offset) override;
+  int Poll() override;
 
  private:
   Terminal& term_;
 };
 
+/** @brief 書き込んだデータを読み手が読むまで溜めておくパイプ． */
 class PipeDescriptor : public FileDescriptor {
  public:
-  explicit PipeDescriptor(Task& task);
   size_t Read(void* buf, size_t len) override;
   size_t Write(const void* buf, size_t len) override;
   size_t Size() const override { return 0; }
   size_t Load(void* buf, size_t len, size_t offset) override { return 0; }
+  int Poll() override;
+  WaitQueue* GetWaitQueue() override { return &wait_queue_; }
 
   void FinishWrite();
 
  private:
-  Task& task_;
-  char data_[16];
-  size_t len_{0};
+  std::deque<char> data_{};
   bool closed_{false};
+  WaitQueue wait_queue_{};
 };
@@ -0,0 +1,81 @@
+/**
+ * @file time_page.hpp
+ *
+ * 時刻ページ．カーネルが全アプリの同じアドレスに読み出し専用で写す 1 ページで，
+ * アプリはシステムコールを使わずに時刻とティックを求められる．
+ * カーネルとアプリの双方から参照する．
+ */
+
+#pragma once
+
+#ifdef __cplusplus
+#include <cstdint>
+extern "C" {
+#else
+#include <stdint.h>
+#endif
+
+/** @brief 時刻ページを写す仮想アドレス．ELF とデマンドページングの領域（上向きに伸びる）と
+ * ファイルマップの領域（スタックから下向きに伸びる）の間にある． */
+#define TIME_PAGE_ADDR 0xffffc00000000000ul
+
+/** @brief 時刻ページの中身．
+ *
+ * seq がシーケンスロックになっている．カーネルは書き換える間 seq を奇数にするので，
+ * 読む側は seq が偶数で，読む前後で変わっていなければその値を使う．
+ */
+struct TimePage {
+  volatile uint32_t seq;
+  uint32_t timer_freq;     // ティックの周波数（Hz）
+  uint64_t tsc_base;       // 時刻 0 の TSC
+  uint64_t tsc_freq;       // TSC の周波数（Hz）
+  uint64_t nanos_per_tick;
+  uint64_t tick;           // カーネルが最後にタイマーを処理したティック
+};
+
+/** @brief TSC を時刻（ナノ秒）に変換する．カーネルの TSCToNanos と同じ計算． */
+static inline uint64_t TimePageTSCToNanos(uint64_t tsc, uint64_t tsc_base, uint64_t tsc_freq) {
+  const uint64_t cycles = tsc - tsc_base;
+  const uint64_t sec = cycles / tsc_freq, rem = cycles % tsc_freq;
+  return sec * 1000000000ul + rem * 1000000000ul / tsc_freq;
+}
+
+/** @brief 時刻ページから現在時刻（ナノ秒）を求める．GetTimeNanos と同じ値になる． */
+static inline uint64_t TimePageNanos(void) {
+  const volatile struct TimePage* page = (const volatile struct TimePage*)TIME_PAGE_ADDR;
+  uint32_t seq;
+  uint64_t tsc, tsc_base, tsc_freq;
+  do {
+    seq = page->seq;
+    // x86 ではロード同士は入れ替わらないので，コンパイラの並べ替えだけ防げばよい
+    __asm__ volatile("" ::: "memory");
+    tsc = __builtin_ia32_rdtsc();
+    tsc_base = page->tsc_base;
+    tsc_freq = page->tsc_freq;
+    __asm__ volatile("" ::: "memory");
+  } while ((seq & 1) || seq != page->seq);
+  return TimePageTSCToNanos(tsc, tsc_base, tsc_freq);
+}
+
+/** @brief 時刻ページから現在のティックを求める．GetCurrentTick と同じ値になる． */
+static inline uint64_t TimePageTick(void) {
+  const volatile struct TimePage* page = (const volatile struct TimePage*)TIME_PAGE_ADDR;
+  uint32_t seq;
+  uint64_t nanos_per_tick;
+  do {
+    seq = page->seq;
+    __asm__ volatile("" ::: "memory");
+    nanos_per_tick = page->nanos_per_tick;
+    __asm__ volatile("" ::: "memory");
+  } while ((seq & 1) || seq != page->seq);
+  return TimePageNanos() / nanos_per_tick;
+}
+
+/** @brief ティックの周波数（Hz）．起動後は変わらない． */
+static inline uint32_t TimePageTimerFreq(void) {
+  return ((const volatile struct TimePage*)TIME_PAGE_ADDR)->timer_freq;
+}
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
@@ -1,45 +1,113 @@
 #include "timer.hpp"
 
-#include "acpi.hpp"
+#include <algorithm>
+#include <limits>
+
+#include "apic.hpp"
+#include "asmfunc.h"
+#include "irqtrace.hpp"
 #include "interrupt.hpp"
+#include "msr.hpp"
+#include "percpu.hpp"
 #include "task.hpp"
+#include "workqueue.hpp"
 
 namespace {
   const uint32_t kCountMax = 0xffffffffu;
-  volatile uint32_t& lvt_timer = *reinterpret_cast<uint32_t*>(0xfee00320);
-  volatile uint32_t& initial_count = *reinterpret_cast<uint32_t*>(0xfee00380);
-  volatile uint32_t& current_count = *reinterpret_cast<uint32_t*>(0xfee00390);
-  volatile uint32_t& divide_config = *reinterpret_cast<uint32_t*>(0xfee003e0);
+
+  bool tsc_deadline = false;
+  // 仕掛けてある割り込みの TSC．仕掛けていなければ最大値
+  uint64_t armed_tsc = std::numeric_limits<uint64_t>::max();
+
+  /** @brief TSC が tsc に達したら割り込みが来るよう LAPIC タイマーを設定する． */
+  void ProgramTimer(uint64_t tsc) {
+    armed_tsc = tsc;
+    if (tsc_deadline) {
+      WriteMSR(kIA32_TSC_DEADLINE, tsc);
+      return;
+    }
+
+    const uint64_t now = ReadTSC();
+    const uint64_t delta = tsc > now ? tsc - now : 0;
+    // 早く来すぎるとティックが進まず割り込みが無駄になるので切り上げる
+    const uint64_t count = delta * (lapic_timer_freq / 1000) / (tsc_freq / 1000) + 1;
+    WriteLAPIC(LAPICRegister::kInitialCount, std::min<uint64_t>(count, kCountMax));
+  }
+
+  /** @brief 次に割り込みが必要な時刻を求めて LAPIC タイマーを仕掛け直す． */
+  void ScheduleNextInterrupt() {
+    const unsigned long now = timer_manager->CurrentTick();
+    unsigned long next = now + 1;
+    if (timer_manager->Tickless()) {
+      next = std::min(timer_manager->NextExpiry(), now + kMaxIdleTicks);
+      if (task_manager) {
+        next = std::min(next, task_manager->NextSchedulerTick());
+      }
+      next = std::max(next, now + 1);
+    }
+    ProgramTimer(timer_manager->TickToTSC(next));
+  }
 }
 
 void InitializeLAPICTimer() {
   timer_manager = new TimerManager;
+  OpenSoftirq(Softirq::kTimer, [] { timer_manager->Tick(); });
 
-  divide_config = 0b1011; // divide 1:1
-  lvt_timer = 0b001 << 16; // masked, one-shot
-
-  StartLAPICTimer();
-  acpi::WaitMilliseconds(100);
-  const auto elapsed = LAPICTimerElapsed();
-  StopLAPICTimer();
+  // CPUID 0x15 で水晶振動子の周波数が分かれば，LAPIC タイマーはその周波数で進む
+  WriteLAPIC(LAPICRegister::kDivideConfig, 0b1011); // divide 1:1
+  lapic_timer_freq = CrystalFreq();
+  if (lapic_timer_freq == 0) {
+    // 周波数の分かっている TSC と 1ms だけ比べる
+    WriteLAPIC(LAPICRegister::kLVTTimer, 0b001 << 16); // masked, one-shot
+    const uint64_t tsc_end = ReadTSC() + tsc_freq / 1000;
+    StartLAPICTimer();
+    while (ReadTSC() < tsc_end);
+    const auto elapsed = LAPICTimerElapsed();
+    StopLAPICTimer();
+    lapic_timer_freq = static_cast<unsigned long>(elapsed) * 1000;
+  }
 
-  lapic_timer_freq = static_cast<unsigned long>(elapsed) * 10;
+  // CPUID.01H:ECX[24] が TSC デッドラインモードの有無
+  uint32_t regs[4];
+  CPUID(1, 0, regs);
+  tsc_deadline = (regs[2] >> 24) & 1;
 
-  divide_config = 0b1011; // divide 1:1
-  lvt_timer = (0b010 << 16) | InterruptVector::kLAPICTimer; // not-masked, periodic
-  initial_count = lapic_timer_freq / kTimerFreq;
+  WriteLAPIC(LAPICRegister::kDivideConfig, 0b1011); // divide 1:1
+  if (tsc_deadline) {
+    // not-masked, TSC-deadline
+    WriteLAPIC(LAPICRegister::kLVTTimer, (0b100 << 16) | InterruptVector::kLAPICTimer);
+  } else {
+    // not-masked, one-shot
+    WriteLAPIC(LAPICRegister::kLVTTimer, (0b000 << 16) | InterruptVector::kLAPICTimer);
+  }
+  ProgramTimer(timer_manager->TickToTSC(1));
 }
 
 void StartLAPICTimer() {
-  initial_count = kCountMax;
+  WriteLAPIC(LAPICRegister::kInitialCount, kCountMax);
 }
 
 uint32_t LAPICTimerElapsed() {
-  return kCountMax - current_count;
+  return kCountMax - ReadLAPIC(LAPICRegister::kCurrentCount);
 }
 
 void StopLAPICTimer() {
-  initial_count = 0;
+  WriteLAPIC(LAPICRegister::kInitialCount, 0);
+}
+
+void ArmTimerInterrupt(unsigned long tick) {
+  const uint64_t tsc = timer_manager->TickToTSC(tick);
+  if (tsc < armed_tsc) {
+    ProgramTimer(tsc);
+  }
+}
+
+bool TSCDeadlineTimer() {
+  return tsc_deadline;
+}
+
+uint64_t ArmedTimerTSC() {
+  return armed_tsc;
 }
 
 Timer::Timer(unsigned long timeout, int value, uint64_t task_id)
@@ -47,49 +115,300 @@ Timer::Timer(unsigned long timeout, int value, uint64_t task_id)
 }
 
 TimerManager::TimerManager() {
-  timers_.push(Timer{std::numeric_limits<unsigned long>::max(), 0, 0});
+  chunks_.reserve(256);
+}
+
+TimerHandle TimerManager::AddTimer(const Timer& timer) {
+  return Add(timer, nullptr);
+}
+
+TimerHandle TimerManager::AddWakeup(unsigned long timeout, Task* task) {
+  return Add(Timer{timeout, 0, 0}, task);
+}
+
+TimerHandle TimerManager::Add(const Timer& timer, Task* sleeper) {
+  LockGuard guard{lock_};
+  Refill();
+  Node* node = free_;
+  free_ = node->next;
+
+  node->timeout = timer.Timeout();
+  node->period = timer.Period();
+  node->value = timer.Value();
+  node->app = timer.App();
+  node->task_id = timer.TaskID();
+  node->sleeper = sleeper;
+  // 過ぎた時刻を指定されたら次のティックで発火させる
+  const unsigned long next_tick = tick_ + 1;
+  const unsigned long expires = std::max(node->timeout, next_tick);
+  Place(node, expires);
+  ++num_timers_;
+  ArmTimerInterrupt(expires);
+  return MakeHandle(node);
+}
+
+TimerHandle TimerManager::MakeHandle(const Node* node) {
+  return static_cast<TimerHandle>(node->generation) << 32 | (node->index + 1);
+}
+
+bool TimerManager::CancelTimer(TimerHandle handle) {
+  LockGuard guard{lock_};
+  Node* node = NodeAt(handle);
+  if (node == nullptr || node->slot == nullptr) {
+    return false;
+  }
+  Unlink(node);
+  Release(node);
+  return true;
+}
+
+bool TimerManager::CancelAppTimer(TimerHandle handle, uint64_t task_id) {
+  LockGuard guard{lock_};
+  Node* node = NodeAt(handle);
+  if (node == nullptr || node->slot == nullptr ||
+      !node->app || node->task_id != task_id) {
+    return false;
+  }
+  Unlink(node);
+  Release(node);
+  return true;
+}
+
+bool TimerManager::ModifyTimer(TimerHandle handle, const Timer& timer) {
+  LockGuard guard{lock_};
+  Node* node = NodeAt(handle);
+  if (node == nullptr || node->slot == nullptr ||
+      node->task_id != timer.TaskID() || node->app != timer.App()) {
+    return false;
+  }
+  Unlink(node);
+  node->timeout = timer.Timeout();
+  node->period = timer.Period();
+  node->value = timer.Value();
+  const unsigned long next_tick = tick_ + 1;
+  const unsigned long expires = std::max(node->timeout, next_tick);
+  Place(node, expires);
+  ArmTimerInterrupt(expires);
+  return true;
+}
+
+void TimerManager::CancelAppTimers(uint64_t task_id) {
+  LockGuard guard{lock_};
+  for (Node* chunk : chunks_) {
+    for (size_t i = 0; i < kNodesPerChunk; ++i) {
+      Node* node = &chunk[i];
+      if (node->slot && node->app && node->task_id == task_id) {
+        Unlink(node);
+        Release(node);
+      }
+    }
+  }
 }
 
-void TimerManager::AddTimer(const Timer& timer) {
-  timers_.push(timer);
+void TimerManager::Tick() {
+  LockGuard guard{lock_};
+  ++num_interrupts_;
+
+  const unsigned long now = CurrentTick();
+  while (tick_ < now) {
+    ++tick_;
+
+    const unsigned long tick = tick_;
+    const int index = tick & (kWheelSize - 1);
+    if (index == 0) {
+      // 上の段は，すぐ下の段が一周したときだけ振り分け直す
+      for (int level = 1; level < kWheelLevels; ++level) {
+        if (Cascade(level, (tick >> (kWheelBits * level)) & (kWheelSize - 1)) != 0) {
+          break;
+        }
+      }
+    }
+
+    while (Node* node = wheel_[0][index]) {
+      Unlink(node);
+      if (node->period == 0) {
+        Fire(node, 0);
+        Release(node);
+        continue;
+      }
+
+      /* 周期タイマーは最初の期限からの絶対時刻で次を決めるので，発火が遅れても
+       * ずれがたまらない．割り込みが遅れて過ぎてしまった期限は飛ばし，その数を
+       * 知らせる． */
+      const unsigned long overrun = (now - node->timeout) / node->period;
+      Fire(node, overrun);
+      node->timeout += (overrun + 1) * node->period;
+      Place(node, node->timeout);
+    }
+  }
+  PublishTick(tick_);
 }
 
-bool TimerManager::Tick() {
-  ++tick_;
+unsigned long TimerManager::NextExpiry() {
+  LockGuard guard{lock_};
+  const unsigned long tick = tick_;
 
-  bool task_timer_timeout = false;
-  while (true) {
-    const auto& t = timers_.top();
-    if (t.Timeout() > tick_) {
-      break;
+  // 上の段のタイマーは，次に段 0 が一周するときの振り分けより後に期限が来る
+  unsigned long next = std::numeric_limits<unsigned long>::max();
+  for (int level = 1; level < kWheelLevels; ++level) {
+    for (int i = 0; i < kWheelSize; ++i) {
+      if (wheel_[level][i]) {
+        next = (tick | (kWheelSize - 1)) + 1;
+        break;
+      }
     }
+  }
 
-    if (t.Value() == kTaskTimerValue) {
-      task_timer_timeout = true;
-      timers_.pop();
-      timers_.push(Timer{tick_ + kTaskTimerPeriod, kTaskTimerValue, 1});
-      continue;
+  // 段 0 には 63 ティック先までのタイマーが期限のスロットに入っている
+  for (unsigned long t = tick + 1; t < tick + kWheelSize && t < next; ++t) {
+    if (wheel_[0][t & (kWheelSize - 1)]) {
+      return t;
     }
+  }
+  return next;
+}
 
-    Message m{Message::kTimerTimeout};
-    m.arg.timer.timeout = t.Timeout();
-    m.arg.timer.value = t.Value();
-    task_manager->SendMessage(t.TaskID(), m);
+void TimerManager::Refill() {
+  if (free_) {
+    return;
+  }
 
-    timers_.pop();
+  // 割り込みを禁止したまま確保しないよう，ロックを外して確保する
+  lock_.Unlock();
+  auto chunk = new Node[kNodesPerChunk];
+  lock_.Lock();
+
+  const uint32_t base = chunks_.size() * kNodesPerChunk;
+  chunks_.push_back(chunk);
+  for (size_t i = kNodesPerChunk; i-- > 0; ) {
+    chunk[i].slot = nullptr;
+    chunk[i].index = base + i;
+    chunk[i].generation = 0;
+    chunk[i].next = free_;
+    free_ = &chunk[i];
   }
+}
 
-  return task_timer_timeout;
+TimerManager::Node* TimerManager::NodeAt(TimerHandle handle) {
+  const uint32_t low = handle & 0xffffffffu;
+  if (low == 0 || low > chunks_.size() * kNodesPerChunk) {
+    return nullptr;
+  }
+  const uint32_t index = low - 1;
+  Node* node = &chunks_[index / kNodesPerChunk][index % kNodesPerChunk];
+  if (node->generation != handle >> 32) {
+    return nullptr;
+  }
+  return node;
+}
+
+void TimerManager::Place(Node* node, unsigned long expires) {
+  const unsigned long kMaxDelta = (1ul << (kWheelBits * kWheelLevels)) - 1;
+  if (expires - tick_ > kMaxDelta) {
+    expires = tick_ + kMaxDelta;
+  }
+  const unsigned long delta = expires - tick_;
+
+  int level = 0;
+  while (level < kWheelLevels - 1 &&
+         delta >= (1ul << (kWheelBits * (level + 1)))) {
+    ++level;
+  }
+  const int index = (expires >> (kWheelBits * level)) & (kWheelSize - 1);
+
+  Node** slot = &wheel_[level][index];
+  node->prev = nullptr;
+  node->next = *slot;
+  if (*slot) {
+    (*slot)->prev = node;
+  }
+  *slot = node;
+  node->slot = slot;
+}
+
+void TimerManager::Unlink(Node* node) {
+  if (node->prev) {
+    node->prev->next = node->next;
+  } else {
+    *node->slot = node->next;
+  }
+  if (node->next) {
+    node->next->prev = node->prev;
+  }
+  node->slot = nullptr;
+}
+
+void TimerManager::Release(Node* node) {
+  ++node->generation;
+  node->next = free_;
+  free_ = node;
+  --num_timers_;
+}
+
+int TimerManager::Cascade(int level, int index) {
+  Node* node = wheel_[level][index];
+  wheel_[level][index] = nullptr;
+  while (node) {
+    Node* next = node->next;
+    // このスロットに入っているタイマーの期限は tick_ 以降
+    const unsigned long tick = tick_;
+    Place(node, std::max(node->timeout, tick));
+    node = next;
+  }
+  return index;
+}
+
+void TimerManager::Fire(Node* node, unsigned long overrun) {
+  if (node->sleeper) {
+    task_manager->Wakeup(node->sleeper);
+    return;
+  }
+
+  Message m{Message::kTimerTimeout};
+  m.arg.timer.timeout = node->timeout;
+  m.arg.timer.value = node->value;
+  m.arg.timer.app = node->app;
+  m.arg.timer.overrun = overrun;
+  m.arg.timer.handle = MakeHandle(node);
+  task_manager->SendMessage(node->task_id, m);
+}
+
+void SleepFor(unsigned long ticks) {
+  if (ticks == 0) {
+    return;
+  }
+
+  DisableInterrupts();
+  Task& task = task_manager->CurrentTask();
+  const unsigned long deadline = timer_manager->CurrentTick() + ticks;
+  const auto handle = timer_manager->AddWakeup(deadline, &task);
+  // 起こされるのを取りこぼさないよう，割り込みを禁止したまま眠る
+  while (timer_manager->CurrentTick() < deadline && !task.Canceled()) {
+    task.Sleep();
+  }
+  timer_manager->CancelTimer(handle);
+  EnableInterrupts();
 }
 
 TimerManager* timer_manager;
 unsigned long lapic_timer_freq;
 
-extern "C" void LAPICTimerOnInterrupt(const TaskContext& ctx_stack) {
-  const bool task_timer_timeout = timer_manager->Tick();
+extern "C" TaskContext* LAPICTimerOnInterrupt() {
+  const uint64_t entry_tsc = ReadTSC();
+  IrqTraceInterrupted();
+  armed_tsc = std::numeric_limits<uint64_t>::max();
+  RaiseSoftirq(Softirq::kTimer);
   NotifyEndOfInterrupt();
+  // タイマーの発火はソフト割り込みで行う
+  IrqExit(entry_tsc);
+
+  const bool switch_task =
+    task_manager && task_manager->OnTick(timer_manager->CurrentTick());
 
-  if (task_timer_timeout) {
-    task_manager->SwitchTask(ctx_stack);
+  TaskContext* next = CurrentCPU()->context;
+  if (switch_task) {
+    next = task_manager->SwitchTask();
   }
+  ScheduleNextInterrupt();
+  return next;
 }
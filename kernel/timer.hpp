@@ -1,15 +1,37 @@
 #pragma once
 
+#include <cstddef>
 #include <cstdint>
-#include <queue>
 #include <vector>
 #include <limits>
+#include "clock.hpp"
+#include "lock.hpp"
 #include "message.hpp"
 
+/** @brief LAPIC タイマーをワンショットか TSC デッドラインで動かし始める．
+ *
+ * TSC の周波数を使うので InitializeClock の後に呼ぶ．
+ * タイマー割り込みは周期的には起こさず，次に必要な時刻（最も近いタイマーか
+ * スケジューラのタイムスライスの終わり）に 1 回ずつ仕掛け直す．
+ */
 void InitializeLAPICTimer();
 void StartLAPICTimer();
 uint32_t LAPICTimerElapsed();
 void StopLAPICTimer();
+/** @brief 遅くとも tick には割り込みが来るようにする．割り込みを禁止して呼ぶこと． */
+void ArmTimerInterrupt(unsigned long tick);
+/** @brief TSC デッドラインモードで動いていれば true */
+bool TSCDeadlineTimer();
+/** @brief 次にタイマー割り込みが来る TSC．仕掛けていなければ最大値．割り込みを禁止して呼ぶこと． */
+uint64_t ArmedTimerTSC();
+
+/** @brief ティックの周波数．ティックレスなので，上げても暇なときの割り込みは増えない． */
+const int kTimerFreq = 1000;
+const uint64_t kNanosPerTick = 1000000000 / kTimerFreq;
+/** @brief ティックレスでも，少なくともこの間隔で割り込みを起こす． */
+const int kMaxIdleTicks = kTimerFreq;
+
+class Task;
 
 class Timer {
  public:
@@ -17,33 +39,136 @@ class Timer {
   unsigned long Timeout() const { return timeout_; }
   int Value() const { return value_; }
   uint64_t TaskID() const { return task_id_; }
+  unsigned long Period() const { return period_; }
+  bool App() const { return app_; }
+
+  /** @brief 0 でなければ，発火後に timeout + period * n の絶対時刻で発火し続ける． */
+  Timer& SetPeriod(unsigned long period) { period_ = period; return *this; }
+  /** @brief アプリが作ったタイマーとする．ReadEvent でアプリに渡される． */
+  Timer& SetApp(bool app) { app_ = app; return *this; }
 
  private:
   unsigned long timeout_;
   int value_;
   uint64_t task_id_;
+  unsigned long period_{0};
+  bool app_{false};
 };
 
-/** @brief タイマー優先度を比較する。タイムアウトが遠いほど優先度低。 */
-inline bool operator<(const Timer& lhs, const Timer& rhs) {
-  return lhs.Timeout() > rhs.Timeout();
-}
+/** @brief 登録したタイマーを指すハンドル．0 はどのタイマーも指さない．
+ *
+ * 下位 32 ビットがタイマーの番号 + 1，上位 32 ビットが世代．タイマーが発火するか
+ * 取り消されると世代が進むので，古いハンドルで別のタイマーを取り消すことはない．
+ */
+using TimerHandle = uint64_t;
 
+/** @brief 階層化タイミングホイールでタイマーを管理する．
+ *
+ * 64 スロットのホイールを 4 段持ち，段 n のスロットは 64^n ティック分を受け持つ．
+ * 登録と取り消しは O(1)．上の段のスロットは，そこを受け持つ範囲に入ったときに
+ * 下の段へ振り分け直す．2^24 ティックより先のタイマーは最上段に置き，振り分け直す
+ * たびに残りを計算し直す．
+ */
 class TimerManager {
  public:
+  static const int kWheelBits = 6;
+  static const int kWheelSize = 1 << kWheelBits;
+  static const int kWheelLevels = 4;
+
   TimerManager();
-  void AddTimer(const Timer& timer);
-  bool Tick();
-  unsigned long CurrentTick() const { return tick_; }
+  /** @brief タイマーを登録する．割り込みを禁止せずに呼んでよい．
+   *
+   * タイムアウトしたら timer.TaskID() のタスクへ kTimerTimeout を送る．
+   */
+  TimerHandle AddTimer(const Timer& timer);
+  /** @brief タイマーを取り消す．発火前に取り消せたら true．
+   *
+   * 周期タイマーは取り消すまで発火し続ける．
+   */
+  bool CancelTimer(TimerHandle handle);
+  /** @brief task_id のタスクでアプリが作ったタイマーに限って取り消す．
+   *
+   * 同じタスクでもカーネルが使うタイマー（Poll のタイムアウトなど）は取り消さない．
+   */
+  bool CancelAppTimer(TimerHandle handle, uint64_t task_id);
+  /** @brief 登録済みのタイマーの期限と周期を timer のものに変える．
+   *
+   * timer.TaskID() のタスクのタイマーでなければ，アプリが作ったかどうかが timer.App() と
+   * 異なれば，あるいはもう発火した単発のタイマーなら false を返す．
+   */
+  bool ModifyTimer(TimerHandle handle, const Timer& timer);
+  /** @brief task_id のタスクにアプリが作ったタイマーをすべて取り消す． */
+  void CancelAppTimers(uint64_t task_id);
+  /** @brief timeout のティックで task を起こすタイマーを登録する．メッセージは送らない． */
+  TimerHandle AddWakeup(unsigned long timeout, Task* task);
+  /** @brief 現在のティックまでホイールを進め，期限の来たタイマーを発火させる．
+   *
+   * タイマー割り込みから呼ぶ．ティックレスの間は一度に何ティックも進むことがある．
+   */
+  void Tick();
+  /** @brief 時計から求めた現在のティック．割り込みが止まっていても進む． */
+  unsigned long CurrentTick() const { return NowNanos() / kNanosPerTick; }
+  /** @brief ティック tick が始まる時刻の TSC */
+  uint64_t TickToTSC(unsigned long tick) const { return NanosToTSC(tick * kNanosPerTick); }
+  /** @brief ホイールを次に進める必要があるティック．タイマーがなければ最大値． */
+  unsigned long NextExpiry();
+  /** @brief 登録されているタイマーの数 */
+  size_t NumTimers() const { return num_timers_; }
+
+  /** @brief false にすると，比較のため毎ティック割り込みを起こす． */
+  void SetTickless(bool tickless) { tickless_ = tickless; }
+  bool Tickless() const { return tickless_; }
+  /** @brief 起動してからのタイマー割り込みの回数 */
+  unsigned long NumInterrupts() const { return num_interrupts_; }
 
  private:
+  struct Node {
+    Node* prev;
+    Node* next;
+    Node** slot;       // 繋がっているスロット．未登録なら nullptr
+    unsigned long timeout;
+    unsigned long period;
+    int value;
+    bool app;
+    uint64_t task_id;
+    Task* sleeper;     // nullptr でなければメッセージの代わりにこのタスクを起こす
+    uint32_t index;
+    uint32_t generation;
+  };
+  static const size_t kNodesPerChunk = 256;
+
+  TimerHandle Add(const Timer& timer, Task* sleeper);
+  static TimerHandle MakeHandle(const Node* node);
+  /** @brief free_ が空ならロックを外してノードを補充する．lock_ を保持して呼ぶ． */
+  void Refill();
+  Node* NodeAt(TimerHandle handle);
+  /** @brief ノードを expires に応じたスロットへ繋ぐ．expires は tick_ 以上であること． */
+  void Place(Node* node, unsigned long expires);
+  void Unlink(Node* node);
+  void Release(Node* node);
+  /** @brief 段 level の index 番目のスロットを下の段へ振り分け直す． */
+  int Cascade(int level, int index);
+  void Fire(Node* node, unsigned long overrun);
+
+  // ホイールを進め終えたティック．CurrentTick() より遅れていることがある
   volatile unsigned long tick_{0};
-  std::priority_queue<Timer> timers_{};
+  size_t num_timers_{0};
+  volatile unsigned long num_interrupts_{0};
+  bool tickless_{true};
+  Node* wheel_[kWheelLevels][kWheelSize]{};
+  std::vector<Node*> chunks_{};
+  Node* free_{nullptr};
+  SpinLock lock_{"timer"};
 };
 
+/** @brief 実行中のタスクを ticks だけ眠らせる．割り込みを禁止せずに呼ぶこと．
+ *
+ * メッセージを介さずにタイマーが直接タスクを起こす．途中でメッセージなどに
+ * 起こされても，期限が来るまでは眠り直す．
+ */
+void SleepFor(unsigned long ticks);
+
 extern TimerManager* timer_manager;
 extern unsigned long lapic_timer_freq;
-const int kTimerFreq = 100;
 
 const int kTaskTimerPeriod = static_cast<int>(kTimerFreq * 0.02);
-const int kTaskTimerValue = std::numeric_limits<int>::max();
@@ -3,6 +3,7 @@
 #include "logger.hpp"
 #include "usb/memory.hpp"
 #include "usb/xhci/ring.hpp"
+#include "usb/xhci/xhci.hpp"
 
 namespace {
   using namespace usb::xhci;
@@ -216,6 +217,7 @@ namespace usb::xhci {
     normal.bits.trb_transfer_length = len;
     normal.bits.interrupt_on_short_packet = true;
     normal.bits.interrupt_on_completion = true;
+    normal.bits.interrupter_target = InterrupterFor(EndpointType::kInterrupt);
 
     tr->Push(normal);
     dbreg_->Ring(dci.value);
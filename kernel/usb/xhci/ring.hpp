@@ -96,11 +96,11 @@ namespace usb::xhci {
     void Pop();
 
    private:
-    TRB* buf_;
-    size_t buf_size_;
+    TRB* buf_{nullptr};
+    size_t buf_size_{0};
 
     bool cycle_bit_;
-    EventRingSegmentTableEntry* erst_;
-    InterrupterRegisterSet* interrupter_;
+    EventRingSegmentTableEntry* erst_{nullptr};
+    InterrupterRegisterSet* interrupter_{nullptr};
   };
 }
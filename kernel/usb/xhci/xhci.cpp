@@ -1,10 +1,17 @@
 #include "usb/xhci/xhci.hpp"
 
+#include <algorithm>
 #include <cstring>
+#include "apic.hpp"
 #include "logger.hpp"
 #include "pci.hpp"
 #include "interrupt.hpp"
+#include "asmfunc.h"
+#include "fiber.hpp"
+#include "irqtrace.hpp"
+#include "lock.hpp"
 #include "timer.hpp"
+#include "workqueue.hpp"
 #include "usb/setupdata.hpp"
 #include "usb/device.hpp"
 #include "usb/descriptor.hpp"
@@ -33,19 +40,35 @@ namespace {
     kConfiguringEndpoints,
     kConfigured,
   };
+
+  /** ポートごとの設定状態．イベントハンドラが結果を書き込み，event を Signal する． */
+  struct PortState {
+    volatile ConfigPhase phase;
+    FiberEvent event;
+    uint8_t slot_id;              // Enable Slot コマンドで割り当てられたスロット
+    unsigned int completed_cmd;   // 最後に完了したコマンドの TRB タイプ
+    uint64_t config_cycles;       // 設定開始から完了までの TSC サイクル数
+  };
+  std::array<PortState, 256> ports{};  // index: port number
+
   /* root hub port はリセット処理をしてからアドレスを割り当てるまでは
    * 他の処理を挟まず，そのポートについての処理だけをしなければならない．
-   * kWaitingAddressed はリセット（kResettingPort）からアドレス割り当て
-   * （kAddressingDevice）までの一連の処理の実行を待っている状態．
+   * この区間に入れるのは addressing_sem を取得した 1 ポートだけ．
    */
-
-  std::array<volatile ConfigPhase, 256> port_config_phase{};  // index: port number
+  FiberEvent addressing_sem{1};
 
   /** kResettingPort から kAddressingDevice までの処理を実行中のポート番号．
    * 0 ならその状態のポートがないことを示す．
    */
   uint8_t addressing_port{0};
 
+  /** xHC のリングやデバイスの状態を触る処理を排他する．
+   * イベント処理と，ポート設定ファイバーの各段階がこれを取得する．
+   */
+  Mutex* xhc_mutex;
+
+  std::array<InterrupterStat, kMaxInterrupters> interrupter_stats{};
+
   void InitializeSlotContext(SlotContext& ctx, Port& port) {
     ctx.bits.route_string = 0;
     ctx.bits.root_hub_port_num = port.Number();
@@ -89,49 +112,6 @@ namespace {
     ctx.bits.error_count = 3;
   }
 
-  Error ResetPort(Controller& xhc, Port& port) {
-    const bool is_connected = port.IsConnected();
-    Log(kDebug, "ResetPort: port.IsConnected() = %s\n",
-        is_connected ? "true" : "false");
-
-    if (!is_connected) {
-      return MAKE_ERROR(Error::kSuccess);
-    }
-
-    if (addressing_port != 0) {
-      port_config_phase[port.Number()] = ConfigPhase::kWaitingAddressed;
-    } else {
-      const auto port_phase = port_config_phase[port.Number()];
-      if (port_phase != ConfigPhase::kNotConnected &&
-          port_phase != ConfigPhase::kWaitingAddressed) {
-        return MAKE_ERROR(Error::kInvalidPhase);
-      }
-      addressing_port = port.Number();
-      port_config_phase[port.Number()] = ConfigPhase::kResettingPort;
-      port.Reset();
-    }
-    return MAKE_ERROR(Error::kSuccess);
-  }
-
-  Error EnableSlot(Controller& xhc, Port& port) {
-    const bool is_enabled = port.IsEnabled();
-    const bool reset_completed = port.IsPortResetChanged();
-    Log(kDebug, "EnableSlot: port.IsEnabled() = %s, port.IsPortResetChanged() = %s\n",
-        is_enabled ? "true" : "false",
-        reset_completed ? "true" : "false");
-
-    if (is_enabled && reset_completed) {
-      port.ClearPortResetChange();
-
-      port_config_phase[port.Number()] = ConfigPhase::kEnablingSlot;
-
-      EnableSlotCommandTRB cmd{};
-      xhc.CommandRing()->Push(cmd);
-      xhc.DoorbellRegisterAt(0)->Ring(0);
-    }
-    return MAKE_ERROR(Error::kSuccess);
-  }
-
   Error AddressDevice(Controller& xhc, uint8_t port_id, uint8_t slot_id) {
     Log(kDebug, "AddressDevice: port_id = %d, slot_id = %d\n", port_id, slot_id);
 
@@ -158,7 +138,7 @@ namespace {
 
     xhc.DeviceManager()->LoadDCBAA(slot_id);
 
-    port_config_phase[port_id] = ConfigPhase::kAddressingDevice;
+    ports[port_id].phase = ConfigPhase::kAddressingDevice;
 
     AddressDeviceCommandTRB addr_dev_cmd{dev->InputContext(), slot_id};
     xhc.CommandRing()->Push(addr_dev_cmd);
@@ -167,44 +147,127 @@ namespace {
     return MAKE_ERROR(Error::kSuccess);
   }
 
-  Error InitializeDevice(Controller& xhc, uint8_t port_id, uint8_t slot_id) {
-    Log(kDebug, "InitializeDevice: port_id = %d, slot_id = %d\n", port_id, slot_id);
+  /** @brief 1 つのポートを，接続からデバイスの設定完了まで進めるファイバー． */
+  class PortConfigFiber : public Fiber {
+   public:
+    PortConfigFiber(Controller& xhc, uint8_t port_id)
+        : xhc_{xhc}, port_id_{port_id}, port_state_{ports[port_id]} {
+    }
 
-    auto dev = xhc.DeviceManager()->FindBySlot(slot_id);
-    if (dev == nullptr) {
-      return MAKE_ERROR(Error::kInvalidSlotID);
+    bool Resume() override {
+      LockGuard guard{*xhc_mutex};
+      return Step();
     }
 
-    port_config_phase[port_id] = ConfigPhase::kInitializingDevice;
-    dev->StartInitialize();
+   private:
+    Controller& xhc_;
+    uint8_t port_id_;
+    PortState& port_state_;
+    Device* dev_{nullptr};
+    uint64_t start_tsc_{0};
 
-    return MAKE_ERROR(Error::kSuccess);
-  }
-
-  Error CompleteConfiguration(Controller& xhc, uint8_t port_id, uint8_t slot_id) {
-    Log(kDebug, "CompleteConfiguration: port_id = %d, slot_id = %d\n", port_id, slot_id);
+    /** @brief コマンドを発行し，その完了を待てるよう completed_cmd を消す． */
+    template <class CommandTRB>
+    void PushCommand(const CommandTRB& cmd) {
+      port_state_.completed_cmd = 0;
+      xhc_.CommandRing()->Push(cmd);
+      xhc_.DoorbellRegisterAt(0)->Ring(0);
+    }
 
-    auto dev = xhc.DeviceManager()->FindBySlot(slot_id);
-    if (dev == nullptr) {
-      return MAKE_ERROR(Error::kInvalidSlotID);
+    bool Fail(const Error& err) {
+      Log(kError, "failed to configure port %d: %s at %s:%d\n",
+          port_id_, err.Name(), err.File(), err.Line());
+      if (addressing_port == port_id_) {
+        addressing_port = 0;
+        addressing_sem.Signal();
+      }
+      return true;
     }
 
-    dev->OnEndpointsConfigured();
+    bool Step() {
+      auto port = xhc_.PortAt(port_id_);
+      FIBER_BEGIN;
+      start_tsc_ = ReadTSC();
+      FIBER_WAIT(addressing_sem);
 
-    port_config_phase[port_id] = ConfigPhase::kConfigured;
-    return MAKE_ERROR(Error::kSuccess);
-  }
+      if (!port.IsConnected()) {
+        port_state_.phase = ConfigPhase::kNotConnected;
+        addressing_sem.Signal();
+        return true;
+      }
+
+      Log(kDebug, "ResetPort: port_id = %d\n", port_id_);
+      addressing_port = port_id_;
+      port_state_.phase = ConfigPhase::kResettingPort;
+      port.Reset();
+      while (!(port.IsEnabled() && port.IsPortResetChanged())) {
+        FIBER_WAIT(port_state_.event);
+      }
+      port.ClearPortResetChange();
+
+      Log(kDebug, "EnableSlot: port_id = %d\n", port_id_);
+      port_state_.phase = ConfigPhase::kEnablingSlot;
+      PushCommand(EnableSlotCommandTRB{});
+      while (port_state_.completed_cmd != EnableSlotCommandTRB::Type) {
+        FIBER_WAIT(port_state_.event);
+      }
+
+      port_state_.completed_cmd = 0;
+      if (auto err = AddressDevice(xhc_, port_id_, port_state_.slot_id)) {
+        return Fail(err);
+      }
+      while (port_state_.completed_cmd != AddressDeviceCommandTRB::Type) {
+        FIBER_WAIT(port_state_.event);
+      }
+      addressing_port = 0;
+      addressing_sem.Signal();
+
+      Log(kDebug, "InitializeDevice: port_id = %d, slot_id = %d\n",
+          port_id_, port_state_.slot_id);
+      dev_ = xhc_.DeviceManager()->FindBySlot(port_state_.slot_id);
+      if (dev_ == nullptr) {
+        return Fail(MAKE_ERROR(Error::kInvalidSlotID));
+      }
+      port_state_.phase = ConfigPhase::kInitializingDevice;
+      if (auto err = dev_->StartInitialize()) {
+        return Fail(err);
+      }
+      while (!dev_->IsInitialized()) {
+        FIBER_WAIT(port_state_.event);
+      }
+
+      port_state_.completed_cmd = 0;
+      if (auto err = ConfigureEndpoints(xhc_, *dev_)) {
+        return Fail(err);
+      }
+      while (port_state_.completed_cmd != ConfigureEndpointCommandTRB::Type) {
+        FIBER_WAIT(port_state_.event);
+      }
+
+      Log(kDebug, "CompleteConfiguration: port_id = %d, slot_id = %d\n",
+          port_id_, port_state_.slot_id);
+      if (auto err = dev_->OnEndpointsConfigured()) {
+        return Fail(err);
+      }
+      port_state_.phase = ConfigPhase::kConfigured;
+      port_state_.config_cycles = ReadTSC() - start_tsc_;
+      Log(kInfo, "port %d configured in %lu us\n", port_id_,
+          port_state_.config_cycles / std::max(tsc_freq / 1000000, 1ul));
+      FIBER_END;
+    }
+  };
 
   Error OnEvent(Controller& xhc, PortStatusChangeEventTRB& trb) {
     Log(kDebug, "PortStatusChangeEvent: port_id = %d\n", trb.bits.port_id);
     auto port_id = trb.bits.port_id;
     auto port = xhc.PortAt(port_id);
 
-    switch (port_config_phase[port_id]) {
+    switch (ports[port_id].phase) {
     case ConfigPhase::kNotConnected:
-      return ResetPort(xhc, port);
+      return ConfigurePort(xhc, port);
     case ConfigPhase::kResettingPort:
-      return EnableSlot(xhc, port);
+      ports[port_id].event.Signal();
+      return MAKE_ERROR(Error::kSuccess);
     default:
       return MAKE_ERROR(Error::kInvalidPhase);
     }
@@ -221,9 +284,8 @@ namespace {
     }
 
     const auto port_id = dev->DeviceContext()->slot_context.bits.root_hub_port_num;
-    if (dev->IsInitialized() &&
-        port_config_phase[port_id] == ConfigPhase::kInitializingDevice) {
-      return ConfigureEndpoints(xhc, *dev);
+    if (ports[port_id].phase == ConfigPhase::kInitializingDevice) {
+      ports[port_id].event.Signal();
     }
     return MAKE_ERROR(Error::kSuccess);
   }
@@ -234,54 +296,40 @@ namespace {
     Log(kDebug, "CommandCompletionEvent: slot_id = %d, issuer = %s\n",
         trb.bits.slot_id, kTRBTypeToName[issuer_type]);
 
+    uint8_t port_id;
+    ConfigPhase expected_phase;
     if (issuer_type == EnableSlotCommandTRB::Type) {
-      if (port_config_phase[addressing_port] != ConfigPhase::kEnablingSlot) {
-        return MAKE_ERROR(Error::kInvalidPhase);
-      }
-
-      return AddressDevice(xhc, addressing_port, slot_id);
-    } else if (issuer_type == AddressDeviceCommandTRB::Type) {
+      port_id = addressing_port;
+      expected_phase = ConfigPhase::kEnablingSlot;
+    } else {
       auto dev = xhc.DeviceManager()->FindBySlot(slot_id);
       if (dev == nullptr) {
         return MAKE_ERROR(Error::kInvalidSlotID);
       }
+      port_id = dev->DeviceContext()->slot_context.bits.root_hub_port_num;
 
-      auto port_id = dev->DeviceContext()->slot_context.bits.root_hub_port_num;
-
-      if (port_id != addressing_port) {
-        return MAKE_ERROR(Error::kInvalidPhase);
-      }
-      if (port_config_phase[port_id] != ConfigPhase::kAddressingDevice) {
-        return MAKE_ERROR(Error::kInvalidPhase);
-      }
-
-      addressing_port = 0;
-      for (int i = 0; i < port_config_phase.size(); ++i) {
-        if (port_config_phase[i] == ConfigPhase::kWaitingAddressed) {
-          auto port = xhc.PortAt(i);
-          if (auto err = ResetPort(xhc, port); err) {
-            return err;
-          }
-          break;
+      if (issuer_type == AddressDeviceCommandTRB::Type) {
+        if (port_id != addressing_port) {
+          return MAKE_ERROR(Error::kInvalidPhase);
         }
-      }
-
-      return InitializeDevice(xhc, port_id, slot_id);
-    } else if (issuer_type == ConfigureEndpointCommandTRB::Type) {
-      auto dev = xhc.DeviceManager()->FindBySlot(slot_id);
-      if (dev == nullptr) {
-        return MAKE_ERROR(Error::kInvalidSlotID);
-      }
-
-      auto port_id = dev->DeviceContext()->slot_context.bits.root_hub_port_num;
-      if (port_config_phase[port_id] != ConfigPhase::kConfiguringEndpoints) {
+        expected_phase = ConfigPhase::kAddressingDevice;
+      } else if (issuer_type == ConfigureEndpointCommandTRB::Type) {
+        expected_phase = ConfigPhase::kConfiguringEndpoints;
+      } else {
         return MAKE_ERROR(Error::kInvalidPhase);
       }
-
-      return CompleteConfiguration(xhc, port_id, slot_id);
     }
 
-    return MAKE_ERROR(Error::kInvalidPhase);
+    auto& state = ports[port_id];
+    if (port_id == 0 || state.phase != expected_phase) {
+      return MAKE_ERROR(Error::kInvalidPhase);
+    }
+    if (issuer_type == EnableSlotCommandTRB::Type) {
+      state.slot_id = slot_id;
+    }
+    state.completed_cmd = issuer_type;
+    state.event.Signal();
+    return MAKE_ERROR(Error::kSuccess);
   }
 
   void RequestHCOwnership(uintptr_t mmio_base, HCCPARAMS1_Bitmap hccp) {
@@ -333,6 +381,145 @@ namespace {
     Log(kDebug, "SwitchEhci2Xhci: SS = %02, xHCI = %02x\n",
         superspeed_ports, ehci2xhci_ports);
   }
+
+  /** @brief 1 回のバッチで処理するイベント数の上限．これを使い切ったらポーリングに移る． */
+  const uint64_t kPollBudget = 16;
+  /** @brief これを超える割り込みレートになりそうなら IMOD で間引く（回/秒） */
+  const uint64_t kMaxInterruptRate = 2000;
+  /** @brief イベントレートを測る区間（ティック） */
+  const unsigned long kRateWindow = kTimerFreq / 10;
+
+  /** @brief インタラプタ interrupter のイベントを高々 budget 個処理する．
+   *
+   * @return 処理したイベントの数．budget 未満ならイベントリングは空になっている
+   */
+  uint64_t ProcessEvents(int interrupter, uint64_t budget) {
+    LockGuard guard{*xhc_mutex};
+    auto event_ring = controller->EventRingAt(interrupter);
+    uint64_t num_events = 0;
+    while (num_events < budget && event_ring->HasFront()) {
+      if (auto err = ProcessEvent(*controller, interrupter)) {
+        Log(kError, "Error while ProcessEvent: %s at %s:%d\n",
+            err.Name(), err.File(), err.Line());
+      }
+      ++num_events;
+    }
+    return num_events;
+  }
+
+  /** @brief イベントレートに合わせて割り込みの最小間隔（IMOD）を変える．
+   *
+   * レートが kMaxInterruptRate を超えたら割り込みをその頻度まで間引き，
+   * 半分を下回ったら間引きをやめる．低レートの HID では遅延が増えない．
+   */
+  class ModerationControl {
+   public:
+    ModerationControl(int interrupter, InterrupterStat& stat)
+        : interrupter_{interrupter}, stat_{stat} {}
+
+    void AddEvents(uint64_t num_events) {
+      window_events_ += num_events;
+      const unsigned long now = timer_manager->CurrentTick();
+      if (now - window_start_ < kRateWindow) {
+        return;
+      }
+
+      const uint64_t rate = window_events_ * kTimerFreq / (now - window_start_);
+      window_start_ = now;
+      window_events_ = 0;
+
+      uint32_t interval_ns = stat_.imod_interval_ns;
+      if (rate > kMaxInterruptRate) {
+        interval_ns = 1000000000 / kMaxInterruptRate;
+      } else if (rate < kMaxInterruptRate / 2) {
+        interval_ns = 0;
+      }
+      if (interval_ns != stat_.imod_interval_ns) {
+        LockGuard guard{*xhc_mutex};
+        controller->SetInterruptModeration(interrupter_, interval_ns / 250);
+        stat_.imod_interval_ns = interval_ns;
+      }
+    }
+
+   private:
+    const int interrupter_;
+    InterrupterStat& stat_;
+    unsigned long window_start_{0};
+    uint64_t window_events_{0};
+  };
+
+  /** @brief インタラプタ 1 つ分のイベント処理．
+   *
+   * 割り込みハンドラは高優先度のワークキューに処理を入れるだけで，イベントの処理は
+   * ワーカータスクが行う．HID の入力が他の転送やメインタスクの描画を待たずに済む．
+   *
+   * 1 回で処理しきれないほどイベントが溜まっていたら，そのインタラプタの割り込みを
+   * 止め，通常優先度のワークキューに入れ直しながら kPollBudget 個ずつ処理する
+   * （NAPI と同じ考え方）．アプリと交互に進むので，イベントが大量に来ても CPU を
+   * 独占しない．イベントリングが空になったら割り込みを戻す．
+   */
+  class EventPoller {
+   public:
+    EventPoller(int interrupter)
+        : interrupter_{interrupter}, stat_{interrupter_stats[interrupter]},
+          work_{Run, this}, moderation_{interrupter, stat_} {}
+
+    /** @brief 割り込みハンドラから呼ぶ． */
+    void OnInterrupt() {
+      ++stat_.interrupts;
+      from_interrupt_ = true;
+      QueueWork(work_, WorkPriority::kHigh);
+    }
+
+   private:
+    const int interrupter_;
+    InterrupterStat& stat_;
+    Work work_;
+    ModerationControl moderation_;
+    bool polling_{false};
+    volatile bool from_interrupt_{false};
+
+    static void Run(void* arg) {
+      reinterpret_cast<EventPoller*>(arg)->Poll();
+    }
+
+    void Poll() {
+      if (from_interrupt_) {
+        from_interrupt_ = false;
+        const uint64_t latency = ReadTSC() - work_.QueuedTSC();
+        stat_.latency_cycles += latency;
+        stat_.max_latency_cycles = std::max(stat_.max_latency_cycles, latency);
+      }
+
+      const uint64_t num_events = ProcessEvents(interrupter_, kPollBudget);
+      stat_.events += num_events;
+      moderation_.AddEvents(num_events);
+
+      if (num_events == kPollBudget) {
+        if (!polling_) {
+          LockGuard guard{*xhc_mutex};
+          controller->EnableInterrupt(interrupter_, false);
+          polling_ = true;
+        }
+        ++stat_.polls;
+        QueueWork(work_, WorkPriority::kNormal);
+        return;
+      }
+      if (!polling_) {
+        return;
+      }
+
+      // 割り込みを戻す前に届いたイベントは割り込みにならないので，戻した後に確かめる
+      LockGuard guard{*xhc_mutex};
+      controller->EnableInterrupt(interrupter_, true);
+      polling_ = false;
+      if (controller->EventRingAt(interrupter_)->HasFront()) {
+        QueueWork(work_, WorkPriority::kHigh);
+      }
+    }
+  };
+
+  std::array<EventPoller*, kMaxInterrupters> pollers{};
 } // namespace
 
 namespace usb::xhci {
@@ -346,7 +533,7 @@ namespace usb::xhci {
             cap_->HCSPARAMS1.Read().bits.max_ports)} {
   }
 
-  Error Controller::Initialize() {
+  Error Controller::Initialize(int num_interrupters) {
     if (auto err = devmgr_.Initialize(kDeviceSize)) {
       return err;
     }
@@ -403,21 +590,27 @@ namespace usb::xhci {
     dcbaap.SetPointer(reinterpret_cast<uint64_t>(devmgr_.DeviceContexts()));
     op_->DCBAAP.Write(dcbaap);
 
-    auto primary_interrupter = &InterrupterRegisterSets()[0];
     if (auto err = cr_.Initialize(32)) {
         return err;
     }
     if (auto err = RegisterCommandRing(&cr_, &op_->CRCR)) {
         return err; }
-    if (auto err = er_.Initialize(32, primary_interrupter)) {
+
+    const int max_interrupters = cap_->HCSPARAMS1.Read().bits.max_interrupters;
+    num_interrupters_ = std::clamp(
+        num_interrupters, 1, std::min(kMaxInterrupters, max_interrupters));
+    for (int i = 0; i < num_interrupters_; ++i) {
+      auto interrupter = &InterrupterRegisterSets()[i];
+      if (auto err = er_[i].Initialize(32, interrupter)) {
         return err;
-    }
+      }
 
-    // Enable interrupt for the primary interrupter
-    auto iman = primary_interrupter->IMAN.Read();
-    iman.bits.interrupt_pending = true;
-    iman.bits.interrupt_enable = true;
-    primary_interrupter->IMAN.Write(iman);
+      // Enable interrupt for the interrupter
+      auto iman = interrupter->IMAN.Read();
+      iman.bits.interrupt_pending = true;
+      iman.bits.interrupt_enable = true;
+      interrupter->IMAN.Write(iman);
+    }
 
     // Enable interrupt for the controller
     usbcmd = op_->USBCMD.Read();
@@ -439,13 +632,30 @@ namespace usb::xhci {
     return MAKE_ERROR(Error::kSuccess);
   }
 
+  void Controller::EnableInterrupt(int interrupter, bool enable) {
+    auto& regs = InterrupterRegisterSets()[interrupter];
+    auto iman = regs.IMAN.Read();
+    iman.bits.interrupt_pending = true; // 1 を書くとクリアされる
+    iman.bits.interrupt_enable = enable;
+    regs.IMAN.Write(iman);
+  }
+
+  void Controller::SetInterruptModeration(int interrupter, uint16_t interval) {
+    auto& regs = InterrupterRegisterSets()[interrupter];
+    auto imod = regs.IMOD.Read();
+    imod.bits.interrupt_moderation_interval = interval;
+    regs.IMOD.Write(imod);
+  }
+
   DoorbellRegister* Controller::DoorbellRegisterAt(uint8_t index) {
     return &DoorbellRegisters()[index];
   }
 
   Error ConfigurePort(Controller& xhc, Port& port) {
-    if (port_config_phase[port.Number()] == ConfigPhase::kNotConnected) {
-      return ResetPort(xhc, port);
+    auto& state = ports[port.Number()];
+    if (state.phase == ConfigPhase::kNotConnected && port.IsConnected()) {
+      state.phase = ConfigPhase::kWaitingAddressed;
+      StartFiber<PortConfigFiber>(xhc, port.Number());
     }
     return MAKE_ERROR(Error::kSuccess);
   }
@@ -506,7 +716,7 @@ namespace usb::xhci {
       ep_ctx->bits.error_count = 3;
     }
 
-    port_config_phase[port_id] = ConfigPhase::kConfiguringEndpoints;
+    ports[port_id].phase = ConfigPhase::kConfiguringEndpoints;
 
     ConfigureEndpointCommandTRB cmd{dev.InputContext(), dev.SlotID()};
     xhc.CommandRing()->Push(cmd);
@@ -515,13 +725,14 @@ namespace usb::xhci {
     return MAKE_ERROR(Error::kSuccess);
   }
 
-  Error ProcessEvent(Controller& xhc) {
-    if (!xhc.PrimaryEventRing()->HasFront()) {
+  Error ProcessEvent(Controller& xhc, int interrupter) {
+    auto event_ring = xhc.EventRingAt(interrupter);
+    if (!event_ring->HasFront()) {
       return MAKE_ERROR(Error::kSuccess);
     }
 
     Error err = MAKE_ERROR(Error::kNotImplemented);
-    auto event_trb = xhc.PrimaryEventRing()->Front();
+    auto event_trb = event_ring->Front();
     if (auto trb = TRBDynamicCast<TransferEventTRB>(event_trb)) {
       err = OnEvent(xhc, *trb);
     } else if (auto trb = TRBDynamicCast<PortStatusChangeEventTRB>(event_trb)) {
@@ -529,14 +740,35 @@ namespace usb::xhci {
     } else if (auto trb = TRBDynamicCast<CommandCompletionEventTRB>(event_trb)) {
       err = OnEvent(xhc, *trb);
     }
-    xhc.PrimaryEventRing()->Pop();
+    event_ring->Pop();
 
     return err;
   }
 
+  unsigned int InterrupterFor(EndpointType type) {
+    unsigned int interrupter = 0;
+    switch (type) {
+    case EndpointType::kControl:     interrupter = 0; break;
+    case EndpointType::kInterrupt:   interrupter = 1; break;
+    case EndpointType::kBulk:        interrupter = 2; break;
+    case EndpointType::kIsochronous: interrupter = 3; break;
+    }
+    if (controller == nullptr || interrupter >= controller->NumInterrupters()) {
+      return 0;
+    }
+    return interrupter;
+  }
+
   Controller* controller;
 
+  uint64_t PortConfigCycles(uint8_t port_id) {
+    return ports[port_id].phase == ConfigPhase::kConfigured
+      ? ports[port_id].config_cycles : 0;
+  }
+
   void Initialize() {
+    xhc_mutex = new Mutex{"xhci"};
+
     // Intel 製を優先して xHC を探す
     pci::Device* xhc_dev = nullptr;
     for (int i = 0; i < pci::num_device; ++i) {
@@ -557,12 +789,17 @@ namespace usb::xhci {
       exit(1);
     }
 
-    const uint8_t bsp_local_apic_id =
-      *reinterpret_cast<const uint32_t*>(0xfee00020) >> 24;
-    pci::ConfigureMSIFixedDestination(
+    // インタラプタ i にはベクタ kXHCI + i が割り当たる
+    const uint8_t bsp_local_apic_id = LAPICID();
+    static_assert(kMaxInterrupters == 1 << 2);
+    auto [ num_vectors, msi_err ] = pci::ConfigureMSIFixedDestination(
         *xhc_dev, bsp_local_apic_id,
         pci::MSITriggerMode::kLevel, pci::MSIDeliveryMode::kFixed,
-        InterruptVector::kXHCI, 0);
+        InterruptVector::kXHCI, 2);
+    if (msi_err) {
+      Log(kError, "failed to configure MSI: %s\n", msi_err.Name());
+      num_vectors = 1;
+    }
 
     const WithError<uint64_t> xhc_bar = pci::ReadBar(*xhc_dev, 0);
     Log(kDebug, "ReadBar: %s\n", xhc_bar.error.Name());
@@ -575,14 +812,20 @@ namespace usb::xhci {
     if (0x8086 == pci::ReadVendorId(*xhc_dev)) {
       SwitchEhci2Xhci(*xhc_dev);
     }
-    if (auto err = xhc.Initialize()) {
+    if (auto err = xhc.Initialize(num_vectors)) {
       Log(kError, "xhc initialize failed: %s\n", err.Name());
       exit(1);
     }
 
-    Log(kInfo, "xHC starting\n");
+    // イベントが届き始める前に，それを処理する準備をしておく
+    for (int i = 0; i < xhc.NumInterrupters(); ++i) {
+      pollers[i] = new EventPoller{i};
+    }
+
+    Log(kInfo, "xHC starting with %d interrupters\n", xhc.NumInterrupters());
     xhc.Run();
 
+    LockGuard guard{*xhc_mutex};
     for (int i = 1; i <= xhc.MaxPorts(); ++i) {
       auto port = xhc.PortAt(i);
       Log(kDebug, "Port %d: IsConnected=%d\n", i, port.IsConnected());
@@ -597,12 +840,13 @@ namespace usb::xhci {
     }
   }
 
-  void ProcessEvents() {
-    while (controller->PrimaryEventRing()->HasFront()) {
-      if (auto err = ProcessEvent(*controller)) {
-        Log(kError, "Error while ProcessEvent: %s at %s:%d\n",
-            err.Name(), err.File(), err.Line());
-      }
+  void OnInterrupt(int interrupter) {
+    if (auto poller = pollers[interrupter]) {
+      poller->OnInterrupt();
     }
   }
+
+  InterrupterStat GetInterrupterStat(int interrupter) {
+    return interrupter_stats[interrupter];
+  }
 }
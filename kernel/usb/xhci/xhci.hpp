@@ -6,8 +6,10 @@
 
 #pragma once
 
+#include <array>
 #include <memory>
 #include "error.hpp"
+#include "usb/endpoint.hpp"
 #include "usb/xhci/registers.hpp"
 #include "usb/xhci/context.hpp"
 #include "usb/xhci/ring.hpp"
@@ -15,13 +17,26 @@
 #include "usb/xhci/devmgr.hpp"
 
 namespace usb::xhci {
+  /** @brief 使うインタラプタの数の上限．インタラプタごとにイベントリングと割り込みベクタを持つ． */
+  const int kMaxInterrupters = 4;
+
   class Controller {
    public:
     Controller(uintptr_t mmio_base);
-    Error Initialize();
+    /** @brief コントローラをリセットし，インタラプタ 0 から num_interrupters 個を有効にする．
+     *
+     * xHC が持つインタラプタが少なければ，そちらに合わせて減らす．
+     */
+    Error Initialize(int num_interrupters);
     Error Run();
     Ring* CommandRing() { return &cr_; }
-    EventRing* PrimaryEventRing() { return &er_; }
+    EventRing* PrimaryEventRing() { return &er_[0]; }
+    EventRing* EventRingAt(int interrupter) { return &er_[interrupter]; }
+    int NumInterrupters() const { return num_interrupters_; }
+    /** @brief インタラプタの割り込みを許可・禁止する．禁止してもイベントはイベントリングに積まれる． */
+    void EnableInterrupt(int interrupter, bool enable);
+    /** @brief インタラプタが割り込みを起こす最小間隔を 250ns 単位で設定する．0 なら間引かない． */
+    void SetInterruptModeration(int interrupter, uint16_t interval);
     DoorbellRegister* DoorbellRegisterAt(uint8_t index);
     Port PortAt(uint8_t port_num) {
       return Port{port_num, PortRegisterSets()[port_num - 1]};
@@ -39,7 +54,8 @@ namespace usb::xhci {
 
     class DeviceManager devmgr_;
     Ring cr_;
-    EventRing er_;
+    std::array<EventRing, kMaxInterrupters> er_;
+    int num_interrupters_{1};
 
     InterrupterRegisterSetArray InterrupterRegisterSets() const {
       return {mmio_base_ + cap_->RTSOFF.Read().Offset() + 0x20u, 1024};
@@ -59,14 +75,41 @@ namespace usb::xhci {
 
   /** @brief イベントリングに登録されたイベントを高々1つ処理する．
    *
-   * xhc のプライマリイベントリングの先頭のイベントを処理する．
+   * xhc のインタラプタ interrupter のイベントリングの先頭のイベントを処理する．
    * イベントが無ければ即座に Error::kSuccess を返す．
    *
    * @return イベントを正常に処理できたら Error::kSuccess
    */
-  Error ProcessEvent(Controller& xhc);
+  Error ProcessEvent(Controller& xhc, int interrupter);
+
+  /** @brief 転送の種類 type の完了イベントを受け取るインタラプタを返す．
+   *
+   * コマンドの完了とポートの状態変化は必ずインタラプタ 0 に届くので，デバイスの設定に
+   * 使うコントロール転送も 0 とする．インタラプト転送（HID），バルク転送（マスストレージ），
+   * アイソクロナス転送はそれぞれ別のインタラプタとし，互いを待たずに処理できるようにする．
+   * 有効なインタラプタが足りなければ 0 を返す．
+   */
+  unsigned int InterrupterFor(EndpointType type);
+
+  /** @brief インタラプタごとの割り込み処理の統計 */
+  struct InterrupterStat {
+    uint64_t interrupts;         // 受け取った割り込みの数
+    uint64_t events;             // 処理したイベントの数
+    uint64_t latency_cycles;     // 割り込みからイベント処理を始めるまでの TSC サイクル数の合計
+    uint64_t max_latency_cycles;
+    uint64_t polls;              // 割り込みを止めてポーリングで処理したバッチの数
+    uint32_t imod_interval_ns;   // いま設定している割り込みの最小間隔
+  };
 
   extern Controller* controller;
+  /** @brief ポートの設定開始から完了までにかかった TSC サイクル数．未完了なら 0 */
+  uint64_t PortConfigCycles(uint8_t port_id);
+  /** @brief xHC を初期化する．
+   *
+   * イベントの処理はワークキューで行うので InitializeWorkQueue の後に呼ぶ．
+   */
   void Initialize();
-  void ProcessEvents();
+  /** @brief インタラプタ interrupter の割り込みハンドラから呼び，イベントの処理を予約する． */
+  void OnInterrupt(int interrupter);
+  InterrupterStat GetInterrupterStat(int interrupter);
 }
@@ -0,0 +1,31 @@
+#include "wait_queue.hpp"
+
+#include <algorithm>
+
+#include "task.hpp"
+
+void WaitQueue::Add(Task* task) {
+  if (std::find(waiters_.begin(), waiters_.end(), task) == waiters_.end()) {
+    waiters_.push_back(task);
+  }
+}
+
+void WaitQueue::Remove(Task* task) {
+  auto it = std::find(waiters_.begin(), waiters_.end(), task);
+  if (it != waiters_.end()) {
+    waiters_.erase(it);
+  }
+}
+
+void WaitQueue::Sleep() {
+  Task* task = &task_manager->CurrentTask();
+  Add(task);
+  task->Sleep();
+  Remove(task);
+}
+
+void WaitQueue::WakeupAll() {
+  for (Task* task : waiters_) {
+    task->Wakeup();
+  }
+}
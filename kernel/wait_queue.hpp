@@ -0,0 +1,30 @@
+/**
+ * @file wait_queue.hpp
+ *
+ * 状態の変化を待つタスクの待ち行列．
+ */
+
+#pragma once
+
+#include <vector>
+
+class Task;
+
+/** @brief 状態の変化を待つタスクを登録しておき，変化したときにまとめて起こす．
+ *
+ * 条件の確認から Sleep までを割り込み禁止状態で行えば起床を取りこぼさない．
+ * 起きたタスクは条件を確認し直すこと．
+ */
+class WaitQueue {
+ public:
+  /** @brief task を登録する．登録済みなら何もしない． */
+  void Add(Task* task);
+  void Remove(Task* task);
+  /** @brief 現在のタスクを登録して眠り，起きたら登録を外す．割り込み禁止状態で呼ぶ． */
+  void Sleep();
+  /** @brief 登録されているタスクをすべて起こす．登録は各タスクが外す． */
+  void WakeupAll();
+
+ private:
+  std::vector<Task*> waiters_{};
+};
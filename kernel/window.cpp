@@ -1,5 +1,7 @@
 #include "window.hpp"
 
+#include <algorithm>
+
 #include "logger.hpp"
 #include "font.hpp"
 
@@ -71,11 +73,12 @@ void Window::DrawTo(FrameBuffer& dst, Vector2D<int> pos, const Rectangle<int>& a
 
   const auto tc = transparent_color_.value();
   auto& writer = dst.Writer();
-  for (int y = std::max(0, 0 - pos.y);
-       y < std::min(Height(), writer.Height() - pos.y);
+  const auto area_end = area.pos + area.size;
+  for (int y = std::max({0, 0 - pos.y, area.pos.y - pos.y});
+       y < std::min({Height(), writer.Height() - pos.y, area_end.y - pos.y});
        ++y) {
-    for (int x = std::max(0, 0 - pos.x);
-         x < std::min(Width(), writer.Width() - pos.x);
+    for (int x = std::max({0, 0 - pos.x, area.pos.x - pos.x});
+         x < std::min({Width(), writer.Width() - pos.x, area_end.x - pos.x});
          ++x) {
       const auto c = At(Vector2D<int>{x, y});
       if (c != tc) {
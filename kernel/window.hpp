@@ -58,6 +58,8 @@ class Window {
   void DrawTo(FrameBuffer& dst, Vector2D<int> pos, const Rectangle<int>& area);
   /** @brief 透過色を設定する。 */
   void SetTransparentColor(std::optional<PixelColor> c);
+  /** @brief 透過色がなく，表示領域の全体で下のレイヤーを隠すなら true を返す。 */
+  bool IsOpaque() const { return !transparent_color_; }
   /** @brief このインスタンスに紐付いた WindowWriter を取得する。 */
   WindowWriter* Writer();
 
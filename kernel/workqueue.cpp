@@ -0,0 +1,161 @@
+#include "workqueue.hpp"
+
+#include <algorithm>
+
+#include "asmfunc.h"
+#include "irqtrace.hpp"
+#include "lock.hpp"
+#include "task.hpp"
+
+namespace {
+  std::array<DeferredStat, kNumDeferredStages> stats{};
+
+  DeferredStat& HardirqStat() { return stats[0]; }
+  DeferredStat& SoftirqStat(int type) { return stats[1 + type]; }
+  DeferredStat& WorkStat(int priority) { return stats[1 + kNumSoftirqs + priority]; }
+
+  void Account(DeferredStat& stat, uint64_t cycles) {
+    ++stat.count;
+    stat.cycles += cycles;
+    stat.max_cycles = std::max(stat.max_cycles, cycles);
+  }
+
+  std::array<SoftirqHandler*, kNumSoftirqs> softirq_handlers{};
+  uint32_t softirq_pending;
+}
+
+/** @brief 優先度 1 つ分のワークキュー．専用のタスクが先頭から順に実行する． */
+class WorkQueue {
+ public:
+  WorkQueue(const char* name, DeferredStat& stat) : lock_{name}, stat_{stat} {}
+
+  void SetWorker(Task* worker) { worker_ = worker; }
+
+  bool Push(Work& work) {
+    {
+      LockGuard guard{lock_};
+      if (work.queued_) {
+        return false;
+      }
+      work.queued_ = true;
+      work.queued_tsc_ = ReadTSC();
+      work.next_ = nullptr;
+      if (tail_) {
+        tail_->next_ = &work;
+      } else {
+        head_ = &work;
+      }
+      tail_ = &work;
+    }
+    if (worker_) {
+      task_manager->Wakeup(worker_);
+    }
+    return true;
+  }
+
+  /** @brief キューが空になるまで実行し続ける．ワーカータスクの本体． */
+  void Run(Task& task) {
+    while (true) {
+      DisableInterrupts();
+      Work* work = Pop();
+      if (work == nullptr) {
+        task.Sleep();
+        EnableInterrupts();
+        continue;
+      }
+      EnableInterrupts();
+
+      const uint64_t start = ReadTSC();
+      const uint64_t latency = start - work->queued_tsc_;
+      stat_.latency_cycles += latency;
+      stat_.max_latency_cycles = std::max(stat_.max_latency_cycles, latency);
+      work->func_(work->arg_);
+      Account(stat_, ReadTSC() - start);
+    }
+  }
+
+ private:
+  SpinLock lock_;
+  DeferredStat& stat_;
+  Task* worker_{nullptr};
+  Work* head_{nullptr};
+  Work* tail_{nullptr};
+
+  /** @brief 先頭を取り出す．取り出した時点で queued_ を下ろすので，実行中に入れ直せる． */
+  Work* Pop() {
+    LockGuard guard{lock_};
+    Work* work = head_;
+    if (work) {
+      head_ = work->next_;
+      if (head_ == nullptr) {
+        tail_ = nullptr;
+      }
+      work->queued_ = false;
+    }
+    return work;
+  }
+};
+
+namespace {
+  std::array<WorkQueue*, kNumWorkPriorities> work_queues{};
+
+  void TaskWorker(uint64_t task_id, int64_t data) {
+    DisableInterrupts();
+    Task& task = task_manager->CurrentTask();
+    EnableInterrupts();
+    work_queues[data]->Run(task);
+  }
+}
+
+void InitializeWorkQueue() {
+  const char* names[kNumWorkPriorities] = { "work:high", "work:normal" };
+  const int levels[kNumWorkPriorities] = { TaskManager::kMaxLevel, Task::kDefaultLevel };
+
+  HardirqStat().name = "hardirq";
+  SoftirqStat(static_cast<int>(Softirq::kTimer)).name = "softirq:timer";
+  for (int i = 0; i < kNumWorkPriorities; ++i) {
+    WorkStat(i).name = names[i];
+    work_queues[i] = new WorkQueue{names[i], WorkStat(i)};
+  }
+
+  for (int i = 0; i < kNumWorkPriorities; ++i) {
+    auto& worker = task_manager->NewTask().InitContext(TaskWorker, i);
+    work_queues[i]->SetWorker(&worker);
+    task_manager->Wakeup(&worker, levels[i]);
+  }
+}
+
+bool QueueWork(Work& work, WorkPriority priority) {
+  return work_queues[static_cast<int>(priority)]->Push(work);
+}
+
+void OpenSoftirq(Softirq type, SoftirqHandler* handler) {
+  softirq_handlers[static_cast<int>(type)] = handler;
+}
+
+void RaiseSoftirq(Softirq type) {
+  softirq_pending |= 1u << static_cast<int>(type);
+}
+
+void IrqExit(uint64_t entry_tsc) {
+  uint64_t start = ReadTSC();
+  Account(HardirqStat(), start - entry_tsc);
+
+  while (softirq_pending) {
+    const int type = __builtin_ctz(softirq_pending);
+    softirq_pending &= ~(1u << type);
+    if (auto handler = softirq_handlers[type]) {
+      handler();
+    }
+    const uint64_t end = ReadTSC();
+    Account(SoftirqStat(type), end - start);
+    start = end;
+  }
+}
+
+std::array<DeferredStat, kNumDeferredStages> DeferredStats() {
+  DisableInterrupts();
+  auto copy = stats;
+  EnableInterrupts();
+  return copy;
+}
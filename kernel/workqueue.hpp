@@ -0,0 +1,89 @@
+/**
+ * @file workqueue.hpp
+ *
+ * 割り込みで始まった処理を後回しにして実行する仕組み（ボトムハーフ）．
+ *
+ * 割り込みハンドラ本体（ハード割り込み）は最小限のことだけをして，残りを次のどちらかに回す．
+ * - ソフト割り込み：ハンドラから戻る直前に，割り込みを禁止したまま実行する．短い処理に限る．
+ * - ワークキュー：優先度ごとの専用タスクが実行する．割り込みを許可して動き，眠ってもよい．
+ * どの段で費やした時間も DeferredStats で分かる．
+ */
+
+#pragma once
+
+#include <array>
+#include <cstdint>
+
+/** @brief ワークキューで実行する処理 1 つ．キューに入っている間は破棄しないこと． */
+class Work {
+ public:
+  using Func = void (void* arg);
+
+  Work(Func* func, void* arg) : func_{func}, arg_{arg} {}
+  Work(const Work&) = delete;
+  Work& operator=(const Work&) = delete;
+
+  /** @brief 最後にキューへ入った時点の TSC */
+  uint64_t QueuedTSC() const { return queued_tsc_; }
+
+ private:
+  Func* const func_;
+  void* const arg_;
+  bool queued_{false};
+  uint64_t queued_tsc_{0};
+  Work* next_{nullptr};
+
+  friend class WorkQueue;
+};
+
+enum class WorkPriority {
+  kHigh,   // 最高レベルのタスクが実行する．入力などの遅延を抑えたい処理
+  kNormal, // 通常レベルのタスクが実行する．アプリと交互に進めたい重い処理
+};
+const int kNumWorkPriorities = 2;
+
+/** @brief 各優先度のワークキューと，それを実行するタスクを作る．
+ *
+ * タスクを作るので InitializeTask の後に呼ぶ．
+ */
+void InitializeWorkQueue();
+
+/** @brief work をキューの末尾に入れる．割り込みハンドラからも呼べる．
+ *
+ * 実行中の work が自分自身を入れ直すこともできる．
+ *
+ * @return すでにキューに入っていれば何もせず false
+ */
+bool QueueWork(Work& work, WorkPriority priority);
+
+enum class Softirq {
+  kTimer, // タイマーホイールを進め，期限の来たタイマーを発火させる
+};
+const int kNumSoftirqs = 1;
+
+using SoftirqHandler = void ();
+
+/** @brief ソフト割り込み type の処理を登録する． */
+void OpenSoftirq(Softirq type, SoftirqHandler* handler);
+/** @brief ソフト割り込み type を実行待ちにする．割り込みを禁止して呼ぶこと． */
+void RaiseSoftirq(Softirq type);
+/** @brief 割り込みハンドラの終わりに，割り込みを禁止したまま呼ぶ．
+ *
+ * entry_tsc（ハンドラに入った時点の TSC）からの時間をハード割り込みの時間として記録し，
+ * 実行待ちのソフト割り込みを実行する．
+ */
+void IrqExit(uint64_t entry_tsc);
+
+/** @brief 処理の段ごとの統計．時間は TSC のサイクル数 */
+struct DeferredStat {
+  const char* name;
+  uint64_t count;
+  uint64_t cycles;
+  uint64_t max_cycles;
+  uint64_t latency_cycles;     // 要求されてから実行を始めるまで（ワークキューのみ）
+  uint64_t max_latency_cycles;
+};
+
+/** @brief ハード割り込み，各ソフト割り込み，各ワークキューの順に並べた統計 */
+const int kNumDeferredStages = 1 + kNumSoftirqs + kNumWorkPriorities;
+std::array<DeferredStat, kNumDeferredStages> DeferredStats();